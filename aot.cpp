@@ -0,0 +1,351 @@
+// chip8_aot: translates a program to a C++ translation unit ahead of time.
+// Code is discovered by following control flow from CHIP8_PROGRAM_OFFSET;
+// see chip8_aot.h for how the result runs.
+
+#include "chip8.h"
+#include "chip8_flow.h"
+#include "chip8_ops.h"
+#include "hash.h"
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+#define PROGRAM_OFFSET CHIP8_PROGRAM_OFFSET
+
+enum { NOT_TRANSLATED, TRANSLATED, ENDS_BLOCK };
+
+struct Program {
+    uint8_t M[MEMORY_SIZE]; // memory as chip8_machine_init leaves it, font aside
+    uint32_t end; // one past the last program byte
+    uint32_t quirks;
+    Chip8Flow flow; // leaders include re-entry points, see discover
+};
+
+static bool read_file(const char *path, std::vector<uint8_t> *content) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    content->resize(size > 0 ? size : 0);
+    bool ok = fread(content->data(), 1, content->size(), file) == content->size();
+    fclose(file);
+    return ok;
+}
+
+static bool in_program(const Program *p, uint32_t addr) {
+    return addr >= PROGRAM_OFFSET && addr + 1 < p->end;
+}
+
+// Whether the instruction at pc gets translated, and whether it ends a block.
+// Idle loops stay with the interpreter, which skips them, as do Fx0A and
+// instructions the profile does not have.
+static uint32_t classify(const Program *p, uint32_t pc) {
+    const uint8_t hi = p->M[pc];
+    const uint8_t lo = p->M[pc + 1];
+    const uint16_t nnn = ((hi & 0xF) << 8) | lo;
+    if (!chip8_op_exists(hi, lo, p->quirks)) return NOT_TRANSLATED;
+    switch (hi >> 4) {
+        case 0x0: return lo == 0xEE ? ENDS_BLOCK : TRANSLATED;
+        case 0x1: return nnn != pc ? ENDS_BLOCK : NOT_TRANSLATED;
+        case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xB: case 0xE: return ENDS_BLOCK;
+        case 0xF:
+            switch (lo) {
+                case 0x07: return chip8_is_timer_poll(p->M, pc) ? NOT_TRANSLATED : TRANSLATED;
+                case 0x0A: return NOT_TRANSLATED;
+                case 0x33: case 0x55: return ENDS_BLOCK;
+            }
+            return TRANSLATED;
+    }
+    return TRANSLATED;
+}
+
+static bool has_label(const Program *p, uint32_t addr) {
+    return in_program(p, addr) && p->flow.code[addr] && classify(p, addr) != NOT_TRANSLATED;
+}
+
+// chip8_flow marks the targets of jumps, calls and skips as leaders. Blocks
+// also have to start behind Fx instructions that leave translated code: Fx0A
+// and timer polls return to the interpreter, Fx33 and Fx55 may have
+// overwritten what follows them.
+static void discover(Program *p) {
+    chip8_flow_discover(p->M, PROGRAM_OFFSET, p->end, p->quirks, &p->flow);
+    for (uint32_t pc = PROGRAM_OFFSET; pc < p->end; ++pc) {
+        if (p->flow.code[pc] && (p->M[pc] >> 4) == 0xF && classify(p, pc) != TRANSLATED && in_program(p, pc + 2)) {
+            p->flow.leader[pc + 2] = true;
+        }
+    }
+}
+
+static void emit_target(FILE *out, const Program *p, uint32_t addr) {
+    fprintf(out, "%s(0x%03X);", has_label(p, addr) ? "GOTO" : "LEAVE", addr);
+}
+
+// Emits the instruction at pc, which must behave exactly like the
+// interpreter's handler for the same Quirks.
+template <typename Quirks>
+static void emit_op(FILE *out, const Program *p, uint32_t pc) {
+    const uint8_t hi = p->M[pc];
+    const uint8_t lo = p->M[pc + 1];
+    const uint8_t x = hi & 0xF;
+    const uint8_t y = lo >> 4;
+    const uint16_t nnn = ((hi & 0xF) << 8) | lo;
+    const uint32_t next = pc + 2;
+    const uint32_t skip = pc + 4;
+    static const char *const alu[16] = {
+        NULL, "chip8_op_or", "chip8_op_and", "chip8_op_xor", "chip8_op_add_v", "chip8_op_sub", "chip8_op_shr",
+        "chip8_op_subn", NULL, NULL, NULL, NULL, NULL, NULL, "chip8_op_shl", NULL,
+    };
+
+    fprintf(out, "L_0x%03X: STEP(0x%03X); ", pc, pc);
+    switch (hi >> 4) {
+        case 0x0:
+            if (lo == 0xE0) fprintf(out, "chip8_op_cls(c8);");
+            else fprintf(out, "if (c8->SP == 0) TRAP(0x%03X); pc = c8->stack[--c8->SP]; goto dispatch;", pc);
+            break;
+        case 0x1:
+            emit_target(out, p, nnn);
+            break;
+        case 0x2:
+            fprintf(out, "if (c8->SP >= CHIP8_STACK_SIZE) TRAP(0x%03X); c8->stack[c8->SP++] = 0x%03X; ", pc, next);
+            emit_target(out, p, nnn);
+            break;
+        case 0x3: case 0x4:
+            fprintf(out, "if (V[0x%X] %s 0x%02X) ", x, (hi >> 4) == 0x3 ? "==" : "!=", lo);
+            emit_target(out, p, skip);
+            fprintf(out, " ");
+            emit_target(out, p, next);
+            break;
+        case 0x5: case 0x9:
+            // A register always equals itself, so 5xx0 always skips and 9xx0 never does.
+            if (x == y) {
+                emit_target(out, p, (hi >> 4) == 0x5 ? skip : next);
+                break;
+            }
+            fprintf(out, "if (V[0x%X] %s V[0x%X]) ", x, (hi >> 4) == 0x5 ? "==" : "!=", y);
+            emit_target(out, p, skip);
+            fprintf(out, " ");
+            emit_target(out, p, next);
+            break;
+        case 0x6: fprintf(out, "V[0x%X] = 0x%02X;", x, lo); break;
+        case 0x7: fprintf(out, "V[0x%X] += 0x%02X;", x, lo); break;
+        case 0x8:
+            if ((lo & 0xF) == 0) fprintf(out, "V[0x%X] = V[0x%X];", x, y);
+            else fprintf(out, "%s<Q>(V, 0x%X, 0x%X);", alu[lo & 0xF], x, y);
+            break;
+        case 0xA: fprintf(out, "c8->I = 0x%03X;", nnn); break;
+        case 0xB:
+            fprintf(out, "pc = (0x%03X + V[0x%X]) & 0xFFF; goto dispatch;", nnn, Quirks::jump_vx ? x : 0);
+            break;
+        case 0xC: fprintf(out, "chip8_op_rnd(c8, 0x%X, 0x%02X);", x, lo); break;
+        case 0xD:
+            fprintf(out, "if (!chip8_in_memory(c8, %u)) TRAP(0x%03X); ", lo & 0xF, pc);
+            fprintf(out, "chip8_op_drw<Q>(c8, 0x%X, 0x%X, %u);", x, y, lo & 0xF);
+            break;
+        case 0xE:
+            fprintf(out, "if (V[0x%X] > 0xF) TRAP(0x%03X); ", x, pc);
+            fprintf(out, "c8->key_reads++; ");
+            fprintf(out, "if (%skeys[V[0x%X]]) ", lo == 0x9E ? "" : "!", x);
+            emit_target(out, p, skip);
+            fprintf(out, " ");
+            emit_target(out, p, next);
+            break;
+        case 0xF:
+            switch (lo) {
+                case 0x07: fprintf(out, "V[0x%X] = c8->delay_timer;", x); break;
+                case 0x15: fprintf(out, "c8->delay_timer = V[0x%X];", x); break;
+                case 0x18: fprintf(out, "c8->sound_timer = V[0x%X];", x); break;
+                case 0x1E: fprintf(out, "c8->I += V[0x%X];", x); break;
+                case 0x29: fprintf(out, "c8->I = 5 * V[0x%X];", x); break;
+                case 0x65:
+                    fprintf(out, "if (!chip8_in_memory(c8, %u)) TRAP(0x%03X); chip8_op_load<Q>(c8, 0x%X);", x + 1, pc, x);
+                    break;
+                case 0x33: case 0x55:
+                    fprintf(out, "if (!chip8_in_memory(c8, %u)) TRAP(0x%03X); ", lo == 0x33 ? 3 : x + 1, pc);
+                    fprintf(out, "{ const uint16_t I = c8->I; ");
+                    if (lo == 0x33) fprintf(out, "chip8_op_bcd(c8, 0x%X); ", x);
+                    else fprintf(out, "chip8_op_store<Q>(c8, 0x%X); ", x);
+                    fprintf(out, "if (chip8_aot_code_written(aot, c8, I, %u)) LEAVE(0x%03X); } ", lo == 0x33 ? 3 : x + 1, next);
+                    emit_target(out, p, next);
+                    break;
+            }
+            break;
+    }
+    fprintf(out, " // %02X%02X\n", hi, lo);
+}
+
+static const char *quirks_type(uint32_t quirks) {
+    switch (quirks) {
+        case CHIP8_QUIRKS_VIP: return "QuirksVip";
+        case CHIP8_QUIRKS_CHIP48: return "QuirksChip48";
+        case CHIP8_QUIRKS_SCHIP: return "QuirksSchip";
+        default: return "QuirksLegacy";
+    }
+}
+
+template <typename Quirks>
+static void translate(FILE *out, Program *p, const char *name, uint32_t quirks) {
+    discover(p);
+
+    // Blocks start at leaders and run until an instruction that ends them or
+    // that falls through into another leader or untranslated code.
+    std::vector<uint32_t> starts;
+    bool uses_dispatch = false;
+    for (uint32_t addr = PROGRAM_OFFSET; addr < p->end; ++addr) {
+        if (!has_label(p, addr)) continue;
+        if (p->flow.leader[addr]) starts.push_back(addr);
+        const uint8_t kind = p->M[addr] >> 4;
+        uses_dispatch |= (p->M[addr] == 0x00 && p->M[addr + 1] == 0xEE) || kind == 0xB;
+    }
+
+    const uint32_t size = p->end - PROGRAM_OFFSET;
+    const uint8_t *image = p->M + PROGRAM_OFFSET;
+    fprintf(out, "// Generated by chip8_aot from %s for the %s quirks. Do not edit.\n\n", name, chip8_quirks_name(quirks));
+    fprintf(out, "#include \"chip8_aot.h\"\n#include \"chip8_ops.h\"\n\n");
+    fprintf(out, "typedef %s Q;\n\n", quirks_type(quirks));
+
+    fprintf(out, "static const uint8_t image[%u] = {", size);
+    for (uint32_t i = 0; i < size; ++i) fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", image[i]);
+    fprintf(out, "\n};\n\n");
+
+    std::vector<uint32_t> lengths;
+    for (uint32_t start : starts) {
+        uint32_t pc = start;
+        uint32_t length = 1;
+        while (classify(p, pc) == TRANSLATED && has_label(p, pc + 2) && !p->flow.leader[pc + 2]) {
+            pc += 2;
+            length++;
+        }
+        lengths.push_back(length);
+    }
+    fprintf(out, "// Start address and instruction count of every block.\n");
+    fprintf(out, "static const uint16_t blocks[] = {\n");
+    for (uint32_t b = 0; b < starts.size(); ++b) fprintf(out, "    0x%03X, %u,\n", starts[b], lengths[b]);
+    if (starts.empty()) fprintf(out, "    0, 0, // nothing translated\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out,
+        "// Uses up a cycle for the instruction at addr, or leaves when there is none left.\n"
+        "#define STEP(addr) do { if (budget == 0) { pc = addr; goto leave; } budget--; } while (0)\n"
+        "// Continues at a translated address while its block is intact.\n"
+        "#define GOTO(addr) do { pc = addr; if (!valid[addr]) goto leave; goto L_##addr; } while (0)\n"
+        "#define LEAVE(addr) do { pc = addr; goto leave; } while (0)\n"
+        "// Leaves the instruction at addr, which would fault, to the interpreter.\n"
+        "#define TRAP(addr) do { budget++; pc = addr | CHIP8_AOT_TRAP; goto leave; } while (0)\n\n");
+
+    fprintf(out, "static uint32_t entry(Chip8Aot *aot, Chip8 *c8, uint32_t *budget_io, const bool *keys, uint32_t pc,\n"
+                 "                      const uint8_t *valid) {\n");
+    fprintf(out, "    (void)aot;\n    (void)keys;\n");
+    fprintf(out, "    uint8_t *const V = c8->V;\n    (void)V;\n    uint32_t budget = *budget_io;\n\n");
+    if (uses_dispatch) fprintf(out, "dispatch:\n");
+    fprintf(out, "    if (pc >= CHIP8_MEMORY_SIZE || !valid[pc]) goto leave;\n    switch (pc) {\n");
+    for (uint32_t addr = PROGRAM_OFFSET; addr < p->end; ++addr) {
+        if (has_label(p, addr)) fprintf(out, "        case 0x%03X: goto L_0x%03X;\n", addr, addr);
+    }
+    fprintf(out, "    }\n    goto leave;\n\n");
+
+    for (uint32_t b = 0; b < starts.size(); ++b) {
+        uint32_t pc = starts[b];
+        for (uint32_t i = 0; i < lengths[b]; ++i, pc += 2) emit_op<Quirks>(out, p, pc);
+        // The last instruction either ends the block by itself or falls through.
+        if (classify(p, pc - 2) == TRANSLATED) {
+            fprintf(out, "    ");
+            emit_target(out, p, pc);
+            fprintf(out, "\n");
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "leave:\n    *budget_io = budget;\n    return pc;\n}\n\n");
+    fprintf(out, "#undef STEP\n#undef GOTO\n#undef LEAVE\n#undef TRAP\n\n");
+    fprintf(out, "static const Chip8AotProgram program = {\n");
+    fprintf(out, "    \"%s\", 0x%016llxull, image, sizeof(image), %u, blocks, %u, entry,\n", name,
+            (unsigned long long)hash_fnv1a(image, size), quirks, (uint32_t)starts.size());
+    fprintf(out, "};\n\nstatic const bool registered = chip8_aot_register(&program);\n");
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_aot [options] path/to/program output.cpp\n"
+        "  --quirks Q     legacy (default), vip, chip48 or schip; the translation\n"
+        "                 is only used for machines running with the same quirks\n"
+        "  --name NAME    name to register the program under (default: file name)\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t quirks = CHIP8_QUIRKS_LEGACY;
+    const char *name = NULL;
+    const char *program_path = NULL;
+    const char *output_path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--quirks") == 0 && has_value) {
+            quirks = chip8_quirks_from_name(argv[++i]);
+            if (quirks == CHIP8_NUM_QUIRKS) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--name") == 0 && has_value) name = argv[++i];
+        else if (arg[0] != '-' && !program_path) program_path = arg;
+        else if (arg[0] != '-' && !output_path) output_path = arg;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!program_path || !output_path) {
+        usage();
+        return 1;
+    }
+
+    std::vector<uint8_t> program;
+    if (!read_file(program_path, &program)) {
+        fprintf(stderr, "Unable to read program %s\n", program_path);
+        return 1;
+    }
+    if (program.empty() || program.size() > CHIP8_MAX_PROGRAM_SIZE) {
+        fprintf(stderr, "Program size %u is outside 1..%u bytes\n", (uint32_t)program.size(), CHIP8_MAX_PROGRAM_SIZE);
+        return 1;
+    }
+
+    // The name ends up in a string literal.
+    std::vector<char> safe_name;
+    if (!name) {
+        name = program_path;
+        for (const char *c = program_path; *c; ++c) {
+            if (*c == '/' || *c == '\\') name = c + 1;
+        }
+    }
+    for (const char *c = name; *c; ++c) safe_name.push_back(*c == '"' || *c == '\\' || *c < ' ' ? '_' : *c);
+    safe_name.push_back(0);
+
+    Program *p = new Program();
+    memcpy(p->M + PROGRAM_OFFSET, program.data(), program.size());
+    p->end = PROGRAM_OFFSET + (uint32_t)program.size();
+    p->quirks = quirks;
+
+    FILE *out = fopen(output_path, "w");
+    if (!out) {
+        fprintf(stderr, "Unable to write %s\n", output_path);
+        return 1;
+    }
+    switch (quirks) {
+        case CHIP8_QUIRKS_VIP: translate<QuirksVip>(out, p, safe_name.data(), quirks); break;
+        case CHIP8_QUIRKS_CHIP48: translate<QuirksChip48>(out, p, safe_name.data(), quirks); break;
+        case CHIP8_QUIRKS_SCHIP: translate<QuirksSchip>(out, p, safe_name.data(), quirks); break;
+        default: translate<QuirksLegacy>(out, p, safe_name.data(), quirks); break;
+    }
+    const bool ok = fclose(out) == 0;
+    delete p;
+    if (!ok) {
+        fprintf(stderr, "Unable to write %s\n", output_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,735 @@
+// chip8_bench: times the interpreter (or a translator) on small programs that each
+// keep one family of instructions busy, and on whole programs given on the
+// command line, then checks the screen and machine state every program leaves
+// after a fixed number of cycles against golden hashes, so that a faster build
+// cannot quietly behave differently. Every program also goes through a rewind
+// buffer and back and runs as batch environments on one thread and on
+// several. Results can be written as JSON and compared with an earlier run.
+
+#include "chip8.h"
+#include "chip8_aot.h"
+#include "chip8_env.h"
+#include "chip8_jit.h"
+#include "chip8_lanes.h"
+#include "chip8_state.h"
+#include "hash.h"
+#include "rewind.h"
+#include "rom.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CYCLES 20000000ull
+#define DEFAULT_REPEAT 3
+#define CHECK_CYCLES 100000ull // of the golden hashes
+#define REWIND_FRAMES 600 // pushed and popped by the rewind check
+#define REWIND_CAPACITY (16u << 20) // enough that no frame of the check is dropped
+#define ENV_COUNT 16 // environments in the env check
+#define ENV_THREADS 4 // compared with one, fixed so that even a single core runs workers
+#define ENV_STEPS 100
+#define ENV_MAX_FRAMES 60 // short episodes, so the check also covers restarts
+
+struct Workload {
+    std::string name;
+    std::vector<uint8_t> program; // empty for programs loaded from files
+    std::string path;
+};
+
+// What runs the programs besides the interpreter, at most one of these.
+struct Backend {
+    Chip8Jit *jit;
+    bool aot; // the translation linked in for each program and profile
+    Chip8Lanes *lanes; // CHIP8_LANES copies of each program in lockstep
+};
+
+struct Golden {
+    std::string name;
+    uint32_t quirks;
+    uint64_t cycles;
+    uint64_t screen_hash;
+    uint64_t state_hash;
+};
+
+struct Check {
+    std::string name;
+    uint32_t quirks;
+    uint64_t cycles;
+    uint64_t screen_hash;
+    uint64_t state_hash;
+    const char *result; // "ok", "mismatch", "none" or "untranslated" (--aot without a translation linked in)
+};
+
+// Totals over all rewind checks.
+struct RewindTiming {
+    uint32_t frames;
+    double push_seconds;
+    double pop_seconds;
+    double round_trip_seconds; // chip8_save_state plus chip8_load_state
+};
+
+struct Result {
+    std::string name;
+    double seconds; // best of the repeats
+    uint64_t idle_cycles;
+    double baseline_ns; // per instruction, 0 = not in the baseline
+};
+
+static std::vector<uint8_t> assemble(std::initializer_list<uint16_t> ops) {
+    std::vector<uint8_t> program;
+    for (uint16_t op : ops) {
+        program.push_back((uint8_t)(op >> 8));
+        program.push_back((uint8_t)op);
+    }
+    return program;
+}
+
+// Draws an n-row sprite at (x, y) over and over.
+static std::vector<uint8_t> draw_program(uint8_t x, uint8_t y, uint8_t n) {
+    std::vector<uint8_t> program = assemble({
+        0xA20A, // 200: I = sprite
+        (uint16_t)(0x6A00 | x), // 202
+        (uint16_t)(0x6B00 | y), // 204
+        (uint16_t)(0xDAB0 | n), // 206: loop
+        0x1206, // 208
+    });
+    static const uint8_t sprite[15] = { 0xF0, 0x90, 0x3C, 0xFF, 0x81, 0x5A, 0x24, 0xC3, 0x18, 0x7E, 0xA5, 0x0F, 0x66, 0x99, 0xE7 };
+    program.insert(program.end(), sprite, sprite + sizeof(sprite));
+    return program;
+}
+
+static std::vector<Workload> builtin_workloads() {
+    std::vector<Workload> w(12);
+    w[0].name = "alu";
+    w[0].program = assemble({
+        0x6001, 0x6103, 0x6207, 0x630F, 0x6455, 0x65AA, 0x6633, 0x67C3,
+        0x8014, 0x8105, 0x8211, 0x8312, 0x8423, 0x8506, 0x860E, 0x8707, 0x7801, 0x8980, 0x1210, // 210: loop
+    });
+    w[1].name = "call";
+    w[1].program = assemble({
+        0x2206, 0x2206, 0x1200, // 200: loop
+        0x7001, 0x220E, 0x7101, 0x00EE, // 206
+        0x7201, 0x00EE, // 20E
+    });
+    w[2].name = "bcd";
+    w[2].program = assemble({ 0xA400, 0xF033, 0x7007, 0x1202 });
+    w[3].name = "store";
+    w[3].program = assemble({ 0xA400, 0xFF55, 0x7003, 0x7E05, 0x1200 }); // I is reset, the quirks move it
+    w[4].name = "load";
+    w[4].program = assemble({ 0xA200, 0xFF65, 0x1200 });
+    w[5].name = "draw-1";
+    w[5].program = draw_program(13, 9, 1);
+    w[6].name = "draw-5";
+    w[6].program = draw_program(13, 9, 5);
+    w[7].name = "draw-15";
+    w[7].program = draw_program(13, 9, 15);
+    w[8].name = "draw-5-aligned";
+    w[8].program = draw_program(8, 8, 5);
+    w[9].name = "draw-15-clipped";
+    w[9].program = draw_program(60, 25, 15);
+    w[10].name = "draw-random";
+    w[10].program = assemble({
+        0xC03F, 0xC11F, 0xC20F, 0xF229, 0xD015, 0x1200, // font digits at random places
+    });
+    w[11].name = "mixed";
+    w[11].program = assemble({
+        0x00E0, 0x6A00, 0x6B00, 0x6C00, // 200
+        0xFC29, 0xDAB5, 0x7A08, 0x7C01, 0x83C0, 0x830E, 0xA400, 0xF333, 0xF265, // 208: loop, a digit per column
+        0x3A40, 0x1208, 0x6A00, 0x7B06, 0x3B1E, 0x1208, 0x222A, 0x1200, // 21A: next row, or store and start over
+        0xA400, 0xF155, 0x00EE, // 22A
+    });
+    return w;
+}
+
+// Taken from this interpreter at CHECK_CYCLES, default seed, no keys.
+static const struct {
+    const char *name;
+    uint32_t quirks;
+    uint64_t screen_hash;
+    uint64_t state_hash;
+} builtin_golden[] = {
+    { "alu", CHIP8_QUIRKS_LEGACY, 0x28c31cf8df2ec325ull, 0x9ce4800cbcfeb944ull },
+    { "alu", CHIP8_QUIRKS_VIP, 0x28c31cf8df2ec325ull, 0xd50c55a1542c6412ull },
+    { "alu", CHIP8_QUIRKS_CHIP48, 0x28c31cf8df2ec325ull, 0x9ce4800cbcfeb944ull },
+    { "alu", CHIP8_QUIRKS_SCHIP, 0x28c31cf8df2ec325ull, 0x9ce4800cbcfeb944ull },
+    { "call", CHIP8_QUIRKS_LEGACY, 0x28c31cf8df2ec325ull, 0x822bd88bc9e3b603ull },
+    { "call", CHIP8_QUIRKS_VIP, 0x28c31cf8df2ec325ull, 0x822bd88bc9e3b603ull },
+    { "call", CHIP8_QUIRKS_CHIP48, 0x28c31cf8df2ec325ull, 0x822bd88bc9e3b603ull },
+    { "call", CHIP8_QUIRKS_SCHIP, 0x28c31cf8df2ec325ull, 0x822bd88bc9e3b603ull },
+    { "bcd", CHIP8_QUIRKS_LEGACY, 0x28c31cf8df2ec325ull, 0x851731445f42ac23ull },
+    { "bcd", CHIP8_QUIRKS_VIP, 0x28c31cf8df2ec325ull, 0x851731445f42ac23ull },
+    { "bcd", CHIP8_QUIRKS_CHIP48, 0x28c31cf8df2ec325ull, 0x851731445f42ac23ull },
+    { "bcd", CHIP8_QUIRKS_SCHIP, 0x28c31cf8df2ec325ull, 0x851731445f42ac23ull },
+    { "store", CHIP8_QUIRKS_LEGACY, 0x28c31cf8df2ec325ull, 0xa2de26117846ed4bull },
+    { "store", CHIP8_QUIRKS_VIP, 0x28c31cf8df2ec325ull, 0x188c15d94344c8bbull },
+    { "store", CHIP8_QUIRKS_CHIP48, 0x28c31cf8df2ec325ull, 0xcc83e1c96b6c9b9cull },
+    { "store", CHIP8_QUIRKS_SCHIP, 0x28c31cf8df2ec325ull, 0xa2de26117846ed4bull },
+    { "load", CHIP8_QUIRKS_LEGACY, 0x28c31cf8df2ec325ull, 0x67e329b107d84137ull },
+    { "load", CHIP8_QUIRKS_VIP, 0x28c31cf8df2ec325ull, 0x67e329b107d84137ull },
+    { "load", CHIP8_QUIRKS_CHIP48, 0x28c31cf8df2ec325ull, 0x67e329b107d84137ull },
+    { "load", CHIP8_QUIRKS_SCHIP, 0x28c31cf8df2ec325ull, 0x67e329b107d84137ull },
+    { "draw-1", CHIP8_QUIRKS_LEGACY, 0xbadd3620cc54e6f1ull, 0x904aea8b6c4f3fcaull },
+    { "draw-1", CHIP8_QUIRKS_VIP, 0xbadd3620cc54e6f1ull, 0x904aea8b6c4f3fcaull },
+    { "draw-1", CHIP8_QUIRKS_CHIP48, 0xbadd3620cc54e6f1ull, 0x904aea8b6c4f3fcaull },
+    { "draw-1", CHIP8_QUIRKS_SCHIP, 0xbadd3620cc54e6f1ull, 0x904aea8b6c4f3fcaull },
+    { "draw-5", CHIP8_QUIRKS_LEGACY, 0x4ef57abe157ec8d1ull, 0xdd898895c63b41deull },
+    { "draw-5", CHIP8_QUIRKS_VIP, 0x4ef57abe157ec8d1ull, 0xdd898895c63b41deull },
+    { "draw-5", CHIP8_QUIRKS_CHIP48, 0x4ef57abe157ec8d1ull, 0xdd898895c63b41deull },
+    { "draw-5", CHIP8_QUIRKS_SCHIP, 0x4ef57abe157ec8d1ull, 0xdd898895c63b41deull },
+    { "draw-15", CHIP8_QUIRKS_LEGACY, 0x264b82cdb6c3bd69ull, 0xa9238e1add350560ull },
+    { "draw-15", CHIP8_QUIRKS_VIP, 0x264b82cdb6c3bd69ull, 0xa9238e1add350560ull },
+    { "draw-15", CHIP8_QUIRKS_CHIP48, 0x264b82cdb6c3bd69ull, 0xa9238e1add350560ull },
+    { "draw-15", CHIP8_QUIRKS_SCHIP, 0x264b82cdb6c3bd69ull, 0xa9238e1add350560ull },
+    { "draw-5-aligned", CHIP8_QUIRKS_LEGACY, 0x45587744ffcab0a9ull, 0xffce8f982bc81034ull },
+    { "draw-5-aligned", CHIP8_QUIRKS_VIP, 0x45587744ffcab0a9ull, 0xffce8f982bc81034ull },
+    { "draw-5-aligned", CHIP8_QUIRKS_CHIP48, 0x45587744ffcab0a9ull, 0xffce8f982bc81034ull },
+    { "draw-5-aligned", CHIP8_QUIRKS_SCHIP, 0x45587744ffcab0a9ull, 0xffce8f982bc81034ull },
+    { "draw-15-clipped", CHIP8_QUIRKS_LEGACY, 0x94d594e2dc6f77a9ull, 0x1aa5f0ea6d2f38d2ull },
+    { "draw-15-clipped", CHIP8_QUIRKS_VIP, 0x94d594e2dc6f77a9ull, 0x1aa5f0ea6d2f38d2ull },
+    { "draw-15-clipped", CHIP8_QUIRKS_CHIP48, 0x94d594e2dc6f77a9ull, 0x1aa5f0ea6d2f38d2ull },
+    { "draw-15-clipped", CHIP8_QUIRKS_SCHIP, 0x94d594e2dc6f77a9ull, 0x1aa5f0ea6d2f38d2ull },
+    { "draw-random", CHIP8_QUIRKS_LEGACY, 0x900b3bc24138093bull, 0x50c99e0b77aaada5ull },
+    { "draw-random", CHIP8_QUIRKS_VIP, 0x900b3bc24138093bull, 0x50c99e0b77aaada5ull },
+    { "draw-random", CHIP8_QUIRKS_CHIP48, 0x900b3bc24138093bull, 0x50c99e0b77aaada5ull },
+    { "draw-random", CHIP8_QUIRKS_SCHIP, 0x900b3bc24138093bull, 0x50c99e0b77aaada5ull },
+    { "mixed", CHIP8_QUIRKS_LEGACY, 0x3d3a8e1a8cfd84faull, 0x97b6ec1e5f7a41caull },
+    { "mixed", CHIP8_QUIRKS_VIP, 0x3d3a8e1a8cfd84faull, 0x7f04fcdca8d44579ull },
+    { "mixed", CHIP8_QUIRKS_CHIP48, 0x3d3a8e1a8cfd84faull, 0xcb19ff2ab4024ca0ull },
+    { "mixed", CHIP8_QUIRKS_SCHIP, 0x3d3a8e1a8cfd84faull, 0x97b6ec1e5f7a41caull },
+};
+
+// Memory and everything a program can observe besides the screen.
+static uint64_t state_hash(const Chip8 *c8) {
+    uint64_t hash = hash_fnv1a(c8->M, sizeof(c8->M));
+    hash = hash_fnv1a(c8->V, sizeof(c8->V), hash);
+    hash = hash_fnv1a(c8->stack, sizeof(c8->stack), hash);
+    const uint16_t registers[6] = { c8->PC, c8->I, c8->SP, c8->delay_timer, c8->sound_timer, c8->fault };
+    return hash_fnv1a(registers, sizeof(registers), hash);
+}
+
+static void run(Chip8 *c8, Chip8Jit *jit, Chip8Aot *aot, uint64_t cycles) {
+    const bool keys[CHIP8_NUM_KEYS] = {};
+    while (cycles > 0) {
+        const uint32_t chunk = cycles > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)cycles;
+        if (jit) chip8_jit_run(jit, c8, chunk, keys);
+        else if (aot) chip8_aot_run(aot, c8, chunk, keys);
+        else chip8_machine_run(c8, chunk, keys);
+        cycles -= chunk;
+    }
+}
+
+// The translation of rom linked in for its quirks, NULL if there is none.
+static Chip8Aot *create_aot(const Rom *rom) {
+    const Chip8AotProgram *translation = chip8_aot_find(rom->image.M + CHIP8_PROGRAM_OFFSET, rom->size, rom->quirks);
+    return translation ? chip8_aot_create(translation) : NULL;
+}
+
+static void start_lanes(Chip8Lanes *lanes, const Rom *rom) {
+    chip8_lanes_init(lanes, rom->image.M + CHIP8_PROGRAM_OFFSET, rom->size, CHIP8_LANES);
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) rom_instance_init(rom, &lanes->machines[l]);
+}
+
+static void run_lanes(Chip8Lanes *lanes, uint64_t cycles) {
+    static const bool keys[CHIP8_LANES][CHIP8_NUM_KEYS] = {};
+    while (cycles > 0) {
+        const uint32_t chunk = cycles > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)cycles;
+        chip8_lanes_run(lanes, chunk, keys);
+        cycles -= chunk;
+    }
+}
+
+static const Rom *load(RomCache *cache, const Workload &w, uint32_t quirks) {
+    RomError error;
+    const Rom *rom = w.program.empty() ? rom_cache_load(cache, w.path.c_str(), quirks, &error)
+                                       : rom_cache_add(cache, w.name.c_str(), w.program.data(), (uint32_t)w.program.size(), quirks, &error);
+    if (!rom) fprintf(stderr, "Unable to load %s: %s\n", w.name.c_str(), rom_error_string(error));
+    return rom;
+}
+
+// Runs on the caller's machine and JIT as they were left by the previous check.
+// With lanes, every lane has to end up where the first one did.
+static Check check(const Rom *rom, const std::string &name, uint32_t quirks, Chip8 *c8, const Backend &backend,
+                   const std::vector<Golden> &golden) {
+    Check c = { name, quirks, CHECK_CYCLES, 0, 0, "untranslated" };
+    Chip8Aot *aot = backend.aot ? create_aot(rom) : NULL;
+    if (backend.aot && !aot) return c;
+    bool lanes_agree = true;
+    if (backend.lanes) {
+        start_lanes(backend.lanes, rom);
+        run_lanes(backend.lanes, CHECK_CYCLES);
+        c8 = &backend.lanes->machines[0];
+        for (uint32_t l = 1; l < CHIP8_LANES; ++l) {
+            const Chip8 *lane = &backend.lanes->machines[l];
+            lanes_agree = lanes_agree && chip8_screen_hash(lane->screen) == chip8_screen_hash(c8->screen) && state_hash(lane) == state_hash(c8);
+        }
+    }
+    else {
+        rom_instance_init(rom, c8);
+        run(c8, backend.jit, aot, CHECK_CYCLES);
+    }
+    if (aot) chip8_aot_destroy(aot);
+    c.screen_hash = chip8_screen_hash(c8->screen);
+    c.state_hash = state_hash(c8);
+    c.result = lanes_agree ? "none" : "mismatch";
+    for (const Golden &g : golden) {
+        if (lanes_agree && g.name == name && g.quirks == quirks && g.cycles == c.cycles) {
+            c.result = g.screen_hash == c.screen_hash && g.state_hash == c.state_hash ? "ok" : "mismatch";
+        }
+    }
+    return c;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Pushes REWIND_FRAMES frames into a rewind buffer, pops them all and compares
+// every restored state with the one saved before that frame ran, then runs
+// from the first one again and checks that it retraces the same frames.
+static bool check_rewind(const Rom *rom, RewindTiming *timing) {
+    const bool keys[CHIP8_NUM_KEYS] = {};
+    Chip8 *c8 = new Chip8;
+    rom_instance_init(rom, c8);
+    Chip8Rewind *rewind = chip8_rewind_create(REWIND_CAPACITY, CHIP8_TIMER_HZ);
+    std::vector<Chip8State> states(REWIND_FRAMES + 1);
+    for (uint32_t frame = 0; frame < REWIND_FRAMES; ++frame) {
+        chip8_save_state(c8, &states[frame]);
+        const auto start = std::chrono::steady_clock::now();
+        chip8_rewind_push(rewind, c8);
+        timing->push_seconds += seconds_since(start);
+        chip8_machine_run(c8, c8->cycle_counter, keys);
+    }
+    chip8_save_state(c8, &states[REWIND_FRAMES]);
+
+    Chip8State restored;
+    bool ok = chip8_rewind_frames(rewind) == REWIND_FRAMES;
+    for (uint32_t frame = REWIND_FRAMES; ok && frame-- > 0;) {
+        const auto start = std::chrono::steady_clock::now();
+        ok = chip8_rewind_pop(rewind, c8);
+        timing->pop_seconds += seconds_since(start);
+        chip8_save_state(c8, &restored);
+        ok = ok && memcmp(&restored, &states[frame], sizeof(restored)) == 0;
+    }
+    ok = ok && chip8_rewind_frames(rewind) == 0;
+    for (uint32_t frame = 1; ok && frame <= REWIND_FRAMES; ++frame) {
+        chip8_machine_run(c8, c8->cycle_counter, keys);
+        chip8_save_state(c8, &restored);
+        ok = memcmp(&restored, &states[frame], sizeof(restored)) == 0;
+    }
+    for (uint32_t frame = 0; ok && frame < REWIND_FRAMES; ++frame) {
+        const auto start = std::chrono::steady_clock::now();
+        chip8_save_state(c8, &restored);
+        ok = chip8_load_state(c8, &restored);
+        timing->round_trip_seconds += seconds_since(start);
+    }
+    timing->frames += REWIND_FRAMES;
+    chip8_rewind_destroy(rewind);
+    delete c8;
+    return ok;
+}
+
+// Lit pixels in the d x d block at block row r, block column c.
+static uint8_t lit_pixels(const uint64_t screen[CHIP8_SCR_H], uint32_t d, uint32_t r, uint32_t c) {
+    uint8_t lit = 0;
+    for (uint32_t y = r * d; y < (r + 1) * d; ++y) {
+        for (uint32_t x = c * d; x < (c + 1) * d; ++x) lit += (screen[y] >> (CHIP8_SCR_W - 1 - x)) & 1;
+    }
+    return lit;
+}
+
+// Steps ENV_COUNT environments with random keys on one thread and on
+// ENV_THREADS, for bit observations, 1/2/4/8 blocks and merged frames, and checks that
+// both give the same observations and info and that observations show the
+// screen of each environment's machine.
+static bool check_env(const Rom *rom) {
+    static const uint32_t downsamples[] = { 0, 1, 2, 4, 8, 2 }; // 0 = bits, the last one with merged frames
+    const uint32_t num_configs = sizeof(downsamples) / sizeof(downsamples[0]);
+    for (uint32_t k = 0; k < num_configs; ++k) {
+        Chip8EnvConfig config;
+        chip8_env_default_config(&config);
+        config.num_envs = ENV_COUNT;
+        config.frame_skip = 2;
+        config.observation = downsamples[k] ? CHIP8_ENV_OBSERVE_BYTES : CHIP8_ENV_OBSERVE_BITS;
+        config.downsample = downsamples[k] ? downsamples[k] : 1;
+        config.merge_frames = k + 1 == num_configs;
+        config.max_frames = ENV_MAX_FRAMES;
+        config.seed = k + 1;
+        config.num_threads = 1;
+        Chip8Env *one = chip8_env_create(rom, &config);
+        config.num_threads = ENV_THREADS;
+        Chip8Env *all = chip8_env_create(rom, &config);
+        if (!one || !all) return false;
+
+        const uint32_t size = chip8_env_observation_size(one);
+        uint32_t rng = k + 1;
+        bool ok = true;
+        for (uint32_t step = 0; ok && step < ENV_STEPS; ++step) {
+            uint16_t masks[ENV_COUNT];
+            for (uint32_t i = 0; i < ENV_COUNT; ++i) {
+                rng ^= rng << 13;
+                rng ^= rng >> 17;
+                rng ^= rng << 5;
+                masks[i] = (uint16_t)rng;
+            }
+            chip8_env_step(one, masks);
+            chip8_env_step(all, masks);
+            ok = memcmp(chip8_env_observations(one), chip8_env_observations(all), (size_t)size * ENV_COUNT) == 0 &&
+                 memcmp(chip8_env_info(one), chip8_env_info(all), sizeof(Chip8EnvInfo) * ENV_COUNT) == 0;
+        }
+        for (uint32_t i = 0; ok && !config.merge_frames && i < ENV_COUNT; ++i) {
+            const uint64_t *screen = chip8_env_machine(one, i)->screen;
+            const uint8_t *observation = chip8_env_observations(one) + (size_t)i * size;
+            if (!downsamples[k]) {
+                ok = memcmp(observation, screen, size) == 0;
+                continue;
+            }
+            const uint32_t d = downsamples[k];
+            for (uint32_t r = 0; r < CHIP8_SCR_H / d; ++r) {
+                for (uint32_t c = 0; c < CHIP8_SCR_W / d; ++c) ok = ok && observation[r * (CHIP8_SCR_W / d) + c] == lit_pixels(screen, d, r, c);
+            }
+        }
+        chip8_env_destroy(one);
+        chip8_env_destroy(all);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Lanes run cycles / CHIP8_LANES cycles each, so the instructions add up to
+// the same count as for one machine.
+static Result time_workload(const Rom *rom, const std::string &name, const Backend &backend, Chip8Aot *aot,
+                            uint64_t cycles, uint32_t repeat) {
+    Result r = { name, 0, 0, 0 };
+    Chip8 *c8 = new Chip8;
+    for (uint32_t i = 0; i < repeat; ++i) {
+        if (backend.lanes) start_lanes(backend.lanes, rom);
+        else rom_instance_init(rom, c8);
+        if (backend.jit) chip8_jit_flush(backend.jit);
+        const auto start = std::chrono::steady_clock::now();
+        if (backend.lanes) run_lanes(backend.lanes, cycles / CHIP8_LANES);
+        else run(c8, backend.jit, aot, cycles);
+        const double seconds = seconds_since(start);
+        if (i == 0 || seconds < r.seconds) r.seconds = seconds;
+    }
+    if (backend.lanes) {
+        for (uint32_t l = 0; l < CHIP8_LANES; ++l) r.idle_cycles += backend.lanes->machines[l].idle_cycles;
+    }
+    else {
+        r.idle_cycles = c8->idle_cycles;
+    }
+    delete c8;
+    return r;
+}
+
+// Golden file: "name quirks cycles screen_hash state_hash" per line, hashes in
+// hex, '#' starts a comment.
+static bool read_golden(const char *path, std::vector<Golden> *golden) {
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    char line[512];
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        char name[ROM_MAX_NAME], quirks[32];
+        unsigned long long cycles, screen, state;
+        if (sscanf(line, "%255s %31s %llu %llx %llx", name, quirks, &cycles, &screen, &state) != 5 ||
+            chip8_quirks_from_name(quirks) == CHIP8_NUM_QUIRKS) {
+            ok = false;
+            break;
+        }
+        Golden g = { name, chip8_quirks_from_name(quirks), cycles, screen, state };
+        golden->push_back(g);
+    }
+    fclose(file);
+    return ok;
+}
+
+static bool write_golden(const char *path, const std::vector<Check> &checks) {
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "# chip8_bench golden hashes: name quirks cycles screen_hash state_hash\n");
+    for (const Check &c : checks) {
+        fprintf(file, "%s %s %llu %016llx %016llx\n", c.name.c_str(), chip8_quirks_name(c.quirks), (unsigned long long)c.cycles,
+                (unsigned long long)c.screen_hash, (unsigned long long)c.state_hash);
+    }
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Picks the per-instruction times out of a file written by --json.
+static bool read_baseline(const char *path, std::vector<Result> *results) {
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        const char *name = strstr(line, "\"name\":\"");
+        const char *ns = strstr(line, "\"ns_per_instruction\":");
+        if (!name || !ns) continue;
+        name += 8;
+        const char *name_end = strchr(name, '"');
+        if (!name_end) continue;
+        const std::string workload(name, name_end);
+        for (Result &r : *results) {
+            if (r.name == workload) r.baseline_ns = strtod(ns + 21, NULL);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static bool write_json(const char *path, const char *backend, uint32_t quirks, uint64_t cycles, uint32_t repeat,
+                       const std::vector<Result> &results, const std::vector<Check> &checks, uint32_t failures) {
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!file) return false;
+    // One result or check per line, so --baseline and line-based tools can read it too.
+    fprintf(file, "{\"backend\":\"%s\",\"quirks\":\"%s\",\"cycles\":%llu,\"repeat\":%u,\"results\":[\n", backend,
+            chip8_quirks_name(quirks), (unsigned long long)cycles, repeat);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        fprintf(file, "{\"name\":\"%s\",\"seconds\":%.6f,\"ns_per_instruction\":%.4f,\"instructions_per_sec\":%.0f,\"idle_cycles\":%llu}%s\n",
+                r.name.c_str(), r.seconds, cycles > 0 ? r.seconds * 1e9 / cycles : 0.0, r.seconds > 0 ? cycles / r.seconds : 0.0,
+                (unsigned long long)r.idle_cycles, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "],\"checks\":[\n");
+    for (size_t i = 0; i < checks.size(); ++i) {
+        const Check &c = checks[i];
+        fprintf(file, "{\"check\":\"%s\",\"quirks\":\"%s\",\"cycles\":%llu,\"screen_hash\":\"%016llx\",\"state_hash\":\"%016llx\",\"result\":\"%s\"}%s\n",
+                c.name.c_str(), chip8_quirks_name(c.quirks), (unsigned long long)c.cycles, (unsigned long long)c.screen_hash,
+                (unsigned long long)c.state_hash, c.result, i + 1 < checks.size() ? "," : "");
+    }
+    fprintf(file, "],\"failures\":%u}\n", failures);
+    if (file == stdout) return true;
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// The built-in workloads as DIR/<name>.ch8, for chip8_aot.
+static bool write_workloads(const char *dir) {
+    for (const Workload &w : builtin_workloads()) {
+        const std::string path = std::string(dir) + "/" + w.name + ".ch8";
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        const bool ok = fwrite(w.program.data(), 1, w.program.size(), file) == w.program.size();
+        if (fclose(file) != 0 || !ok) return false;
+    }
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_bench [options] [FILE|DIR]...\n"
+        "Times the built-in workloads and any programs given (.ch8 files in DIR),\n"
+        "and checks every one against golden hashes after %llu cycles and for\n"
+        "identical states after running %u frames into a rewind buffer and back,\n"
+        "and runs them as batch environments on one thread and on several.\n"
+        "  --cycles N     cycles to time each workload for (default %llu)\n"
+        "  --repeat N     runs per workload, the fastest counts (default %u)\n"
+        "  --quirks Q     profile to time with and to check programs on: legacy\n"
+        "                 (default), vip, chip48 or schip; the built-in workloads\n"
+        "                 are checked on all of them\n"
+        "  --only TEXT    only workloads whose name contains TEXT\n"
+        "  --jit          run on the JIT (x86-64 Linux) instead of the interpreter\n"
+        "  --aot          run on the translations linked in with chip8_add_aot_rom;\n"
+        "                 chip8_bench_aot has every built-in workload on every profile\n"
+        "  --lanes        run %u copies of each program in lockstep (chip8_lanes.h);\n"
+        "                 every copy has to match the golden hashes\n"
+        "  --golden FILE  also check against the hashes in FILE\n"
+        "  --write-golden FILE\n"
+        "                 write the hashes of this run to FILE\n"
+        "  --json FILE    write the results as JSON, - = stdout\n"
+        "  --baseline FILE\n"
+        "                 compare times with a JSON file written by an earlier run\n"
+        "  --write-workloads DIR\n"
+        "                 write the built-in workloads to DIR as .ch8 files and exit\n",
+        CHECK_CYCLES, REWIND_FRAMES, DEFAULT_CYCLES, DEFAULT_REPEAT, CHIP8_LANES);
+}
+
+static void add_path(const char *path, void *user) {
+    ((std::vector<std::string> *)user)->push_back(path);
+}
+
+int main(int argc, char **argv) {
+    uint64_t cycles = DEFAULT_CYCLES;
+    uint32_t repeat = DEFAULT_REPEAT;
+    uint32_t quirks = CHIP8_QUIRKS_LEGACY;
+    const char *only = NULL;
+    bool use_jit = false;
+    bool use_aot = false;
+    bool use_lanes = false;
+    const char *golden_path = NULL;
+    const char *write_golden_path = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    const char *workloads_dir = NULL;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--cycles") == 0 && has_value) cycles = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--repeat") == 0 && has_value) repeat = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--only") == 0 && has_value) only = argv[++i];
+        else if (strcmp(arg, "--jit") == 0) use_jit = true;
+        else if (strcmp(arg, "--aot") == 0) use_aot = true;
+        else if (strcmp(arg, "--lanes") == 0) use_lanes = true;
+        else if (strcmp(arg, "--golden") == 0 && has_value) golden_path = argv[++i];
+        else if (strcmp(arg, "--write-golden") == 0 && has_value) write_golden_path = argv[++i];
+        else if (strcmp(arg, "--json") == 0 && has_value) json_path = argv[++i];
+        else if (strcmp(arg, "--baseline") == 0 && has_value) baseline_path = argv[++i];
+        else if (strcmp(arg, "--write-workloads") == 0 && has_value) workloads_dir = argv[++i];
+        else if (strcmp(arg, "--quirks") == 0 && has_value) {
+            quirks = chip8_quirks_from_name(argv[++i]);
+            if (quirks == CHIP8_NUM_QUIRKS) {
+                usage();
+                return 1;
+            }
+        }
+        else if (arg[0] != '-') {
+            if (!rom_list_dir(arg, ".ch8", add_path, &paths)) paths.push_back(arg);
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (repeat == 0 || use_jit + use_aot + use_lanes > 1) {
+        usage();
+        return 1;
+    }
+    if (workloads_dir) {
+        if (!write_workloads(workloads_dir)) {
+            fprintf(stderr, "Unable to write the workloads to %s\n", workloads_dir);
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<Golden> golden;
+    for (const auto &g : builtin_golden) {
+        Golden entry = { g.name, g.quirks, CHECK_CYCLES, g.screen_hash, g.state_hash };
+        golden.push_back(entry);
+    }
+    if (golden_path && !read_golden(golden_path, &golden)) {
+        fprintf(stderr, "Unable to read golden hashes %s\n", golden_path);
+        return 1;
+    }
+
+    std::vector<Workload> workloads;
+    for (Workload &w : builtin_workloads()) {
+        if (!only || strstr(w.name.c_str(), only)) workloads.push_back(w);
+    }
+    for (const std::string &path : paths) {
+        Workload w;
+        w.name = rom_base_name(path.c_str());
+        w.path = path;
+        if (!only || strstr(w.name.c_str(), only)) workloads.push_back(w);
+    }
+
+    RomCache *cache = rom_cache_create();
+    Backend backend = { use_jit ? chip8_jit_create() : NULL, use_aot, use_lanes ? new Chip8Lanes : NULL };
+    Chip8 *machine = new Chip8;
+    std::vector<Check> checks;
+    std::vector<Result> results;
+    uint32_t failures = 0;
+    RewindTiming rewind_timing = {};
+    uint32_t rewind_counts[2] = {}; // ok, mismatched
+    uint32_t env_counts[2] = {};
+    // Built-in workloads run on every profile, programs on the one they are meant
+    // for. Golden checks go a profile at a time on one machine and a JIT that is
+    // never flushed, so each program starts where the last one ran with the same
+    // quirks and memory_writes; a JIT that kept the old blocks would mismatch.
+    for (uint32_t q = 0; q < CHIP8_NUM_QUIRKS; ++q) {
+        for (const Workload &w : workloads) {
+            if (q != quirks && w.program.empty()) continue;
+            const Rom *rom = load(cache, w, q);
+            if (!rom) {
+                failures++;
+                continue;
+            }
+            checks.push_back(check(rom, w.name, q, machine, backend, golden));
+            if (strcmp(checks.back().result, "mismatch") == 0 || strcmp(checks.back().result, "untranslated") == 0) failures++;
+        }
+    }
+    for (const Workload &w : workloads) {
+        for (uint32_t q = 0; q < CHIP8_NUM_QUIRKS; ++q) {
+            if (q != quirks && w.program.empty()) continue;
+            const Rom *rom = load(cache, w, q);
+            if (!rom) break; // counted by the golden checks
+            if (check_rewind(rom, &rewind_timing)) {
+                rewind_counts[0]++;
+            }
+            else {
+                rewind_counts[1]++;
+                failures++;
+                fprintf(stderr, "rewind mismatch: %s on %s\n", w.name.c_str(), chip8_quirks_name(q));
+            }
+        }
+        const Rom *rom = load(cache, w, quirks);
+        if (!rom) continue;
+        if (check_env(rom)) {
+            env_counts[0]++;
+        }
+        else {
+            env_counts[1]++;
+            failures++;
+            fprintf(stderr, "env mismatch: %s on %s\n", w.name.c_str(), chip8_quirks_name(quirks));
+        }
+        Chip8Aot *aot = use_aot ? create_aot(rom) : NULL;
+        if (!use_aot || aot) results.push_back(time_workload(rom, w.name, backend, aot, cycles, repeat));
+        if (aot) chip8_aot_destroy(aot);
+    }
+    delete machine;
+    if (backend.jit) chip8_jit_destroy(backend.jit);
+    delete backend.lanes;
+    rom_cache_destroy(cache);
+
+    if (baseline_path && !read_baseline(baseline_path, &results)) {
+        fprintf(stderr, "Unable to read baseline %s\n", baseline_path);
+        return 1;
+    }
+    const bool json_to_stdout = json_path && strcmp(json_path, "-") == 0;
+    FILE *out = json_to_stdout ? stderr : stdout;
+    fprintf(out, "%-20s %10s %10s %8s%s\n", "workload", "ns/instr", "Minstr/s", "idle", baseline_path ? "   change" : "");
+    for (const Result &r : results) {
+        const double ns = cycles > 0 ? r.seconds * 1e9 / cycles : 0.0;
+        fprintf(out, "%-20s %10.3f %10.1f %7.1f%%", r.name.c_str(), ns, r.seconds > 0 ? cycles / r.seconds * 1e-6 : 0.0,
+                cycles > 0 ? 100.0 * r.idle_cycles / cycles : 0.0);
+        if (r.baseline_ns > 0) fprintf(out, " %+8.1f%%", 100.0 * (ns - r.baseline_ns) / r.baseline_ns);
+        fprintf(out, "\n");
+    }
+    uint32_t counts[4] = {};
+    for (const Check &c : checks) {
+        if (strcmp(c.result, "ok") == 0) counts[0]++;
+        else if (strcmp(c.result, "mismatch") == 0) counts[1]++;
+        else if (strcmp(c.result, "none") == 0) counts[2]++;
+        else counts[3]++;
+        if (strcmp(c.result, "untranslated") == 0) {
+            fprintf(out, "untranslated: %s on %s\n", c.name.c_str(), chip8_quirks_name(c.quirks));
+        }
+        else if (strcmp(c.result, "ok") != 0) {
+            fprintf(out, "%s: %s on %s, screen %016llx state %016llx\n", c.result, c.name.c_str(), chip8_quirks_name(c.quirks),
+                    (unsigned long long)c.screen_hash, (unsigned long long)c.state_hash);
+        }
+    }
+    fprintf(out, "golden checks:       %u ok, %u mismatched, %u without a golden hash", counts[0], counts[1], counts[2]);
+    if (use_aot) fprintf(out, ", %u without a translation", counts[3]);
+    fprintf(out, "\n");
+    const double per_frame = rewind_timing.frames ? 1e6 / rewind_timing.frames : 0.0;
+    fprintf(out, "rewind checks:       %u ok, %u mismatched; %.3f us per push, %.3f us per pop, %.3f us per save+load\n",
+            rewind_counts[0], rewind_counts[1], rewind_timing.push_seconds * per_frame, rewind_timing.pop_seconds * per_frame,
+            rewind_timing.round_trip_seconds * per_frame);
+    fprintf(out, "env checks:          %u ok, %u mismatched\n", env_counts[0], env_counts[1]);
+
+    if (json_path && !write_json(json_path, use_jit ? "jit" : use_aot ? "aot" : use_lanes ? "lanes" : "interpreter", quirks, cycles, repeat, results, checks, failures)) {
+        fprintf(stderr, "Unable to write %s\n", json_path);
+        return 1;
+    }
+    if (write_golden_path && !write_golden(write_golden_path, checks)) {
+        fprintf(stderr, "Unable to write %s\n", write_golden_path);
+        return 1;
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -1,17 +1,24 @@
 #include "chip8.h"
+#include "chip8_quirks.h"
+#include "hash.h"
 
+#include <atomic>
 #include <memory.h>
+#include <string.h>
 #include <assert.h>
-#include <stdlib.h>
 
-#define MEMORY_SIZE 4096
-#define PROGRAM_OFFSET 512
-#define NUM_REGISTERS 16
-#define STACK_SIZE 16
-#define SCREEN_BYTES (CHIP8_SCR_H * CHIP8_SCR_W)
+#if CHIP8_PROFILE
+#include "chip8_profile.h"
+#include <chrono>
+#endif
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+#define PROGRAM_OFFSET CHIP8_PROGRAM_OFFSET
+#define NUM_REGISTERS CHIP8_NUM_REGISTERS
+#define STACK_SIZE CHIP8_STACK_SIZE
 #define FONT_HEIGHT 5
 
-static uint8_t M[MEMORY_SIZE] = {
+static const uint8_t font[16 * FONT_HEIGHT] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -29,293 +36,825 @@ static uint8_t M[MEMORY_SIZE] = {
     0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
     0xF0, 0x80, 0xF0, 0x80, 0x80, // F
 };
-static uint16_t PC; // program counter
-static uint8_t V[NUM_REGISTERS]; // registers
-static uint16_t I;
-static uint8_t delay_timer;
-static uint8_t sound_timer;
-static uint16_t stack[STACK_SIZE];
-static uint8_t SP; // stack pointer
-static uint32_t cycle_counter;
 
-void chip8_init(const uint8_t *program, uint32_t program_size) {
-    memcpy(M + PROGRAM_OFFSET, program, program_size);
-    PC = PROGRAM_OFFSET;
-    cycle_counter = CHIP8_CYCLES_PER_TIMER;
+static Chip8 default_machine;
+// Source of Chip8::generation, shared by every machine in the process.
+static std::atomic<uint32_t> generations(0);
+
+// xorshift32, kept per machine so Cxkk never touches shared state.
+uint32_t chip8_machine_random(Chip8 *c8) {
+    uint32_t x = c8->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c8->rng_state = x;
+    return x;
 }
 
-void chip8_do_cycle(uint8_t screen[CHIP8_SCR_H][CHIP8_SCR_W], const bool keys[CHIP8_NUM_KEYS]) {
-    switch (M[PC] >> 4) {
-        case 0x0: {
-            assert(M[PC] == 0);
-            switch (M[PC + 1]) {
-                case 0xe0:
-                    memset(screen, 0, SCREEN_BYTES);
-                    PC += 2;
-                    break;
-                case 0xee:
-                    assert(SP > 0);
-                    PC = stack[--SP];
-                    break;
-                default: assert(!"Unknown instruction");
+void chip8_machine_seed(Chip8 *c8, uint32_t seed) {
+    // xorshift never leaves the all-zero state.
+    c8->rng_state = seed ? seed : CHIP8_DEFAULT_SEED;
+}
+
+void chip8_machine_init(Chip8 *c8, const uint8_t *program, uint32_t program_size) {
+    assert(program_size <= CHIP8_MAX_PROGRAM_SIZE);
+    memset(c8, 0, sizeof(*c8));
+    c8->generation = ++generations;
+    memcpy(c8->M, font, sizeof(font));
+    memcpy(c8->M + PROGRAM_OFFSET, program, program_size);
+    c8->PC = PROGRAM_OFFSET;
+    c8->cycles_per_timer = CHIP8_CYCLES_PER_TIMER;
+    c8->cycle_counter = c8->cycles_per_timer;
+    chip8_machine_seed(c8, CHIP8_DEFAULT_SEED);
+    c8->dirty_rows = CHIP8_ALL_ROWS;
+}
+
+uint32_t chip8_machine_take_dirty_rows(Chip8 *c8) {
+    uint32_t rows = c8->dirty_rows;
+    c8->dirty_rows = 0;
+    return rows;
+}
+
+// X-macro list of decoded handlers. Order defines the handler ids stored in Chip8Op.
+#define CHIP8_OPS(X) \
+    X(DECODE) X(UNKNOWN) \
+    X(CLS) X(RET) X(JP) X(CALL) X(SE_K) X(SNE_K) X(SE_V) X(LD_K) X(ADD_K) \
+    X(LD_V) X(OR) X(AND) X(XOR) X(ADD_V) X(SUB) X(SHR) X(SUBN) X(SHL) X(SNE_V) \
+    X(LD_I) X(RND) X(DRW) X(SKP) X(SKNP) \
+    X(GET_DT) X(WAIT_KEY) X(SET_DT) X(SET_ST) X(ADD_I) X(LD_F) X(BCD) X(STORE) X(LOAD) \
+    X(JP_V0) \
+    X(LD_I_DRW) X(LD_I_ADD_I) X(ADD_I_LOAD) X(LD_K_LD_K) X(ADD_K_SE_K_JP)
+
+#define MAKE_ENUM(name) OP_##name,
+enum { CHIP8_OPS(MAKE_ENUM) NUM_OPS };
+#undef MAKE_ENUM
+static_assert(NUM_OPS <= CHIP8_MAX_OPS, "CHIP8_MAX_OPS too small");
+static_assert(OP_DECODE == CHIP8_OP_DECODE, "CHIP8_OP_DECODE does not match the handler list");
+
+const char *chip8_quirks_name(uint32_t quirks) {
+    static const char *const names[CHIP8_NUM_QUIRKS] = { "legacy", "vip", "chip48", "schip" };
+    return quirks < CHIP8_NUM_QUIRKS ? names[quirks] : NULL;
+}
+
+uint32_t chip8_quirks_from_name(const char *name) {
+    uint32_t quirks = 0;
+    while (quirks < CHIP8_NUM_QUIRKS && strcmp(chip8_quirks_name(quirks), name) != 0) quirks++;
+    return quirks;
+}
+
+const char *chip8_fault_name(uint32_t fault) {
+    static const char *const names[CHIP8_NUM_FAULTS] = {
+        "none", "unknown opcode", "stack overflow", "stack underflow", "PC out of range", "memory out of range", "bad key",
+    };
+    return fault < CHIP8_NUM_FAULTS ? names[fault] : NULL;
+}
+
+const char *chip8_op_name(uint32_t handler) {
+#define MAKE_NAME(name) #name,
+    static const char *const names[NUM_OPS] = { CHIP8_OPS(MAKE_NAME) };
+#undef MAKE_NAME
+    return handler < NUM_OPS ? names[handler] : NULL;
+}
+
+static uint8_t decode_handler(uint8_t hi, uint8_t lo) {
+    switch (hi >> 4) {
+        case 0x0:
+            if (hi != 0) break; // 0nnn calls machine code
+            switch (lo) {
+                case 0xe0: return OP_CLS;
+                case 0xee: return OP_RET;
             }
             break;
-        }
-        case 0x1: {
-            uint16_t addr = ((M[PC] & 0xF) << 8) | M[PC + 1];
-            PC = addr;
-            break;
-        }
-        case 0x2: {
-            uint16_t addr = ((M[PC] & 0xF) << 8) | M[PC + 1];
-            PC += 2;
-            assert(SP < STACK_SIZE);
-            stack[SP++] = PC;
-            PC = addr;
+        case 0x1: return OP_JP;
+        case 0x2: return OP_CALL;
+        case 0x3: return OP_SE_K;
+        case 0x4: return OP_SNE_K;
+        case 0x5: return OP_SE_V;
+        case 0x6: return OP_LD_K;
+        case 0x7: return OP_ADD_K;
+        case 0x8:
+            switch (lo & 0xF) {
+                case 0x0: return OP_LD_V;
+                case 0x1: return OP_OR;
+                case 0x2: return OP_AND;
+                case 0x3: return OP_XOR;
+                case 0x4: return OP_ADD_V;
+                case 0x5: return OP_SUB;
+                case 0x6: return OP_SHR;
+                case 0x7: return OP_SUBN;
+                case 0xe: return OP_SHL;
+            }
             break;
-        }
-        case 0x3: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t k = M[PC + 1];
-            PC += 2;
-            if (V[x] == k) PC += 2;
+        case 0x9: return OP_SNE_V;
+        case 0xa: return OP_LD_I;
+        case 0xb: return OP_JP_V0;
+        case 0xc: return OP_RND;
+        case 0xd: return OP_DRW;
+        case 0xe:
+            switch (lo) {
+                case 0x9e: return OP_SKP;
+                case 0xa1: return OP_SKNP;
+            }
             break;
-        }
-        case 0x4: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t k = M[PC + 1];
-            PC += 2;
-            if (V[x] != k) PC += 2;
+        case 0xf:
+            switch (lo) {
+                case 0x07: return OP_GET_DT;
+                case 0x0a: return OP_WAIT_KEY;
+                case 0x15: return OP_SET_DT;
+                case 0x18: return OP_SET_ST;
+                case 0x1e: return OP_ADD_I;
+                case 0x29: return OP_LD_F;
+                case 0x33: return OP_BCD;
+                case 0x55: return OP_STORE;
+                case 0x65: return OP_LOAD;
+            }
             break;
-        }
-        case 0x5: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t y = M[PC + 1] >> 4;
-            PC += 2;
-            if (V[x] == V[y]) PC += 2;
+    }
+    return OP_UNKNOWN;
+}
+
+// Common sequences that start at addr and run as one fused handler: sprite
+// drawing, table lookups, register setup and counted loops. Matched on the raw
+// bytes that follow, so data behind the last instruction is never decoded.
+static uint8_t fuse_handler(const uint8_t *M, uint32_t addr, uint8_t handler) {
+    if (addr + 3 >= MEMORY_SIZE) return handler;
+    const uint8_t hi = M[addr + 2];
+    const uint8_t lo = M[addr + 3];
+    switch (handler) {
+        case OP_LD_I:
+            if ((hi >> 4) == 0xD) return OP_LD_I_DRW;
+            if ((hi >> 4) == 0xF && lo == 0x1E) return OP_LD_I_ADD_I;
             break;
-        }
-        case 0x6: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t k = M[PC + 1];
-            V[x] = k;
-            PC += 2;
+        case OP_ADD_I:
+            if ((hi >> 4) == 0xF && lo == 0x65) return OP_ADD_I_LOAD;
             break;
-        }
-        case 0x7: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t k = M[PC + 1];
-            V[x] += k;
-            PC += 2;
+        case OP_LD_K:
+            if ((hi >> 4) == 0x6) return OP_LD_K_LD_K;
             break;
-        }
-        case 0x8: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t y = M[PC + 1] >> 4;
-            switch (M[PC + 1] & 0xF) {
-                case 0x0: {
-                    V[x] = V[y];
-                    PC += 2;
-                    break;
-                }
-                case 0x1: {
-                    V[x] = V[x] | V[y];
-                    PC += 2;
-                    break;
-                }
-                case 0x2: {
-                    V[x] = V[x] & V[y];
-                    PC += 2;
-                    break;
-                }
-                case 0x3: {
-                    V[x] = V[x] ^ V[y];
-                    PC += 2;
-                    break;
-                }
-                case 0x4: {
-                    uint32_t result = V[x] + V[y];
-                    if (result > 0xFF) V[0xF] = 1;
-                    V[x] = result & 0xFF;
-                    PC += 2;
-                    break;
-                }
-                case 0x5: {
-                    V[0xF] = V[x] > V[y];
-                    V[x] = V[x] - V[y];
-                    PC += 2;
-                    break;
-                }
-                case 0x6: {
-                    V[0xF] = V[x] & 0x1;
-                    V[x] >>= 1;
-                    PC += 2;
-                    break;
-                }
-                case 0x7: {
-                    V[0xF] = V[y] > V[x];
-                    V[x] = V[y] - V[x];
-                    PC += 2;
-                    break;
-                }
-                case 0xe: {
-                    V[0xF] = V[x] & 0x80;
-                    V[x] <<= 1;
-                    PC += 2;
-                    break;
-                }
-                default: assert(!"Unknown instruction");
+        case OP_ADD_K:
+            // Jumps to themselves stay with JP, which idles on them.
+            if ((hi >> 4) == 0x3 && addr + 5 < MEMORY_SIZE && (M[addr + 4] >> 4) == 0x1 &&
+                (((M[addr + 4] & 0xF) << 8) | M[addr + 5]) != addr + 4) {
+                return OP_ADD_K_SE_K_JP;
             }
             break;
+    }
+    return handler;
+}
+
+static void decode_fields(Chip8 *c8, uint32_t addr) {
+    const uint8_t hi = c8->M[addr];
+    const uint8_t lo = c8->M[addr + 1];
+    Chip8Op *op = &c8->decoded[addr];
+    op->x = hi & 0xF;
+    op->y = lo >> 4;
+    op->n = lo & 0xF;
+    op->kk = lo;
+    op->nnn = ((hi & 0xF) << 8) | lo;
+}
+
+static void decode(Chip8 *c8, uint16_t addr) {
+    Chip8Op *op = &c8->decoded[addr];
+    const uint8_t handler = decode_handler(c8->M[addr], c8->M[addr + 1]);
+    decode_fields(c8, addr);
+    op->handler = fuse_handler(c8->M, addr, handler);
+    if (op->handler == handler) return;
+    // Fused handlers take the operands of the later instructions from their
+    // own entries, whose handlers stay as they are.
+    decode_fields(c8, addr + 2);
+    if (op->handler == OP_ADD_K_SE_K_JP) decode_fields(c8, addr + 4);
+}
+
+bool chip8_op_exists(uint8_t hi, uint8_t lo, uint32_t quirks) {
+    const uint8_t handler = decode_handler(hi, lo);
+    if (handler != OP_JP_V0) return handler != OP_UNKNOWN;
+    switch (quirks) {
+        case CHIP8_QUIRKS_VIP: return QuirksVip::has_jump;
+        case CHIP8_QUIRKS_CHIP48: return QuirksChip48::has_jump;
+        case CHIP8_QUIRKS_SCHIP: return QuirksSchip::has_jump;
+        default: return QuirksLegacy::has_jump;
+    }
+}
+
+void chip8_machine_predecode(Chip8 *c8, uint32_t addr) {
+    assert(addr + 1 < MEMORY_SIZE);
+    decode(c8, (uint16_t)addr);
+}
+
+// A write to `addr` changes the opcodes starting at addr - 1 and addr, and the
+// fused sequences of up to three instructions that include them.
+static void invalidate(Chip8 *c8, uint32_t first, uint32_t last) {
+    c8->memory_writes++;
+    first = first > 5 ? first - 5 : 0;
+    if (last >= MEMORY_SIZE) last = MEMORY_SIZE - 1;
+    for (uint32_t addr = first; addr <= last; ++addr) c8->decoded[addr].handler = OP_DECODE;
+}
+
+// Lets `cycles` cycles pass without executing anything, given `counter` cycles
+// until the next tick. Returns the new counter.
+static uint32_t advance_timers(Chip8 *c8, uint32_t counter, uint32_t cycles) {
+    if (cycles < counter) return counter - cycles;
+    cycles -= counter;
+    const uint32_t ticks = 1 + cycles / c8->cycles_per_timer;
+    c8->delay_timer = c8->delay_timer > ticks ? c8->delay_timer - ticks : 0;
+    c8->sound_timer = c8->sound_timer > ticks ? c8->sound_timer - ticks : 0;
+    return c8->cycles_per_timer - cycles % c8->cycles_per_timer;
+}
+
+#if defined(__GNUC__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+// GCC otherwise merges the identical dispatch tails of all handlers into one
+// shared indirect jump, which throws away the point of threaded dispatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#define THREADED_DISPATCH_FUNC __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define THREADED_DISPATCH_FUNC
+#endif
+
+template <typename Quirks>
+THREADED_DISPATCH_FUNC
+static uint32_t run(Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]) {
+
+    uint16_t PC = c8->PC;
+    uint8_t *V = c8->V;
+    uint32_t counter = c8->cycle_counter;
+    uint32_t remaining = cycles;
+    // Cycles left until the next timer tick or the end of the run, whichever comes first.
+    uint32_t chunk = counter < remaining ? counter : remaining;
+    uint32_t budget = chunk;
+    const Chip8Op *op;
+
+#if CHIP8_PROFILE
+    Chip8Profile *const profile = c8->profile;
+    // DECODE runs before the handler it decodes, so it counts cache misses, not instructions.
+#define PROFILE_COUNT(name) do { \
+        if (profile) { \
+            profile->op_counts[OP_##name]++; \
+            if (OP_##name != OP_DECODE) profile->pc_counts[PC]++; \
+        } \
+    } while (0)
+#define PROFILE_IDLE(cycles) do { \
+        if (profile) profile->idle_cycles += (cycles); \
+    } while (0)
+#else
+#define PROFILE_COUNT(name) do {} while (0)
+#define PROFILE_IDLE(cycles) do {} while (0)
+#endif
+
+#if COMPUTED_GOTO
+#define MAKE_LABEL(name) &&L_##name,
+    static void *const labels[NUM_OPS] = { CHIP8_OPS(MAKE_LABEL) };
+#undef MAKE_LABEL
+#define HANDLER(name) L_##name: PROFILE_COUNT(name);
+#define DISPATCH() do { op = &c8->decoded[PC]; goto *labels[op->handler]; } while (0)
+#else
+#define HANDLER(name) case OP_##name: L_##name: PROFILE_COUNT(name);
+#define DISPATCH() goto dispatch
+#endif
+// Fused handlers count as the first instruction of their sequence and every
+// later one as itself, so profiles come out the same with or without fusion.
+#if COMPUTED_GOTO
+#define FUSED_HANDLER(name, first) L_##name: PROFILE_COUNT(first);
+#else
+#define FUSED_HANDLER(name, first) case OP_##name: PROFILE_COUNT(first);
+#endif
+
+    // Every handler ends with NEXT(), which jumps straight to the handler of the
+    // following instruction. Timer ticks and the end of the run are only checked
+    // when the budget for the current chunk runs out.
+#define NEXT() do { \
+        if (--budget == 0) goto chunk_done; \
+        DISPATCH(); \
+    } while (0)
+
+    // Within a fused handler: moves on to the next instruction of the sequence,
+    // which takes its own cycle off the budget like after NEXT(), so timer ticks
+    // and the end of the run fall on the same instruction as without fusion.
+    // FUSED_STEP continues in the same handler, NEXT_IS jumps straight to the
+    // handler `name` instead of dispatching.
+#define FUSED_STEP(name) do { \
+        if (--budget == 0) goto chunk_done; \
+        op = &c8->decoded[PC]; \
+        PROFILE_COUNT(name); \
+    } while (0)
+#define NEXT_IS(name) do { \
+        if (--budget == 0) goto chunk_done; \
+        op = &c8->decoded[PC]; \
+        goto L_##name; \
+    } while (0)
+
+    // For handlers that know the machine will keep repeating the same steps
+    // without observable effect until the timers change: account the rest of
+    // the chunk as executed and go straight to the tick.
+#define IDLE_UNTIL_TICK() do { \
+        c8->idle_cycles += budget - 1; \
+        PROFILE_IDLE(budget - 1); \
+        goto chunk_done; \
+    } while (0)
+    // Same, for waits that nothing but new keys can end.
+#define IDLE_UNTIL_END() do { \
+        const uint32_t executed = chunk - budget; \
+        c8->idle_cycles += remaining - executed - 1; \
+        PROFILE_IDLE(remaining - executed - 1); \
+        counter = advance_timers(c8, counter - executed, remaining - executed); \
+        goto run_done; \
+    } while (0)
+    // Stops the machine at the current instruction instead of executing it;
+    // the rest of the run passes as if idle.
+#define FAULT(code) do { \
+        if (!c8->fault) { \
+            c8->fault = code; \
+            c8->fault_pc = PC; \
+        } \
+        IDLE_UNTIL_END(); \
+    } while (0)
+
+    DISPATCH();
+#if !COMPUTED_GOTO
+dispatch:
+    op = &c8->decoded[PC];
+    switch (op->handler) {
+#endif
+    HANDLER(DECODE) {
+        if (PC >= MEMORY_SIZE - 1) FAULT(CHIP8_FAULT_PC_OUT_OF_RANGE);
+        decode(c8, PC);
+        DISPATCH();
+    }
+    HANDLER(UNKNOWN) {
+        FAULT(CHIP8_FAULT_UNKNOWN_OPCODE);
+    }
+    HANDLER(CLS) {
+        for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+            if (c8->screen[row]) c8->dirty_rows |= 1u << row;
         }
-        case 0x9: {
-            uint8_t x = M[PC] & 0xF;
-            uint8_t y = M[PC + 1] >> 4;
-            PC += 2;
-            if (V[x] != V[y]) {
-                PC += 2;
-            }
-            break;
+        memset(c8->screen, 0, sizeof(c8->screen));
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(RET) {
+        if (c8->SP == 0) FAULT(CHIP8_FAULT_STACK_UNDERFLOW);
+        PC = c8->stack[--c8->SP];
+        NEXT();
+    }
+    HANDLER(JP) {
+        // A jump to itself only ever waits for the end of the run.
+        if (op->nnn == PC) IDLE_UNTIL_END();
+        PC = op->nnn;
+        NEXT();
+    }
+    HANDLER(CALL) {
+        if (c8->SP >= STACK_SIZE) FAULT(CHIP8_FAULT_STACK_OVERFLOW);
+        c8->stack[c8->SP++] = PC + 2;
+        PC = op->nnn;
+        NEXT();
+    }
+    HANDLER(SE_K) {
+        PC += (V[op->x] == op->kk) ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(SNE_K) {
+        PC += (V[op->x] != op->kk) ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(SE_V) {
+        PC += (V[op->x] == V[op->y]) ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(LD_K) {
+        V[op->x] = op->kk;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(ADD_K) {
+        V[op->x] += op->kk;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(LD_V) {
+        V[op->x] = V[op->y];
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(OR) {
+        V[op->x] |= V[op->y];
+        if (Quirks::vf_reset) V[0xF] = 0;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(AND) {
+        V[op->x] &= V[op->y];
+        if (Quirks::vf_reset) V[0xF] = 0;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(XOR) {
+        V[op->x] ^= V[op->y];
+        if (Quirks::vf_reset) V[0xF] = 0;
+        PC += 2;
+        NEXT();
+    }
+    // The non-legacy flag handlers write the result first, so VF as a
+    // destination ends up holding the flag.
+    HANDLER(ADD_V) {
+        uint32_t result = V[op->x] + V[op->y];
+        if (Quirks::legacy_flags) {
+            if (result > 0xFF) V[0xF] = 1;
+            V[op->x] = result & 0xFF;
         }
-        case 0xa: {
-            uint16_t addr = ((M[PC] & 0xF) << 8) | M[PC + 1];
-            I = addr;
-            PC += 2;
-            break;
+        else {
+            V[op->x] = result & 0xFF;
+            V[0xF] = result > 0xFF;
         }
-        case 0xc: {
-            uint8_t reg = M[PC] & 0xF;
-            uint8_t mask = M[PC + 1];
-            uint8_t val = (rand() % 0x100) & mask;
-            V[reg] = val;
-            PC += 2;
-            break;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SUB) {
+        if (Quirks::legacy_flags) {
+            V[0xF] = V[op->x] > V[op->y];
+            V[op->x] = V[op->x] - V[op->y];
+        }
+        else {
+            const uint8_t flag = V[op->x] >= V[op->y];
+            V[op->x] = V[op->x] - V[op->y];
+            V[0xF] = flag;
+        }
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SHR) {
+        if (Quirks::legacy_flags) {
+            V[0xF] = V[op->x] & 0x1;
+            V[op->x] >>= 1;
+        }
+        else {
+            const uint8_t source = V[Quirks::shift_vy ? op->y : op->x];
+            V[op->x] = source >> 1;
+            V[0xF] = source & 0x1;
+        }
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SUBN) {
+        if (Quirks::legacy_flags) {
+            V[0xF] = V[op->y] > V[op->x];
+            V[op->x] = V[op->y] - V[op->x];
+        }
+        else {
+            const uint8_t flag = V[op->y] >= V[op->x];
+            V[op->x] = V[op->y] - V[op->x];
+            V[0xF] = flag;
+        }
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SHL) {
+        if (Quirks::legacy_flags) {
+            V[0xF] = V[op->x] & 0x80;
+            V[op->x] <<= 1;
+        }
+        else {
+            const uint8_t source = V[Quirks::shift_vy ? op->y : op->x];
+            V[op->x] = source << 1;
+            V[0xF] = source >> 7;
         }
-        case 0xd: {
-            uint8_t xReg = M[PC] & 0xF;
-            uint8_t yReg = M[PC + 1] >> 4;
-            uint8_t height = M[PC + 1] & 0xF;
-            uint8_t collision = 0;
-            for (uint8_t row = 0; row < height; ++row) {
-                uint8_t curY = V[yReg] + row;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SNE_V) {
+        PC += (V[op->x] != V[op->y]) ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(LD_I) {
+        c8->I = op->nnn;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(RND) {
+        V[op->x] = (chip8_machine_random(c8) % 0x100) & op->kk;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(DRW) {
+        // Each sprite row lands in one screen word: shift it into place, then
+        // collision is a single AND and drawing a single XOR. Pixels shifted
+        // past the right edge fall off, which is the clipping we want.
+#if CHIP8_PROFILE
+        const auto draw_start = std::chrono::steady_clock::now();
+#endif
+        if (c8->I + op->n > MEMORY_SIZE) FAULT(CHIP8_FAULT_MEMORY_OUT_OF_RANGE);
+        const uint8_t x0 = Quirks::wrap_start ? V[op->x] % CHIP8_SCR_W : V[op->x];
+        const uint8_t y0 = Quirks::wrap_start ? V[op->y] % CHIP8_SCR_H : V[op->y];
+        uint64_t collision = 0;
+        if (x0 < CHIP8_SCR_W) {
+            for (uint8_t row = 0; row < op->n; ++row) {
+                uint8_t curY = y0 + row;
                 if (curY >= CHIP8_SCR_H) break;
-                uint8_t spriteRow = M[I + row];
-                for (uint8_t col = 0; col < 8; ++col) {
-                    uint8_t curX = V[xReg] + col;
-                    if (curX >= CHIP8_SCR_W) break;
-                    uint8_t spriteBit = (spriteRow >> (7 - col)) & 1;
-                    if (collision == 0) collision = screen[curY][curX] & spriteBit;
-                    screen[curY][curX] ^= spriteBit;
-                }
+                uint64_t bits = ((uint64_t)c8->M[c8->I + row] << (CHIP8_SCR_W - 8)) >> x0;
+                collision |= c8->screen[curY] & bits;
+                c8->screen[curY] ^= bits;
+                if (bits) c8->dirty_rows |= 1u << curY;
             }
-            V[0xF] = collision;
-            PC += 2;
-            break;
         }
-        case 0xe: {
-            switch (M[PC + 1]) {
-                case 0x9e: {
-                    uint8_t reg = M[PC] & 0xF;
-                    uint8_t key = V[reg];
-                    assert(key <= 0xF);
-                    PC += 2;
-                    if (keys[key]) PC += 2;
-                    break;
-                }
-                case 0xa1: {
-                    uint8_t reg = M[PC] & 0xF;
-                    uint8_t key = V[reg];
-                    assert(key <= 0xF);
-                    PC += 2;
-                    if (!keys[key]) PC += 2;
-                    break;
-                }
-                default: assert(!"Unknown instruction");
+        V[0xF] = collision != 0;
+#if CHIP8_PROFILE
+        if (profile) {
+            profile->draw_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - draw_start).count();
+        }
+#endif
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SKP) {
+        uint8_t key = V[op->x];
+        if (key > 0xF) FAULT(CHIP8_FAULT_BAD_KEY);
+        c8->key_reads++;
+        PC += keys[key] ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(SKNP) {
+        uint8_t key = V[op->x];
+        if (key > 0xF) FAULT(CHIP8_FAULT_BAD_KEY);
+        c8->key_reads++;
+        PC += !keys[key] ? 4 : 2;
+        NEXT();
+    }
+    HANDLER(GET_DT) {
+        V[op->x] = c8->delay_timer;
+        // Polling loop "Fx07; 3xkk; 1nnn back to the Fx07" that has to wait
+        // for the timer: nothing changes until the next tick except which of
+        // the three instructions the chunk ends on.
+        if (PC + 4 < MEMORY_SIZE) {
+            const Chip8Op *test = &c8->decoded[PC + 2];
+            const Chip8Op *jump = &c8->decoded[PC + 4];
+            if (test->handler == OP_SE_K && test->x == op->x && test->kk != V[op->x] &&
+                jump->handler == OP_JP && jump->nnn == PC) {
+                PC += 2 * (budget % 3);
+                IDLE_UNTIL_TICK();
             }
-            break;
         }
-        case 0xf: {
-            switch (M[PC + 1]) {
-                case 0x07: {
-                    uint8_t x = M[PC] & 0xF;
-                    V[x] = delay_timer;
-                    PC += 2;
-                    break;
-                }
-                case 0x0a: {
-                    uint8_t x = M[PC] & 0xF;
-                    for (uint8_t key = 0; key < CHIP8_NUM_KEYS; ++key) {
-                        if (keys[key]) {
-                            V[x] = key;
-                            PC += 2;
-                            break;
-                        }
-                    }
-                    break;
-                }
-                case 0x15: {
-                    uint8_t x = M[PC] & 0xF;
-                    delay_timer = V[x];
-                    PC += 2;
-                    break;
-                }
-                case 0x18: {
-                    uint8_t x = M[PC] & 0xF;
-                    sound_timer = V[x];
-                    PC += 2;
-                    break;
-                }
-                case 0x1e: {
-                    uint8_t x = M[PC] & 0xF;
-                    I += V[x];
-                    PC += 2;
-                    break;
-                }
-                case 0x29: {
-                    uint8_t x = M[PC] & 0xF;
-                    assert(V[x] <= 0xF);
-                    I = FONT_HEIGHT * V[x];
-                    PC += 2;
-                    break;
-                }
-                case 0x33: {
-                    uint8_t x = M[PC] & 0xF;
-                    uint8_t hundreds = V[x] / 100;
-                    uint8_t tens = (V[x] % 100) / 10;
-                    uint8_t ones = V[x] % 10;
-                    M[I + 0] = hundreds;
-                    M[I + 1] = tens;
-                    M[I + 2] = ones;
-                    PC += 2;
-                    break;
-                }
-                case 0x55: {
-                    uint8_t end_reg = M[PC] & 0xF;
-                    for (uint8_t i = 0; i <= end_reg; ++i) M[I + i] = V[i];
-                    PC += 2;
-                    break;
-                }
-                case 0x65: {
-                    uint8_t end_reg = M[PC] & 0xF;
-                    for (uint8_t i = 0; i <= end_reg; ++i) V[i] = M[I + i];
-                    PC += 2;
-                    break;
-                }
-                default: assert(!"Unknown instruction");
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(WAIT_KEY) {
+        c8->key_reads++;
+        for (uint8_t key = 0; key < CHIP8_NUM_KEYS; ++key) {
+            if (keys[key]) {
+                V[op->x] = key;
+                PC += 2;
+                NEXT();
             }
-            break;
         }
-        default: assert(!"Unknown instruction");
+        // Keys are fixed for the whole run, so this waits until the run ends.
+        IDLE_UNTIL_END();
+    }
+    HANDLER(SET_DT) {
+        c8->delay_timer = V[op->x];
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(SET_ST) {
+        c8->sound_timer = V[op->x];
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(ADD_I) {
+        c8->I += V[op->x];
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(LD_F) {
+        // Digits past F point I at whatever follows the font, still inside M.
+        c8->I = FONT_HEIGHT * V[op->x];
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(BCD) {
+        const uint8_t value = V[op->x];
+        const uint16_t I = c8->I;
+        if (I + 3 > MEMORY_SIZE) FAULT(CHIP8_FAULT_MEMORY_OUT_OF_RANGE);
+        c8->M[I + 0] = value / 100;
+        c8->M[I + 1] = (value % 100) / 10;
+        c8->M[I + 2] = value % 10;
+        invalidate(c8, I, I + 2);
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(STORE) {
+        const uint8_t end_reg = op->x;
+        const uint16_t I = c8->I;
+        if (I + end_reg + 1 > MEMORY_SIZE) FAULT(CHIP8_FAULT_MEMORY_OUT_OF_RANGE);
+        for (uint8_t i = 0; i <= end_reg; ++i) c8->M[I + i] = V[i];
+        invalidate(c8, I, I + end_reg);
+        if (Quirks::store_i == STORE_I_PLUS_X) c8->I += end_reg;
+        if (Quirks::store_i == STORE_I_PLUS_X_PLUS_1) c8->I += end_reg + 1;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(LOAD) {
+        const uint8_t end_reg = op->x;
+        if (c8->I + end_reg + 1 > MEMORY_SIZE) FAULT(CHIP8_FAULT_MEMORY_OUT_OF_RANGE);
+        for (uint8_t i = 0; i <= end_reg; ++i) V[i] = c8->M[c8->I + i];
+        if (Quirks::store_i == STORE_I_PLUS_X) c8->I += end_reg;
+        if (Quirks::store_i == STORE_I_PLUS_X_PLUS_1) c8->I += end_reg + 1;
+        PC += 2;
+        NEXT();
+    }
+    HANDLER(JP_V0) {
+        if (!Quirks::has_jump) FAULT(CHIP8_FAULT_UNKNOWN_OPCODE);
+        PC = (op->nnn + V[Quirks::jump_vx ? op->x : 0]) & 0xFFF;
+        NEXT();
+    }
+    FUSED_HANDLER(LD_I_DRW, LD_I) {
+        c8->I = op->nnn;
+        PC += 2;
+        NEXT_IS(DRW);
+    }
+    FUSED_HANDLER(LD_I_ADD_I, LD_I) {
+        c8->I = op->nnn;
+        PC += 2;
+        NEXT_IS(ADD_I);
+    }
+    FUSED_HANDLER(ADD_I_LOAD, ADD_I) {
+        c8->I += V[op->x];
+        PC += 2;
+        NEXT_IS(LOAD);
+    }
+    FUSED_HANDLER(LD_K_LD_K, LD_K) {
+        V[op->x] = op->kk;
+        PC += 2;
+        FUSED_STEP(LD_K);
+        V[op->x] = op->kk;
+        PC += 2;
+        NEXT();
+    }
+    FUSED_HANDLER(ADD_K_SE_K_JP, ADD_K) {
+        V[op->x] += op->kk;
+        PC += 2;
+        FUSED_STEP(SE_K);
+        if (V[op->x] == op->kk) {
+            PC += 4;
+            NEXT();
+        }
+        PC += 2;
+        FUSED_STEP(JP);
+        PC = op->nnn;
+        NEXT();
+    }
+#if !COMPUTED_GOTO
     }
+#endif
 
-    cycle_counter--;
-    if (cycle_counter == 0) {
-        cycle_counter = CHIP8_CYCLES_PER_TIMER;
-        if (delay_timer > 0) delay_timer--;
-        if (sound_timer > 0) sound_timer--;
+chunk_done:
+    counter -= chunk;
+    remaining -= chunk;
+    if (counter == 0) {
+        counter = c8->cycles_per_timer;
+        if (c8->delay_timer > 0) c8->delay_timer--;
+        if (c8->sound_timer > 0) c8->sound_timer--;
     }
+    if (remaining > 0) {
+        chunk = counter < remaining ? counter : remaining;
+        budget = chunk;
+        DISPATCH();
+    }
+
+run_done:
+    c8->PC = PC;
+    c8->cycle_counter = counter;
+    c8->cycles += cycles;
+    return cycles;
+
+#undef HANDLER
+#undef FUSED_HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef FUSED_STEP
+#undef NEXT_IS
+#undef IDLE_UNTIL_TICK
+#undef IDLE_UNTIL_END
+#undef FAULT
+#undef PROFILE_COUNT
+#undef PROFILE_IDLE
+}
+
+uint32_t chip8_machine_run(Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]) {
+    if (cycles == 0) return 0;
+    if (c8->fault) {
+        c8->cycle_counter = advance_timers(c8, c8->cycle_counter, cycles);
+        c8->idle_cycles += cycles;
+        c8->cycles += cycles;
+#if CHIP8_PROFILE
+        if (c8->profile) c8->profile->idle_cycles += cycles;
+#endif
+        return cycles;
+    }
+    switch (c8->quirks) {
+        case CHIP8_QUIRKS_VIP: return run<QuirksVip>(c8, cycles, keys);
+        case CHIP8_QUIRKS_CHIP48: return run<QuirksChip48>(c8, cycles, keys);
+        case CHIP8_QUIRKS_SCHIP: return run<QuirksSchip>(c8, cycles, keys);
+        default:
+            assert(c8->quirks == CHIP8_QUIRKS_LEGACY);
+            return run<QuirksLegacy>(c8, cycles, keys);
+    }
+}
+
+void chip8_machine_do_cycle(Chip8 *c8, const bool keys[CHIP8_NUM_KEYS]) {
+    chip8_machine_run(c8, 1, keys);
+}
+
+// Changed addresses passed to add() in ascending order; runs of them are
+// invalidated as one range, [first, end).
+struct Changes {
+    uint32_t first;
+    uint32_t end;
+
+    Changes() : first(0), end(0) {}
+    void add(Chip8 *c8, uint32_t addr, uint32_t size) {
+        if (addr != end) {
+            flush(c8);
+            first = addr;
+        }
+        end = addr + size;
+    }
+    void flush(Chip8 *c8) {
+        if (end > first) invalidate(c8, first, end - 1);
+    }
+};
+
+static void write_block(Chip8 *c8, uint32_t addr, const uint8_t *data, Changes *changes) {
+    if (memcmp(c8->M + addr, data, 64) == 0) return;
+    for (uint32_t word = 0; word < 64; word += 8) {
+        if (memcmp(c8->M + addr + word, data + word, 8) == 0) continue;
+        memcpy(c8->M + addr + word, data + word, 8);
+        changes->add(c8, addr + word, 8);
+    }
+}
+
+void chip8_machine_write_memory(Chip8 *c8, uint32_t addr, const uint8_t *data, uint32_t size) {
+    assert(addr + size <= MEMORY_SIZE);
+    // Compare a page, a block, then a word at a time so that writing back a
+    // mostly unchanged image is cheap and only drops the decode cache where
+    // bytes actually differ.
+    Changes changes;
+    uint32_t i = 0;
+    for (; i + 512 <= size; i += 512) {
+        if (memcmp(c8->M + addr + i, data + i, 512) == 0) continue;
+        for (uint32_t block = i; block < i + 512; block += 64) write_block(c8, addr + block, data + block, &changes);
+    }
+    for (; i + 64 <= size; i += 64) write_block(c8, addr + i, data + i, &changes);
+    for (; i < size; ++i) {
+        if (c8->M[addr + i] == data[i]) continue;
+        c8->M[addr + i] = data[i];
+        changes.add(c8, addr + i, 1);
+    }
+    changes.flush(c8);
+}
+
+// Byte pattern for every possible 8-pixel group, most significant bit first.
+struct ByteExpansion {
+    uint64_t pattern[256];
+
+    ByteExpansion() {
+        for (uint32_t bits = 0; bits < 256; ++bits) {
+            uint8_t pixels[8];
+            for (uint32_t col = 0; col < 8; ++col) pixels[col] = (bits >> (7 - col)) & 1;
+            memcpy(&pattern[bits], pixels, sizeof(pixels));
+        }
+    }
+};
+
+void chip8_screen_to_bytes(const uint64_t screen[CHIP8_SCR_H], uint32_t rows, uint8_t out[CHIP8_SCR_H][CHIP8_SCR_W]) {
+    static const ByteExpansion expansion;
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        if (!(rows & (1u << row))) continue;
+        for (uint32_t group = 0; group < CHIP8_SCR_W / 8; ++group) {
+            uint8_t bits = (uint8_t)(screen[row] >> (CHIP8_SCR_W - 8 - group * 8));
+            memcpy(&out[row][group * 8], &expansion.pattern[bits], 8);
+        }
+    }
+}
+
+uint64_t chip8_screen_hash(const uint64_t screen[CHIP8_SCR_H]) {
+    uint8_t bytes[CHIP8_SCR_H][CHIP8_SCR_W];
+    chip8_screen_to_bytes(screen, CHIP8_ALL_ROWS, bytes);
+    return hash_fnv1a(bytes, sizeof(bytes));
+}
+
+void chip8_init(const uint8_t *program, uint32_t program_size) {
+    chip8_machine_init(&default_machine, program, program_size);
+}
+
+void chip8_do_cycle(uint8_t screen[CHIP8_SCR_H][CHIP8_SCR_W], const bool keys[CHIP8_NUM_KEYS]) {
+    chip8_machine_do_cycle(&default_machine, keys);
+    uint32_t dirty_rows = chip8_machine_take_dirty_rows(&default_machine);
+    if (dirty_rows) chip8_screen_to_bytes(default_machine.screen, dirty_rows, screen);
 }
 
 uint8_t chip8_get_sound_timer() {
-    return sound_timer;
+    return default_machine.sound_timer;
 }
@@ -11,7 +11,125 @@
 #define CHIP8_SCR_H 32
 #define CHIP8_ASPECT ((float)CHIP8_SCR_W / CHIP8_SCR_H)
 #define CHIP8_NUM_KEYS 16
+#define CHIP8_ALL_ROWS 0xFFFFFFFFu
 
+#define CHIP8_MEMORY_SIZE 4096
+#define CHIP8_PROGRAM_OFFSET 512
+#define CHIP8_MAX_PROGRAM_SIZE (CHIP8_MEMORY_SIZE - CHIP8_PROGRAM_OFFSET)
+#define CHIP8_NUM_REGISTERS 16
+#define CHIP8_STACK_SIZE 16
+#define CHIP8_DEFAULT_SEED 0x2545f491u
+#define CHIP8_MAX_OPS 64 // upper bound on decoded handler ids, see chip8_op_name
+#define CHIP8_OP_DECODE 0 // handler id of a decode cache entry not filled yet
+// Highest PC a machine can reach: a skip over the last instruction in M.
+// Anything at or past CHIP8_MEMORY_SIZE - 1 faults before it is decoded.
+#define CHIP8_MAX_PC (CHIP8_MEMORY_SIZE + 2)
+
+struct Chip8Profile;
+
+// Interpretations of the opcodes that CHIP-8 implementations disagree on. Each
+// one runs on its own specialization of the interpreter.
+enum Chip8Quirks {
+    CHIP8_QUIRKS_LEGACY, // this emulator's original behavior, see QuirksLegacy in chip8_quirks.h
+    CHIP8_QUIRKS_VIP, // COSMAC VIP: shifts read Vy, Fx55/Fx65 advance I past the last register, 8xy1-3 clear VF
+    CHIP8_QUIRKS_CHIP48, // shifts use Vx, Fx55/Fx65 advance I by x, Bxnn jumps to xnn + Vx
+    CHIP8_QUIRKS_SCHIP, // SUPER-CHIP 1.1 in 64x32 mode: as CHIP-48 but I is left alone
+    CHIP8_NUM_QUIRKS
+};
+
+// Why a machine stopped. The interpreter checks every instruction that could
+// leave M, the stack or the key array; instead of executing one that would, it
+// records the first fault, keeps PC at the instruction and stops. A faulted
+// machine only lets time pass: timers and cycle counts go on as if it idled,
+// until the host clears `fault` (chip8_load_state does) to let it run again.
+enum Chip8Fault {
+    CHIP8_FAULT_NONE,
+    CHIP8_FAULT_UNKNOWN_OPCODE, // including Bnnn on quirk profiles without it
+    CHIP8_FAULT_STACK_OVERFLOW, // 2nnn with CHIP8_STACK_SIZE entries in use
+    CHIP8_FAULT_STACK_UNDERFLOW, // 00EE with an empty stack
+    CHIP8_FAULT_PC_OUT_OF_RANGE, // an instruction would be fetched from past the end of M
+    CHIP8_FAULT_MEMORY_OUT_OF_RANGE, // Dxyn, Fx33, Fx55 or Fx65 would access M past its end
+    CHIP8_FAULT_BAD_KEY, // Ex9E or ExA1 with Vx > 0xF
+    CHIP8_NUM_FAULTS
+};
+
+// One predecoded instruction: handler id plus every operand field already extracted.
+struct Chip8Op {
+    uint8_t handler;
+    uint8_t x, y, n;
+    uint8_t kk;
+    uint16_t nnn;
+};
+
+// Complete state of one emulated machine. Instances share nothing, so any number
+// of them can be stepped concurrently as long as each is owned by one thread.
+struct Chip8 {
+    uint8_t M[CHIP8_MEMORY_SIZE];
+    uint16_t PC; // program counter
+    uint8_t V[CHIP8_NUM_REGISTERS]; // registers
+    uint16_t I;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint16_t stack[CHIP8_STACK_SIZE];
+    uint8_t SP; // stack pointer
+    uint32_t cycle_counter; // cycles left until the next 60 Hz timer tick
+    uint32_t cycles_per_timer; // CPU speed: cycles per timer tick, i.e. per frame
+    uint8_t quirks; // Chip8Quirks, may be changed at any time
+    uint32_t rng_state;
+    uint64_t cycles; // cycles run since init, the time base for input logs
+    uint64_t screen[CHIP8_SCR_H]; // one bit per pixel, leftmost pixel in the top bit
+    uint32_t dirty_rows; // bit n set = screen row n changed since chip8_machine_take_dirty_rows
+    uint64_t idle_cycles; // cycles skipped rather than executed because the program was waiting
+    uint32_t generation; // new on every chip8_machine_init, so observers notice a new program at the same address
+    uint32_t memory_writes; // bumped on every store to M, lets observers notice self-modifying code
+    uint32_t key_reads; // bumped by every Ex9E, ExA1 and Fx0A that looked at the keys
+    uint8_t fault; // Chip8Fault, the first one since it was last cleared
+    uint16_t fault_pc; // address of the faulting instruction
+    Chip8Profile *profile; // counters to update when built with CHIP8_PROFILE, NULL = don't collect
+    // Decode cache keyed by address, filled lazily and cleared by writes to M.
+    // Entries that start a common sequence of instructions get a fused handler.
+    // Entries past the end of M always hold DECODE, which faults there.
+    Chip8Op decoded[CHIP8_MAX_PC + 1];
+};
+
+void chip8_machine_init(Chip8 *c8, const uint8_t *program, uint32_t program_size);
+void chip8_machine_do_cycle(Chip8 *c8, const bool keys[CHIP8_NUM_KEYS]);
+// Runs `cycles` cycles with a fixed key state and returns the number of cycles executed.
+uint32_t chip8_machine_run(Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]);
+// Copies data into M and keeps the decode cache consistent. Always use this
+// rather than writing M directly once the machine has started running.
+void chip8_machine_write_memory(Chip8 *c8, uint32_t addr, const uint8_t *data, uint32_t size);
+// Fills the decode cache entry for the instruction at addr as its first
+// execution would, so a machine can be decoded once and copied.
+void chip8_machine_predecode(Chip8 *c8, uint32_t addr);
+// Restarts the PRNG from `seed`. Machines with the same program, seed and key
+// input always produce the same results. 0 selects CHIP8_DEFAULT_SEED.
+void chip8_machine_seed(Chip8 *c8, uint32_t seed);
+// Advances the machine's PRNG, as Cxkk does, and returns the new state.
+uint32_t chip8_machine_random(Chip8 *c8);
+// Returns the rows changed since the previous call and clears them. 0 means the
+// frame is identical to the last one presented.
+uint32_t chip8_machine_take_dirty_rows(Chip8 *c8);
+
+// "legacy", "vip", "chip48" or "schip"; NULL past the last profile.
+const char *chip8_quirks_name(uint32_t quirks);
+// Inverse of chip8_quirks_name, CHIP8_NUM_QUIRKS for an unknown name.
+uint32_t chip8_quirks_from_name(const char *name);
+// "unknown opcode", "stack overflow", ...; NULL past the last fault.
+const char *chip8_fault_name(uint32_t fault);
+// Name of a decoded handler id ("DRW", "ADD_K", ...), NULL past the last one.
+const char *chip8_op_name(uint32_t handler);
+// Whether the quirk profile has the instruction hi lo, i.e. it does not fault
+// on it as CHIP8_FAULT_UNKNOWN_OPCODE. Same opcode table as the decoder.
+bool chip8_op_exists(uint8_t hi, uint8_t lo, uint32_t quirks);
+
+// Expand the packed screen for consumers that want one byte (0 or 1) per pixel. Only rows
+// whose bit is set in `rows` are written. For 32-bit colors see render_expand in render.h.
+void chip8_screen_to_bytes(const uint64_t screen[CHIP8_SCR_H], uint32_t rows, uint8_t out[CHIP8_SCR_H][CHIP8_SCR_W]);
+// hash_fnv1a of the byte-per-pixel form, the screen hash every tool prints and compares.
+uint64_t chip8_screen_hash(const uint64_t screen[CHIP8_SCR_H]);
+
+// Thin wrappers over a process-wide default machine.
 void chip8_init(const uint8_t *program, uint32_t program_size);
 void chip8_do_cycle(uint8_t screen[CHIP8_SCR_H][CHIP8_SCR_W], const bool keys[CHIP8_NUM_KEYS]);
 uint8_t chip8_get_sound_timer();
@@ -0,0 +1,117 @@
+#include "chip8_aot.h"
+#include "chip8_ops.h"
+#include "hash.h"
+
+#include <string.h>
+#include <vector>
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+
+struct Chip8Aot {
+    const Chip8AotProgram *program;
+    const Chip8 *machine; // the machine `valid` describes
+    uint32_t generation; // machine->generation when `valid` was last computed
+    uint32_t memory_writes; // machine->memory_writes when `valid` was last computed
+    uint8_t valid[MEMORY_SIZE]; // 1 at every instruction of a block whose bytes are intact
+    uint8_t covered[MEMORY_SIZE]; // 1 at every byte some block was made from
+    Chip8AotStats stats;
+};
+
+// Function-local so generated units can register from their static initializers.
+static std::vector<const Chip8AotProgram *> &registry() {
+    static std::vector<const Chip8AotProgram *> programs;
+    return programs;
+}
+
+bool chip8_aot_register(const Chip8AotProgram *program) {
+    registry().push_back(program);
+    return true;
+}
+
+const Chip8AotProgram *chip8_aot_find(const uint8_t *program, uint32_t size, uint32_t quirks) {
+    const uint64_t hash = hash_fnv1a(program, size);
+    for (const Chip8AotProgram *p : registry()) {
+        if (p->hash == hash && p->size == size && p->quirks == quirks && memcmp(p->image, program, size) == 0) return p;
+    }
+    return NULL;
+}
+
+Chip8Aot *chip8_aot_create(const Chip8AotProgram *program) {
+    Chip8Aot *aot = new Chip8Aot();
+    aot->program = program;
+    aot->machine = NULL;
+    for (uint32_t b = 0; b < program->num_blocks; ++b) {
+        const uint32_t start = program->blocks[2 * b];
+        const uint32_t length = program->blocks[2 * b + 1];
+        memset(aot->covered + start, 1, 2 * length);
+    }
+    return aot;
+}
+
+void chip8_aot_destroy(Chip8Aot *aot) {
+    delete aot;
+}
+
+Chip8AotStats chip8_aot_stats(const Chip8Aot *aot) {
+    return aot->stats;
+}
+
+static void validate(Chip8Aot *aot, const Chip8 *c8) {
+    const Chip8AotProgram *program = aot->program;
+    memset(aot->valid, 0, sizeof(aot->valid));
+    for (uint32_t b = 0; b < program->num_blocks; ++b) {
+        const uint32_t start = program->blocks[2 * b];
+        const uint32_t length = program->blocks[2 * b + 1];
+        if (memcmp(c8->M + start, program->image + (start - CHIP8_PROGRAM_OFFSET), 2 * length) != 0) continue;
+        for (uint32_t i = 0; i < length; ++i) aot->valid[start + 2 * i] = 1;
+    }
+    aot->generation = c8->generation;
+    aot->memory_writes = c8->memory_writes;
+}
+
+bool chip8_aot_code_written(Chip8Aot *aot, const Chip8 *c8, uint32_t first, uint32_t size) {
+    if (c8->memory_writes == aot->memory_writes) return false;
+    for (uint32_t addr = first; addr < first + size && addr < MEMORY_SIZE; ++addr) {
+        if (aot->covered[addr]) return true;
+    }
+    aot->memory_writes = c8->memory_writes;
+    return false;
+}
+
+uint32_t chip8_aot_run(Chip8Aot *aot, Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]) {
+    if (cycles == 0) return 0;
+    if (c8->quirks != aot->program->quirks) {
+        aot->stats.interpreted_cycles += cycles;
+        return chip8_machine_run(c8, cycles, keys);
+    }
+    if (c8 != aot->machine || c8->generation != aot->generation) {
+        aot->machine = c8;
+        validate(aot, c8);
+    }
+
+    uint32_t remaining = cycles;
+    bool trapped = false; // translated code stopped before an instruction that faults
+    while (remaining > 0) {
+        if (c8->memory_writes != aot->memory_writes) validate(aot, c8);
+        // Translated code stops at the budget, so timers only ever tick out here.
+        const uint32_t chunk = c8->cycle_counter < remaining ? c8->cycle_counter : remaining;
+        if (!trapped && !c8->fault && c8->PC < MEMORY_SIZE && aot->valid[c8->PC]) {
+            uint32_t budget = chunk;
+            const uint32_t pc = aot->program->entry(aot, c8, &budget, keys, c8->PC, aot->valid);
+            c8->PC = (uint16_t)pc;
+            trapped = (pc & CHIP8_AOT_TRAP) != 0;
+            const uint32_t executed = chunk - budget;
+            chip8_account_cycles(c8, executed);
+            remaining -= executed;
+            aot->stats.native_cycles += executed;
+            continue;
+        }
+
+        trapped = false;
+        const uint32_t run = chip8_interpret_cycles(c8, chunk, remaining, keys);
+        chip8_machine_run(c8, run, keys);
+        remaining -= run;
+        aot->stats.interpreted_cycles += run;
+    }
+    return cycles;
+}
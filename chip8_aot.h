@@ -0,0 +1,53 @@
+#pragma once
+
+#include "chip8.h"
+
+// Ahead-of-time translation. The chip8_aot tool discovers a program's code
+// from CHIP8_PROGRAM_OFFSET and writes a C++ translation unit that runs it
+// directly against the machine state (see chip8_add_aot_rom in CMakeLists.txt).
+// Linking that unit in registers the program here, keyed by the hash of its
+// image. A translated block only runs while the machine's memory still holds
+// the bytes it was made from; addresses that were not discovered, changed
+// code, idle loops and Fx0A go to the interpreter, so results match
+// chip8_machine_run cycle for cycle.
+struct Chip8Aot;
+
+// Generated code: runs from pc until *budget cycles are used up or execution
+// reaches an address whose entry in `valid` is 0, and returns where to go on,
+// with CHIP8_AOT_TRAP set if the instruction there would fault.
+#define CHIP8_AOT_TRAP 0x10000
+typedef uint32_t (*Chip8AotEntry)(Chip8Aot *aot, Chip8 *c8, uint32_t *budget, const bool *keys, uint32_t pc,
+                                  const uint8_t *valid);
+
+struct Chip8AotProgram {
+    const char *name;
+    uint64_t hash; // hash_fnv1a of the image
+    const uint8_t *image; // the program as loaded at CHIP8_PROGRAM_OFFSET
+    uint32_t size;
+    uint8_t quirks; // the Chip8Quirks the code was generated for
+    const uint16_t *blocks; // start address and instruction count of every translated block
+    uint32_t num_blocks;
+    Chip8AotEntry entry;
+};
+
+struct Chip8AotStats {
+    uint64_t native_cycles; // cycles executed by translated code
+    uint64_t interpreted_cycles; // cycles handed to chip8_machine_run
+};
+
+// Called from generated code during static initialization. Returns true.
+bool chip8_aot_register(const Chip8AotProgram *program);
+// The translation linked in for this program image and quirk profile, NULL if none.
+const Chip8AotProgram *chip8_aot_find(const uint8_t *program, uint32_t size, uint32_t quirks);
+
+// A Chip8Aot runs one machine at a time and notices when it is switched to
+// another or re-initialized.
+Chip8Aot *chip8_aot_create(const Chip8AotProgram *program);
+void chip8_aot_destroy(Chip8Aot *aot);
+// Same contract as chip8_machine_run.
+uint32_t chip8_aot_run(Chip8Aot *aot, Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]);
+Chip8AotStats chip8_aot_stats(const Chip8Aot *aot);
+
+// For generated code, after a store to [first, first + size): true when it may
+// have changed translated code, which then has to return to chip8_aot_run.
+bool chip8_aot_code_written(Chip8Aot *aot, const Chip8 *c8, uint32_t first, uint32_t size);
@@ -0,0 +1,38 @@
+#include "chip8_batch.h"
+#include "thread_pool.h"
+
+#include <stddef.h>
+
+struct BatchJob {
+    Chip8 *machines;
+    Chip8Lanes *groups;
+    uint32_t cycles;
+    const bool (*keys)[CHIP8_NUM_KEYS];
+};
+
+static const bool no_keys[CHIP8_NUM_KEYS] = {};
+static const bool no_lane_keys[CHIP8_LANES][CHIP8_NUM_KEYS] = {};
+
+static void run_machine(uint32_t index, uint32_t, void *user) {
+    const BatchJob *job = (const BatchJob *)user;
+    Chip8 *c8 = &job->machines[index];
+    const bool *keys = job->keys ? job->keys[index] : no_keys;
+    chip8_machine_run(c8, job->cycles, keys);
+}
+
+static void run_group(uint32_t index, uint32_t, void *user) {
+    const BatchJob *job = (const BatchJob *)user;
+    chip8_lanes_run(&job->groups[index], job->cycles, job->keys ? job->keys + index * CHIP8_LANES : no_lane_keys);
+}
+
+void chip8_batch_run(ThreadPool *pool, Chip8 *machines, uint32_t count, uint32_t cycles,
+                     const bool (*keys)[CHIP8_NUM_KEYS]) {
+    BatchJob job = { machines, NULL, cycles, keys };
+    thread_pool_for(pool, count, run_machine, &job);
+}
+
+void chip8_batch_run_lanes(ThreadPool *pool, Chip8Lanes *groups, uint32_t count, uint32_t cycles,
+                           const bool (*keys)[CHIP8_NUM_KEYS]) {
+    BatchJob job = { NULL, groups, cycles, keys };
+    thread_pool_for(pool, count, run_group, &job);
+}
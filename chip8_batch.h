@@ -0,0 +1,15 @@
+#pragma once
+
+#include "chip8.h"
+#include "chip8_lanes.h"
+
+struct ThreadPool;
+
+// Runs `cycles` cycles on every machine, spreading machines over the pool's threads.
+// keys holds one key array per machine and may be NULL for "no keys pressed".
+void chip8_batch_run(ThreadPool *pool, Chip8 *machines, uint32_t count, uint32_t cycles,
+                     const bool (*keys)[CHIP8_NUM_KEYS]);
+// The same for groups of lanes, a group per task. keys holds one key array per
+// lane, CHIP8_LANES per group, and may be NULL as above.
+void chip8_batch_run_lanes(ThreadPool *pool, Chip8Lanes *groups, uint32_t count, uint32_t cycles,
+                           const bool (*keys)[CHIP8_NUM_KEYS]);
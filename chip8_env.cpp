@@ -0,0 +1,245 @@
+#include "chip8_env.h"
+#include "hash.h"
+#include "input_log.h"
+#include "rom.h"
+#include "thread_pool.h"
+
+#include <vector>
+#include <string.h>
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+
+static_assert(sizeof(Chip8EnvInfo) == 12, "Chip8EnvInfo has implicit padding");
+
+struct EnvSlot {
+    Chip8 machine;
+    uint64_t previous[CHIP8_SCR_H]; // screen before the last frame, for merge_frames
+    uint32_t frames; // in the current episode
+    uint32_t episodes; // finished
+    uint32_t starts; // episodes started, chip8_env_reset included
+};
+
+struct Chip8Env {
+    const Rom *rom;
+    Chip8EnvConfig config;
+    ThreadPool *pool; // NULL for a single environment
+    std::vector<EnvSlot> slots;
+    std::vector<uint64_t> observations; // uint64_t for the alignment of bit observations
+    uint32_t observation_size;
+    std::vector<Chip8EnvInfo> info;
+    const uint16_t *key_masks; // of the step in progress
+};
+
+// Lit pixels per block in each byte value, for blocks 2, 4 and 8 pixels wide:
+// one byte per block, leftmost first, packed into a uint32_t so that the
+// counts of several rows add up without carrying into each other.
+struct BlockCounts {
+    uint32_t counts[3][256]; // by log2(width) - 1
+
+    BlockCounts() {
+        for (uint32_t shift = 1; shift <= 3; ++shift) {
+            const uint32_t width = 1u << shift;
+            for (uint32_t bits = 0; bits < 256; ++bits) {
+                uint8_t blocks[4] = {};
+                for (uint32_t col = 0; col < 8; ++col) blocks[col / width] += (bits >> (7 - col)) & 1;
+                memcpy(&counts[shift - 1][bits], blocks, sizeof(blocks));
+            }
+        }
+    }
+};
+
+void chip8_env_default_config(Chip8EnvConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->num_envs = 1;
+    config->frame_skip = 1;
+    config->observation = CHIP8_ENV_OBSERVE_BITS;
+    config->downsample = 1;
+    config->end_on_fault = true;
+    config->end_on_halt = true;
+}
+
+static void start_episode(Chip8Env *env, uint32_t i) {
+    EnvSlot *slot = &env->slots[i];
+    Chip8 *c8 = &slot->machine;
+    rom_instance_init(env->rom, c8);
+    if (env->config.cycles_per_frame) {
+        c8->cycles_per_timer = env->config.cycles_per_frame;
+        c8->cycle_counter = env->config.cycles_per_frame;
+    }
+    const uint32_t key[3] = { env->config.seed, i, slot->starts++ };
+    chip8_machine_seed(c8, (uint32_t)hash_fnv1a(key, sizeof(key)));
+    c8->dirty_rows = CHIP8_ALL_ROWS;
+    memcpy(slot->previous, c8->screen, sizeof(slot->previous));
+    slot->frames = 0;
+}
+
+// The program sits in a jump to itself.
+static bool is_halted(const Chip8 *c8) {
+    const uint32_t pc = c8->PC;
+    if (pc + 1 >= MEMORY_SIZE) return false;
+    const uint8_t hi = c8->M[pc];
+    const uint8_t lo = c8->M[pc + 1];
+    return (hi >> 4) == 0x1 && (uint32_t)(((hi & 0xF) << 8) | lo) == pc;
+}
+
+static Chip8EnvEnd episode_end(const Chip8Env *env, const EnvSlot *slot, uint32_t i) {
+    const Chip8EnvConfig &config = env->config;
+    const Chip8 *c8 = &slot->machine;
+    if (config.end_on_fault && c8->fault) return CHIP8_ENV_END_FAULT;
+    if (config.end_on_halt && is_halted(c8)) return CHIP8_ENV_END_HALT;
+    if (config.max_frames && slot->frames >= config.max_frames) return CHIP8_ENV_END_TIME_LIMIT;
+    if (config.terminal && config.terminal(c8, i, config.terminal_user)) return CHIP8_ENV_END_CALLBACK;
+    return CHIP8_ENV_RUNNING;
+}
+
+// Lit pixels per D x D block, D > 1. Output rows whose source rows are all
+// clean are left alone.
+template <uint32_t D>
+static void screen_to_blocks(const uint64_t screen[CHIP8_SCR_H], uint32_t rows, uint8_t *out) {
+    static const BlockCounts blocks;
+    const uint32_t *counts = blocks.counts[D == 2 ? 0 : D == 4 ? 1 : 2];
+    const uint32_t row_mask = (1u << D) - 1;
+    for (uint32_t r = 0; r < CHIP8_SCR_H / D; ++r) {
+        if (!(rows & (row_mask << (r * D)))) continue;
+        const uint64_t *source = &screen[r * D];
+        uint8_t *line = out + r * (CHIP8_SCR_W / D);
+        for (uint32_t group = 0; group < CHIP8_SCR_W / 8; ++group) {
+            const uint32_t shift = CHIP8_SCR_W - 8 - group * 8;
+            uint32_t lit = 0;
+            for (uint32_t k = 0; k < D; ++k) lit += counts[(uint8_t)(source[k] >> shift)];
+            memcpy(line + group * (8 / D), &lit, 8 / D);
+        }
+    }
+}
+
+static void observe(Chip8Env *env, uint32_t i) {
+    EnvSlot *slot = &env->slots[i];
+    uint32_t rows = chip8_machine_take_dirty_rows(&slot->machine);
+    const uint64_t *screen = slot->machine.screen;
+    uint64_t merged[CHIP8_SCR_H];
+    if (env->config.merge_frames) {
+        for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) merged[row] = slot->previous[row] | screen[row];
+        screen = merged;
+        rows = CHIP8_ALL_ROWS;
+    }
+    if (!rows) return;
+
+    uint8_t *out = (uint8_t *)env->observations.data() + (size_t)i * env->observation_size;
+    if (env->config.observation == CHIP8_ENV_OBSERVE_BITS) {
+        uint64_t *words = (uint64_t *)out;
+        for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+            if (rows & (1u << row)) words[row] = screen[row];
+        }
+    }
+    else {
+        switch (env->config.downsample) {
+            case 1: chip8_screen_to_bytes(screen, rows, (uint8_t(*)[CHIP8_SCR_W])out); break;
+            case 2: screen_to_blocks<2>(screen, rows, out); break;
+            case 4: screen_to_blocks<4>(screen, rows, out); break;
+            case 8: screen_to_blocks<8>(screen, rows, out); break;
+        }
+    }
+}
+
+static void step_env(uint32_t i, uint32_t, void *user) {
+    Chip8Env *env = (Chip8Env *)user;
+    EnvSlot *slot = &env->slots[i];
+    Chip8 *c8 = &slot->machine;
+    Chip8EnvInfo *info = &env->info[i];
+    bool keys[CHIP8_NUM_KEYS];
+    input_mask_to_keys(env->key_masks ? env->key_masks[i] : 0, keys);
+
+    info->done = 0;
+    info->end = CHIP8_ENV_RUNNING;
+    info->reserved[0] = info->reserved[1] = 0;
+    const uint32_t frame_skip = env->config.frame_skip;
+    for (uint32_t frame = 0; frame < frame_skip; ++frame) {
+        if (env->config.merge_frames && frame + 1 == frame_skip) memcpy(slot->previous, c8->screen, sizeof(slot->previous));
+        chip8_machine_run(c8, c8->cycle_counter, keys);
+        slot->frames++;
+        const Chip8EnvEnd end = episode_end(env, slot, i);
+        if (end != CHIP8_ENV_RUNNING) {
+            info->done = 1;
+            info->end = (uint8_t)end;
+            info->frames = slot->frames;
+            slot->episodes++;
+            start_episode(env, i);
+            break;
+        }
+    }
+    if (!info->done) info->frames = slot->frames;
+    info->episodes = slot->episodes;
+    observe(env, i);
+}
+
+static void reset_env(uint32_t i, uint32_t, void *user) {
+    Chip8Env *env = (Chip8Env *)user;
+    start_episode(env, i);
+    env->info[i] = Chip8EnvInfo();
+    env->info[i].episodes = env->slots[i].episodes;
+    observe(env, i);
+}
+
+Chip8Env *chip8_env_create(const Rom *rom, const Chip8EnvConfig *config) {
+    const uint32_t d = config->downsample;
+    if (config->num_envs == 0 || config->frame_skip == 0) return NULL;
+    if (config->observation == CHIP8_ENV_OBSERVE_BYTES && d != 1 && d != 2 && d != 4 && d != 8) return NULL;
+    if (config->observation != CHIP8_ENV_OBSERVE_BITS && config->observation != CHIP8_ENV_OBSERVE_BYTES) return NULL;
+
+    Chip8Env *env = new Chip8Env();
+    env->rom = rom;
+    env->config = *config;
+    env->pool = config->num_envs > 1 ? thread_pool_create(config->num_threads) : NULL;
+    env->slots.resize(config->num_envs);
+    for (EnvSlot &slot : env->slots) {
+        slot.episodes = 0;
+        slot.starts = 0;
+    }
+    env->observation_size = config->observation == CHIP8_ENV_OBSERVE_BITS ? sizeof(uint64_t) * CHIP8_SCR_H
+                                                                         : (CHIP8_SCR_H / d) * (CHIP8_SCR_W / d);
+    const size_t observation_bytes = (size_t)env->observation_size * config->num_envs;
+    env->observations.resize((observation_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    env->info.resize(config->num_envs);
+    env->key_masks = NULL;
+    chip8_env_reset(env);
+    return env;
+}
+
+void chip8_env_destroy(Chip8Env *env) {
+    if (env->pool) thread_pool_destroy(env->pool);
+    delete env;
+}
+
+void chip8_env_reset(Chip8Env *env) {
+    const uint32_t count = (uint32_t)env->slots.size();
+    if (env->pool) thread_pool_for(env->pool, count, reset_env, env);
+    else for (uint32_t i = 0; i < count; ++i) reset_env(i, 0, env);
+}
+
+void chip8_env_step(Chip8Env *env, const uint16_t *key_masks) {
+    const uint32_t count = (uint32_t)env->slots.size();
+    env->key_masks = key_masks;
+    if (env->pool) thread_pool_for(env->pool, count, step_env, env);
+    else step_env(0, 0, env);
+    env->key_masks = NULL;
+}
+
+uint32_t chip8_env_count(const Chip8Env *env) {
+    return (uint32_t)env->slots.size();
+}
+
+const uint8_t *chip8_env_observations(const Chip8Env *env) {
+    return (const uint8_t *)env->observations.data();
+}
+
+uint32_t chip8_env_observation_size(const Chip8Env *env) {
+    return env->observation_size;
+}
+
+const Chip8EnvInfo *chip8_env_info(const Chip8Env *env) {
+    return env->info.data();
+}
+
+const Chip8 *chip8_env_machine(const Chip8Env *env, uint32_t i) {
+    return &env->slots[i].machine;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Batch environments for training loops: N machines running one program, all
+// stepped together by a number of frames with one key mask per environment.
+// Observations of every environment live in one buffer owned by the Chip8Env;
+// each step writes them in place from the worker that ran the environment, so
+// the caller reads them through a pointer that stays the same for the Chip8Env's
+// lifetime. Nothing is allocated after chip8_env_create.
+//
+// An environment whose episode ends during a step stops there, is reset to
+// the program's start with a new PRNG seed, and its observation and info
+// describe the new episode's first frame; info.done says it happened.
+
+struct Rom;
+
+enum Chip8EnvObservation {
+    // CHIP8_SCR_H uint64_t per environment, as Chip8::screen.
+    CHIP8_ENV_OBSERVE_BITS,
+    // (CHIP8_SCR_H / d) x (CHIP8_SCR_W / d) bytes per environment, row by row,
+    // each the number of lit pixels in a d x d block (d = downsample): 0 or 1
+    // when d is 1, as chip8_screen_to_bytes writes.
+    CHIP8_ENV_OBSERVE_BYTES,
+};
+
+// Why an episode ended.
+enum Chip8EnvEnd {
+    CHIP8_ENV_RUNNING,
+    CHIP8_ENV_END_FAULT, // the machine faulted, see Chip8::fault
+    CHIP8_ENV_END_HALT, // the program jumps to itself, which is how most CHIP-8 games stop
+    CHIP8_ENV_END_TIME_LIMIT, // max_frames reached
+    CHIP8_ENV_END_CALLBACK, // config.terminal said so
+};
+
+struct Chip8EnvConfig {
+    uint32_t num_envs;
+    uint32_t frame_skip; // frames per step, all with the step's keys
+    uint32_t observation; // Chip8EnvObservation
+    uint32_t downsample; // 1, 2, 4 or 8, CHIP8_ENV_OBSERVE_BYTES only
+    // OR the screens at the end of the step's last two frames, or the last
+    // frame of the previous step when frame_skip is 1, so sprites a program
+    // erases and redraws every other frame don't flicker out of observations.
+    bool merge_frames;
+    uint32_t cycles_per_frame; // 0 = the program's default
+    uint32_t seed; // the PRNG seed of every episode is derived from this, the environment and the episode
+    // Episode ends, checked after every frame.
+    bool end_on_fault;
+    bool end_on_halt;
+    uint32_t max_frames; // 0 = no limit
+    // Called from worker threads for one environment at a time; NULL = none.
+    bool (*terminal)(const Chip8 *c8, uint32_t env, void *user);
+    void *terminal_user;
+    uint32_t num_threads; // workers stepping environments, 0 = one per core
+};
+
+// Per environment, about the step that just finished.
+struct Chip8EnvInfo {
+    uint8_t done; // the episode ended (reason in end) and the environment was reset
+    uint8_t end; // Chip8EnvEnd
+    uint8_t reserved[2]; // always 0, so info buffers can be compared and hashed as bytes
+    uint32_t frames; // of the episode that ended if done, of the current one otherwise
+    uint32_t episodes; // finished so far
+};
+
+struct Chip8Env;
+
+// Fills config with one environment, no frame skip, bit observations, episodes
+// ending on faults and halts, and all cores.
+void chip8_env_default_config(Chip8EnvConfig *config);
+// Starts every environment on rom, quirk profile included. The Rom must
+// outlive the Chip8Env. NULL if the config is invalid.
+Chip8Env *chip8_env_create(const Rom *rom, const Chip8EnvConfig *config);
+void chip8_env_destroy(Chip8Env *env);
+// Starts a new episode in every environment.
+void chip8_env_reset(Chip8Env *env);
+// Runs frame_skip frames on every environment in parallel, key n of
+// environment i held iff bit n of key_masks[i] is set (NULL = no keys).
+void chip8_env_step(Chip8Env *env, const uint16_t *key_masks);
+
+uint32_t chip8_env_count(const Chip8Env *env);
+// All observations, observation_size bytes apart.
+const uint8_t *chip8_env_observations(const Chip8Env *env);
+uint32_t chip8_env_observation_size(const Chip8Env *env);
+const Chip8EnvInfo *chip8_env_info(const Chip8Env *env);
+// The machine behind environment i, for rewards read from its registers or
+// memory. Must not be changed, nor read during chip8_env_step.
+const Chip8 *chip8_env_machine(const Chip8Env *env, uint32_t i);
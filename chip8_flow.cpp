@@ -0,0 +1,66 @@
+#include "chip8_flow.h"
+
+#include <vector>
+#include <string.h>
+
+struct Walk {
+    uint32_t begin;
+    uint32_t end;
+    Chip8Flow *flow;
+    std::vector<uint32_t> work;
+};
+
+static void fall_through(Walk *w, uint32_t addr) {
+    if (addr >= w->begin && addr + 1 < w->end) w->work.push_back(addr);
+}
+
+static void branch(Walk *w, uint32_t addr) {
+    if (addr < w->begin || addr + 1 >= w->end) return;
+    w->flow->leader[addr] = true;
+    w->work.push_back(addr);
+}
+
+void chip8_flow_discover(const uint8_t *M, uint32_t begin, uint32_t end, uint32_t quirks, Chip8Flow *flow) {
+    memset(flow, 0, sizeof(*flow));
+    flow->complete = true;
+    if (end > CHIP8_MEMORY_SIZE) end = CHIP8_MEMORY_SIZE;
+    Walk w = { begin, end, flow, std::vector<uint32_t>() };
+    branch(&w, CHIP8_PROGRAM_OFFSET);
+    while (!w.work.empty()) {
+        const uint32_t pc = w.work.back();
+        w.work.pop_back();
+        if (flow->code[pc] || flow->faults[pc]) continue;
+        const uint8_t hi = M[pc];
+        const uint8_t lo = M[pc + 1];
+        const uint16_t nnn = ((hi & 0xF) << 8) | lo;
+        if (!chip8_op_exists(hi, lo, quirks)) {
+            flow->faults[pc] = true;
+            continue;
+        }
+        flow->code[pc] = true;
+
+        switch (hi >> 4) {
+            case 0x0:
+                if (lo == 0xE0) fall_through(&w, pc + 2);
+                break;
+            case 0x1:
+                branch(&w, nnn);
+                break;
+            case 0x2:
+                branch(&w, nnn);
+                branch(&w, pc + 2);
+                break;
+            case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+                branch(&w, pc + 2);
+                branch(&w, pc + 4);
+                break;
+            case 0xB:
+                flow->complete = false;
+                for (uint32_t offset = 0; offset < CHIP8_FLOW_JUMP_TABLE; offset += 2) branch(&w, nnn + offset);
+                break;
+            default:
+                fall_through(&w, pc + 2);
+                break;
+        }
+    }
+}
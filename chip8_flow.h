@@ -0,0 +1,28 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Static control flow: the instructions execution can reach from
+// CHIP8_PROGRAM_OFFSET, found by following every statically known path
+// without running the program. The ROM cache predecodes what it finds and
+// chip8_aot translates it.
+//
+// Paths end at instructions the quirk profile does not have, since the
+// interpreter faults there. 00EE targets are only known at run time; return
+// sites are covered by their 2nnn. Bnnn targets are guessed by assuming a jump
+// table of CHIP8_FLOW_JUMP_TABLE bytes behind nnn.
+
+#define CHIP8_FLOW_JUMP_TABLE 0x100 // nnn plus every even register value
+
+struct Chip8Flow {
+    bool code[CHIP8_MEMORY_SIZE]; // an instruction starts here
+    bool leader[CHIP8_MEMORY_SIZE]; // reached by a jump, call, return or skip rather than falling through
+    bool faults[CHIP8_MEMORY_SIZE]; // reached, but the profile does not have the instruction
+    bool complete; // no Bnnn on any path, so no target was guessed
+};
+
+// Discovers the code of M under the quirk profile, only following
+// instructions that lie entirely within [begin, end).
+void chip8_flow_discover(const uint8_t *M, uint32_t begin, uint32_t end, uint32_t quirks, Chip8Flow *flow);
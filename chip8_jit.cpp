@@ -0,0 +1,808 @@
+#include "chip8_jit.h"
+#include "chip8_ops.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_NATIVE 1
+#include <sys/mman.h>
+#else
+#define JIT_NATIVE 0
+#endif
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+#define MAX_BLOCK_LENGTH 64 // instructions
+#define MAX_OP_BYTES 128 // longest translation of one instruction, budget check, fault check and exits included
+#define MAX_BLOCK_BYTES (MAX_BLOCK_LENGTH * MAX_OP_BYTES + 32)
+#define ARENA_SIZE (1u << 20)
+// Set in BlockResult::pc when the instruction there would fault: it has not
+// run, and the interpreter has to take it.
+#define TRAP 0x10000
+
+enum { ENTRY_NONE, ENTRY_NATIVE, ENTRY_INTERPRET };
+
+// A block exit that looks its target up in the table because the target had
+// no block yet when the exit was made. Patched into a direct jump once it has.
+struct PendingLink {
+    uint8_t *site;
+    uint16_t target;
+};
+
+// Both halves come back in rax:rdx.
+struct BlockResult {
+    uint64_t pc; // where execution continues
+    uint64_t budget_left; // cycles of the budget the block did not use
+};
+
+// Entry into translated code: runs blocks starting at pc, chaining from one to
+// the next, until `budget` instructions have executed or execution reaches an
+// address without a block or a store that may have changed the code. Books
+// the cycles it ran and ticks the timers on the way, like chip8_machine_run.
+typedef BlockResult (*EntryFunc)(Chip8 *c8, uint32_t budget, const bool *keys, uint32_t pc);
+
+struct Chip8Jit {
+    const Chip8 *machine; // the machine the cache describes
+    uint32_t generation; // machine->generation when the cache was made
+    uint32_t memory_writes; // machine->memory_writes when the cache was last checked
+    uint8_t quirks;
+    uint8_t *arena; // NULL when executable memory is unavailable
+    uint32_t arena_used;
+    uint8_t kind[MEMORY_SIZE]; // ENTRY_* per start address
+    uint8_t length[MEMORY_SIZE]; // instructions in the native block
+    const uint8_t *native[MEMORY_SIZE]; // block per start address, NULL = none, read by the dispatcher
+    uint32_t stub_size; // shared entry, dispatch and exit code at the start of the arena
+    uint32_t dispatch; // arena offsets into the stub
+    uint32_t early_exit;
+    uint32_t segment_end;
+    uint32_t exit;
+    uint8_t shadow[MEMORY_SIZE]; // the bytes each entry was made from
+    uint64_t covered[MEMORY_SIZE / 64]; // bit per byte some entry was made from, until the next flush
+    std::vector<uint16_t> entries; // every address whose kind is not ENTRY_NONE
+    std::vector<PendingLink> links;
+    Chip8JitStats stats;
+};
+
+#if JIT_NATIVE
+
+// Instructions too big to inline are calls into these.
+
+static void helper_cls(Chip8 *c8) {
+    chip8_op_cls(c8);
+}
+
+template <typename Quirks>
+static void helper_drw(Chip8 *c8, uint32_t x, uint32_t y, uint32_t n) {
+    chip8_op_drw<Quirks>(c8, x, y, n);
+}
+
+static void helper_rnd(Chip8 *c8, uint32_t x, uint32_t kk) {
+    chip8_op_rnd(c8, x, kk);
+}
+
+// After a store of [first, first + size): nonzero when it may have changed
+// translated code, which sends execution back to chip8_jit_run to revalidate.
+// Otherwise the cache is known to still be good.
+static uint32_t store_hit_code(Chip8Jit *jit, const Chip8 *c8, uint32_t first, uint32_t size) {
+    if (c8->memory_writes == jit->memory_writes) return 0;
+    // At most 16 bytes, so two words of the bitmap.
+    const uint32_t last = first + size - 1;
+    const uint64_t head = jit->covered[first / 64] >> (first % 64);
+    const uint64_t tail = jit->covered[last / 64] << (63 - last % 64);
+    const uint64_t bits = first / 64 == last / 64 ? head << (63 - (last - first)) : head | tail;
+    if (bits) return 1;
+    jit->memory_writes = c8->memory_writes;
+    return 0;
+}
+
+static uint32_t helper_bcd(Chip8 *c8, uint32_t x, uint32_t unused, Chip8Jit *jit) {
+    (void)unused;
+    const uint16_t I = c8->I;
+    chip8_op_bcd(c8, x);
+    return store_hit_code(jit, c8, I, 3);
+}
+
+template <typename Quirks>
+static uint32_t helper_store(Chip8 *c8, uint32_t x, uint32_t unused, Chip8Jit *jit) {
+    (void)unused;
+    const uint16_t I = c8->I;
+    chip8_op_store<Quirks>(c8, x);
+    return store_hit_code(jit, c8, I, x + 1);
+}
+
+template <typename Quirks>
+static void helper_load(Chip8 *c8, uint32_t x) {
+    chip8_op_load<Quirks>(c8, x);
+}
+
+// x86-64 emitter. Translated code keeps the Chip8 pointer in rbx, the key
+// array in r12 and the block table in r13, and addresses every field as
+// [rbx + disp32]. The budget is split into segments that end at timer ticks:
+// ebp counts down the current one, r15d holds its length and r14d what is
+// left of the budget after it, while cycles and cycle_counter stay as they
+// were when the segment began. eax carries the next PC from a block to the
+// next; al, cl and dl are scratch. Helpers are called with the System V
+// argument registers.
+enum { AL = 0, CL = 1, DL = 2 };
+
+#define V_AT(x) (uint32_t)(offsetof(Chip8, V) + (x))
+#define VF V_AT(0xF)
+#define FIELD(name) (uint32_t)offsetof(Chip8, name)
+
+struct Emitter {
+    Chip8Jit *jit;
+    uint8_t *p;
+    const uint8_t *dispatch; // next block at eax, or back to the host
+    const uint8_t *early_exit; // budget spent before the instruction at eax
+    const uint8_t *segment_end; // ebp is 0: tick and go on at eax, or back to the host
+    const uint8_t *exit; // back to the host, continue at eax
+    uint32_t start; // of the block being emitted
+    const uint8_t *begin; // its code
+};
+
+static void emit8(Emitter *e, uint8_t byte) {
+    *e->p++ = byte;
+}
+
+static void emit16(Emitter *e, uint16_t value) {
+    memcpy(e->p, &value, 2);
+    e->p += 2;
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+    memcpy(e->p, &value, 4);
+    e->p += 4;
+}
+
+static void emit64(Emitter *e, uint64_t value) {
+    memcpy(e->p, &value, 8);
+    e->p += 8;
+}
+
+// Relative field of a jump whose rel32 is the last thing in the instruction.
+static void emit_rel32(Emitter *e, const uint8_t *target) {
+    emit32(e, (uint32_t)(int32_t)(target - (e->p + 4)));
+}
+
+// `opcode` with a [rbx + disp] operand; `reg` is the ModRM reg field, either a
+// register or an opcode extension.
+static void emit_mem(Emitter *e, uint8_t opcode, uint8_t reg, uint32_t disp) {
+    emit8(e, opcode);
+    emit8(e, 0x80 | reg << 3 | 3);
+    emit32(e, disp);
+}
+
+static void emit_load(Emitter *e, uint8_t reg, uint32_t disp) { emit_mem(e, 0x8A, reg, disp); } // mov r8, [m]
+static void emit_store(Emitter *e, uint32_t disp, uint8_t reg) { emit_mem(e, 0x88, reg, disp); } // mov [m], r8
+
+static void emit_store_imm(Emitter *e, uint32_t disp, uint8_t value) { // mov byte [m], imm8
+    emit_mem(e, 0xC6, 0, disp);
+    emit8(e, value);
+}
+
+static void emit_load_zx(Emitter *e, uint32_t disp) { // movzx eax, byte [m]
+    emit8(e, 0x0F);
+    emit_mem(e, 0xB6, AL, disp);
+}
+
+static void emit_mov_eax(Emitter *e, uint32_t value) {
+    emit8(e, 0xB8); emit32(e, value);
+}
+
+// Ends a block whose successor is already in eax. A copy of the dispatcher,
+// so every block exit gets its own branch prediction.
+static void emit_continue(Emitter *e) {
+    emit8(e, 0x85); emit8(e, 0xED); // test ebp, ebp
+    emit8(e, 0x0F); emit8(e, 0x84); emit_rel32(e, e->segment_end); // jz segment_end
+    emit8(e, 0x3D); emit32(e, MEMORY_SIZE - 1); // cmp eax, MEMORY_SIZE - 1
+    emit8(e, 0x0F); emit8(e, 0x87); emit_rel32(e, e->exit); // ja exit
+    emit8(e, 0x49); emit8(e, 0x8B); emit8(e, 0x4C); emit8(e, 0xC5); emit8(e, 0x00); // mov rcx, [r13 + rax*8]
+    emit8(e, 0x48); emit8(e, 0x85); emit8(e, 0xC9); // test rcx, rcx
+    emit8(e, 0x0F); emit8(e, 0x84); emit_rel32(e, e->exit); // jz exit
+    emit8(e, 0xFF); emit8(e, 0xE1); // jmp rcx
+}
+
+// Ends a block with a jump straight to the block at pc. Without one yet, the
+// exit looks pc up in the table until translate() links it.
+static void emit_goto(Emitter *e, uint32_t pc) {
+    emit_mov_eax(e, pc);
+    if (pc + 1 >= MEMORY_SIZE) {
+        emit8(e, 0xE9); emit_rel32(e, e->dispatch); // jmp dispatch
+        return;
+    }
+    emit8(e, 0x85); emit8(e, 0xED); // test ebp, ebp
+    emit8(e, 0x0F); emit8(e, 0x84); emit_rel32(e, e->segment_end); // jz segment_end
+    const uint8_t *const target = pc == e->start ? e->begin : e->jit->native[pc];
+    if (target) {
+        emit8(e, 0xE9); emit_rel32(e, target); // jmp target
+        return;
+    }
+    PendingLink link = { e->p, (uint16_t)pc };
+    e->jit->links.push_back(link);
+    emit8(e, 0x49); emit8(e, 0x8B); emit8(e, 0x8D); emit32(e, pc * 8); // mov rcx, [r13 + pc*8]
+    emit8(e, 0x48); emit8(e, 0x85); emit8(e, 0xC9); // test rcx, rcx
+    emit8(e, 0x0F); emit8(e, 0x84); emit_rel32(e, e->exit); // jz exit
+    emit8(e, 0xFF); emit8(e, 0xE1); // jmp rcx
+}
+
+// Turns the table lookups of exits waiting for `target` into direct jumps.
+static void link_pending(Chip8Jit *jit, uint16_t target, const uint8_t *code) {
+    size_t kept = 0;
+    for (const PendingLink &link : jit->links) {
+        if (link.target != target) {
+            jit->links[kept++] = link;
+            continue;
+        }
+        Emitter e;
+        e.p = link.site;
+        emit8(&e, 0xE9); emit_rel32(&e, code); // jmp code, over the start of the lookup
+    }
+    jit->links.resize(kept);
+}
+
+// Charges one cycle to the budget. Every instruction but the first of a block
+// leaves through the early exit with PC = pc when the budget is already spent,
+// so nothing runs past the timer tick the host stopped the budget at. The
+// dispatcher only enters a block with budget left.
+static void emit_budget_check(Emitter *e, uint32_t pc, bool first) {
+    if (!first) emit_mov_eax(e, pc);
+    emit8(e, 0x83); emit8(e, 0xED); emit8(e, 0x01); // sub ebp, 1
+    if (!first) {
+        emit8(e, 0x0F); emit8(e, 0x82); emit_rel32(e, e->early_exit); // jb early_exit
+    }
+}
+
+// Skips: flags are already set, continue at PC + 4 when `jcc` (0x84 = je,
+// 0x85 = jne) is taken and at PC + 2 otherwise.
+static void emit_skip(Emitter *e, uint8_t jcc, uint32_t pc) {
+    emit8(e, 0x0F); emit8(e, jcc);
+    uint8_t *const taken = e->p;
+    emit32(e, 0);
+    emit_goto(e, (uint16_t)(pc + 2));
+    const int32_t offset = (int32_t)(e->p - (taken + 4));
+    memcpy(taken, &offset, 4);
+    emit_goto(e, (uint16_t)(pc + 4));
+}
+
+// Leaves for the interpreter at pc unless the flags the caller set satisfy
+// `jcc` (a short jump opcode), handing back the cycle charged for the
+// instruction, which would fault.
+static void emit_trap_unless(Emitter *e, uint8_t jcc, uint32_t pc) {
+    emit8(e, jcc); emit8(e, 12); // over the next three instructions
+    emit_mov_eax(e, pc | TRAP);
+    emit8(e, 0xFF); emit8(e, 0xC5); // inc ebp
+    emit8(e, 0xE9); emit_rel32(e, e->exit); // jmp exit
+}
+
+// Traps unless `size` bytes from I lie inside M.
+static void emit_memory_check(Emitter *e, uint32_t size, uint32_t pc) {
+    emit8(e, 0x0F); emit_mem(e, 0xB7, AL, FIELD(I)); // movzx eax, word [I]
+    emit8(e, 0x3D); emit32(e, MEMORY_SIZE - size); // cmp eax, MEMORY_SIZE - size
+    emit_trap_unless(e, 0x76, pc); // jbe
+}
+
+// helper(c8, a, b, c)
+static void emit_call(Emitter *e, const void *helper, uint32_t a, uint32_t b, uint64_t c) {
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF); // mov rdi, rbx
+    emit8(e, 0xBE); emit32(e, a); // mov esi, a
+    emit8(e, 0xBA); emit32(e, b); // mov edx, b
+    emit8(e, 0x48); emit8(e, 0xB9); emit64(e, c); // mov rcx, c
+    emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64_t)helper); // mov rax, helper
+    emit8(e, 0xFF); emit8(e, 0xD0); // call rax
+}
+
+// Books the ebp cycles of the current segment that ran, r15d - ebp, and ticks
+// the timers if that reached the tick, as chip8_account_cycles does.
+static void emit_book_segment(Emitter *e) {
+    emit8(e, 0x44); emit8(e, 0x89); emit8(e, 0xF9); // mov ecx, r15d
+    emit8(e, 0x29); emit8(e, 0xE9); // sub ecx, ebp
+    emit8(e, 0x48); emit_mem(e, 0x01, CL, FIELD(cycles)); // add qword [cycles], rcx
+    emit_mem(e, 0x29, CL, FIELD(cycle_counter)); // sub dword [cycle_counter], ecx
+    emit8(e, 0x75);
+    uint8_t *const no_tick = e->p;
+    emit8(e, 0); // jnz over the tick
+    emit_mem(e, 0x8B, CL, FIELD(cycles_per_timer)); // mov ecx, [cycles_per_timer]
+    emit_mem(e, 0x89, CL, FIELD(cycle_counter)); // mov [cycle_counter], ecx
+    const uint32_t timers[2] = { FIELD(delay_timer), FIELD(sound_timer) };
+    for (uint32_t timer : timers) {
+        emit_mem(e, 0x80, 7, timer); emit8(e, 0); // cmp byte [timer], 0
+        emit8(e, 0x74); emit8(e, 6); // je over the next instruction
+        emit_mem(e, 0xFE, 1, timer); // dec byte [timer]
+    }
+    *no_tick = (uint8_t)(e->p - (no_tick + 1));
+}
+
+// Starts a segment of at most r14d cycles that ends at the next tick, which
+// is cycle_counter cycles away.
+static void emit_next_segment(Emitter *e) {
+    emit_mem(e, 0x8B, 5, FIELD(cycle_counter)); // mov ebp, [cycle_counter]
+    emit8(e, 0x44); emit8(e, 0x39); emit8(e, 0xF5); // cmp ebp, r14d
+    emit8(e, 0x41); emit8(e, 0x0F); emit8(e, 0x47); emit8(e, 0xEE); // cmova ebp, r14d
+    emit8(e, 0x41); emit8(e, 0x29); emit8(e, 0xEE); // sub r14d, ebp
+    emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0xEF); // mov r15d, ebp
+}
+
+// The code every block shares, at the start of the arena: the EntryFunc,
+// the dispatcher that chains blocks through jit->native, the timer tick
+// between segments and the exits.
+static void emit_stub(Chip8Jit *jit) {
+    Emitter e;
+    e.p = jit->arena;
+    emit8(&e, 0x53); // push rbx
+    emit8(&e, 0x55); // push rbp
+    emit8(&e, 0x41); emit8(&e, 0x54); // push r12
+    emit8(&e, 0x41); emit8(&e, 0x55); // push r13
+    emit8(&e, 0x41); emit8(&e, 0x56); // push r14
+    emit8(&e, 0x41); emit8(&e, 0x57); // push r15
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xEC); emit8(&e, 0x08); // sub rsp, 8: keep calls 16-byte aligned
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB); // mov rbx, rdi
+    emit8(&e, 0x41); emit8(&e, 0x89); emit8(&e, 0xF6); // mov r14d, esi
+    emit8(&e, 0x49); emit8(&e, 0x89); emit8(&e, 0xD4); // mov r12, rdx
+    emit8(&e, 0x49); emit8(&e, 0xBD); emit64(&e, (uint64_t)jit->native); // mov r13, native
+    emit8(&e, 0x89); emit8(&e, 0xC8); // mov eax, ecx
+    emit_next_segment(&e);
+
+    // dispatch: stop when the budget is spent or there is no block at eax.
+    jit->dispatch = (uint32_t)(e.p - jit->arena);
+    emit8(&e, 0x85); emit8(&e, 0xED); // test ebp, ebp
+    uint8_t *const budget_spent = e.p + 2;
+    emit8(&e, 0x0F); emit8(&e, 0x84); emit32(&e, 0); // jz segment_end
+    emit8(&e, 0x3D); emit32(&e, MEMORY_SIZE - 1); // cmp eax, MEMORY_SIZE - 1
+    uint8_t *const outside = e.p + 2;
+    emit8(&e, 0x0F); emit8(&e, 0x87); emit32(&e, 0); // ja exit
+    emit8(&e, 0x49); emit8(&e, 0x8B); emit8(&e, 0x4C); emit8(&e, 0xC5); emit8(&e, 0x00); // mov rcx, [r13 + rax*8]
+    emit8(&e, 0x48); emit8(&e, 0x85); emit8(&e, 0xC9); // test rcx, rcx
+    uint8_t *const no_block = e.p + 2;
+    emit8(&e, 0x0F); emit8(&e, 0x84); emit32(&e, 0); // jz exit
+    emit8(&e, 0xFF); emit8(&e, 0xE1); // jmp rcx
+
+    // early_exit: the budget check wrapped ebp below zero.
+    jit->early_exit = (uint32_t)(e.p - jit->arena);
+    emit8(&e, 0x31); emit8(&e, 0xED); // xor ebp, ebp
+
+    // segment_end: the segment ran up to the tick. Tick and go on with the
+    // next one, unless that was the end of the budget.
+    jit->segment_end = (uint32_t)(e.p - jit->arena);
+    const int32_t to_segment_end = (int32_t)(e.p - (budget_spent + 4));
+    memcpy(budget_spent, &to_segment_end, 4);
+    emit8(&e, 0x45); emit8(&e, 0x85); emit8(&e, 0xF6); // test r14d, r14d
+    uint8_t *const budget_done = e.p + 2;
+    emit8(&e, 0x0F); emit8(&e, 0x84); emit32(&e, 0); // jz exit
+    emit_book_segment(&e);
+    emit_next_segment(&e);
+    emit8(&e, 0xE9); emit_rel32(&e, jit->arena + jit->dispatch); // jmp dispatch
+
+    // exit: book the segment so far and return { eax, ebp + r14d }.
+    jit->exit = (uint32_t)(e.p - jit->arena);
+    uint8_t *const to_exit[3] = { outside, no_block, budget_done };
+    for (uint8_t *field : to_exit) {
+        const int32_t offset = (int32_t)(e.p - (field + 4));
+        memcpy(field, &offset, 4);
+    }
+    emit_book_segment(&e);
+    emit8(&e, 0x89); emit8(&e, 0xEA); // mov edx, ebp
+    emit8(&e, 0x44); emit8(&e, 0x01); emit8(&e, 0xF2); // add edx, r14d
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xC4); emit8(&e, 0x08); // add rsp, 8
+    emit8(&e, 0x41); emit8(&e, 0x5F); // pop r15
+    emit8(&e, 0x41); emit8(&e, 0x5E); // pop r14
+    emit8(&e, 0x41); emit8(&e, 0x5D); // pop r13
+    emit8(&e, 0x41); emit8(&e, 0x5C); // pop r12
+    emit8(&e, 0x5D); // pop rbp
+    emit8(&e, 0x5B); // pop rbx
+    emit8(&e, 0xC3); // ret
+    jit->stub_size = (uint32_t)(e.p - jit->arena);
+}
+
+enum { NOT_TRANSLATED, TRANSLATED, ENDS_BLOCK };
+
+// Whether the instruction at pc gets translated. Idle loops stay with the
+// interpreter, which skips them, as do Fx0A and opcodes it does not know.
+template <typename Quirks>
+static bool translatable(const uint8_t *M, uint32_t pc) {
+    const uint8_t hi = M[pc];
+    const uint8_t lo = M[pc + 1];
+    const uint16_t nnn = ((hi & 0xF) << 8) | lo;
+    switch (hi >> 4) {
+        case 0x0: return hi == 0 && (lo == 0xE0 || lo == 0xEE);
+        case 0x1: return nnn != pc;
+        case 0x8: {
+            const uint8_t n = lo & 0xF;
+            return n <= 0x7 || n == 0xE;
+        }
+        case 0xB: return Quirks::has_jump;
+        case 0xE: return lo == 0x9E || lo == 0xA1;
+        case 0xF:
+            switch (lo) {
+                case 0x07:
+                    return !chip8_is_timer_poll(M, pc);
+                case 0x15: case 0x18: case 0x1E: case 0x29: case 0x33: case 0x55: case 0x65:
+                    return true;
+            }
+            return false;
+    }
+    return true;
+}
+
+// Emits the instruction at pc, which must behave exactly like the
+// interpreter's handler for the same Quirks.
+template <typename Quirks>
+static uint32_t translate_op(Emitter *e, const uint8_t *M, uint32_t pc) {
+    const uint8_t hi = M[pc];
+    const uint8_t lo = M[pc + 1];
+    const uint8_t x = hi & 0xF;
+    const uint8_t y = lo >> 4;
+    const uint16_t nnn = ((hi & 0xF) << 8) | lo;
+
+    switch (hi >> 4) {
+        case 0x0:
+            if (lo == 0xE0) {
+                emit_call(e, (const void *)helper_cls, 0, 0, 0);
+                return TRANSLATED;
+            }
+            // RET
+            emit_mem(e, 0x80, 7, FIELD(SP)); emit8(e, 0); // cmp byte [SP], 0
+            emit_trap_unless(e, 0x75, pc); // jne
+            emit_load_zx(e, FIELD(SP));
+            emit8(e, 0xFF); emit8(e, 0xC8); // dec eax
+            emit_store(e, FIELD(SP), AL);
+            emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x84); emit8(e, 0x43); // movzx eax, word [rbx + rax*2 + stack]
+            emit32(e, FIELD(stack));
+            emit_continue(e);
+            return ENDS_BLOCK;
+        case 0x1:
+            emit_goto(e, nnn);
+            return ENDS_BLOCK;
+        case 0x2:
+            emit_mem(e, 0x80, 7, FIELD(SP)); emit8(e, CHIP8_STACK_SIZE); // cmp byte [SP], CHIP8_STACK_SIZE
+            emit_trap_unless(e, 0x72, pc); // jb
+            emit_load_zx(e, FIELD(SP));
+            emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x84); emit8(e, 0x43); // mov word [rbx + rax*2 + stack], pc + 2
+            emit32(e, FIELD(stack));
+            emit16(e, (uint16_t)(pc + 2));
+            emit_mem(e, 0xFE, 0, FIELD(SP)); // inc byte [SP]
+            emit_goto(e, nnn);
+            return ENDS_BLOCK;
+        case 0x3:
+        case 0x4:
+            emit_mem(e, 0x80, 7, V_AT(x)); // cmp byte [Vx], kk
+            emit8(e, lo);
+            emit_skip(e, (hi >> 4) == 0x3 ? 0x84 : 0x85, pc);
+            return ENDS_BLOCK;
+        case 0x5:
+        case 0x9:
+            emit_load(e, AL, V_AT(x));
+            emit_mem(e, 0x3A, AL, V_AT(y)); // cmp al, [Vy]
+            emit_skip(e, (hi >> 4) == 0x5 ? 0x84 : 0x85, pc);
+            return ENDS_BLOCK;
+        case 0x6:
+            emit_store_imm(e, V_AT(x), lo);
+            return TRANSLATED;
+        case 0x7:
+            emit_mem(e, 0x80, 0, V_AT(x)); // add byte [Vx], kk
+            emit8(e, lo);
+            return TRANSLATED;
+        case 0x8: {
+            const uint32_t source = V_AT(Quirks::shift_vy ? y : x);
+            switch (lo & 0xF) {
+                case 0x0:
+                    emit_load(e, AL, V_AT(y));
+                    emit_store(e, V_AT(x), AL);
+                    return TRANSLATED;
+                case 0x1:
+                case 0x2:
+                case 0x3: {
+                    static const uint8_t opcodes[4] = { 0, 0x08, 0x20, 0x30 }; // or, and, xor [m], r8
+                    emit_load(e, AL, V_AT(y));
+                    emit_mem(e, opcodes[lo & 0xF], AL, V_AT(x));
+                    if (Quirks::vf_reset) emit_store_imm(e, VF, 0);
+                    return TRANSLATED;
+                }
+                case 0x4:
+                    emit_load(e, AL, V_AT(x));
+                    emit_mem(e, 0x02, AL, V_AT(y)); // add al, [Vy]
+                    if (Quirks::legacy_flags) {
+                        emit8(e, 0x73); emit8(e, 7); // jnc over the next store
+                        emit_store_imm(e, VF, 1);
+                        emit_store(e, V_AT(x), AL);
+                    }
+                    else {
+                        emit8(e, 0x0F); emit8(e, 0x92); emit8(e, 0xC1); // setc cl
+                        emit_store(e, V_AT(x), AL);
+                        emit_store(e, VF, CL);
+                    }
+                    return TRANSLATED;
+                case 0x5:
+                case 0x7: {
+                    // 8xy5 computes Vx - Vy, 8xy7 Vy - Vx.
+                    const uint32_t a = V_AT((lo & 0xF) == 0x5 ? x : y);
+                    const uint32_t b = V_AT((lo & 0xF) == 0x5 ? y : x);
+                    emit_load(e, AL, a);
+                    emit_mem(e, 0x3A, AL, b); // cmp al, [b]
+                    if (Quirks::legacy_flags) {
+                        // The flag lands first and the operands are read again after it.
+                        emit8(e, 0x0F); emit8(e, 0x97); emit8(e, 0xC2); // seta dl
+                        emit_store(e, VF, DL);
+                        emit_load(e, AL, a);
+                        emit_mem(e, 0x2A, AL, b); // sub al, [b]
+                        emit_store(e, V_AT(x), AL);
+                    }
+                    else {
+                        emit8(e, 0x0F); emit8(e, 0x93); emit8(e, 0xC2); // setae dl
+                        emit_mem(e, 0x2A, AL, b);
+                        emit_store(e, V_AT(x), AL);
+                        emit_store(e, VF, DL);
+                    }
+                    return TRANSLATED;
+                }
+                case 0x6:
+                    if (Quirks::legacy_flags) {
+                        emit_load(e, AL, V_AT(x));
+                        emit8(e, 0x24); emit8(e, 0x01); // and al, 1
+                        emit_store(e, VF, AL);
+                        emit_mem(e, 0xD0, 5, V_AT(x)); // shr byte [Vx], 1
+                    }
+                    else {
+                        emit_load(e, AL, source);
+                        emit8(e, 0x88); emit8(e, 0xC2); // mov dl, al
+                        emit8(e, 0x80); emit8(e, 0xE2); emit8(e, 0x01); // and dl, 1
+                        emit8(e, 0xD0); emit8(e, 0xE8); // shr al, 1
+                        emit_store(e, V_AT(x), AL);
+                        emit_store(e, VF, DL);
+                    }
+                    return TRANSLATED;
+                case 0xE:
+                    if (Quirks::legacy_flags) {
+                        emit_load(e, AL, V_AT(x));
+                        emit8(e, 0x24); emit8(e, 0x80); // and al, 0x80
+                        emit_store(e, VF, AL);
+                        emit_mem(e, 0xD0, 4, V_AT(x)); // shl byte [Vx], 1
+                    }
+                    else {
+                        emit_load(e, AL, source);
+                        emit8(e, 0x88); emit8(e, 0xC2); // mov dl, al
+                        emit8(e, 0xC0); emit8(e, 0xEA); emit8(e, 0x07); // shr dl, 7
+                        emit8(e, 0x00); emit8(e, 0xC0); // add al, al
+                        emit_store(e, V_AT(x), AL);
+                        emit_store(e, VF, DL);
+                    }
+                    return TRANSLATED;
+            }
+            break;
+        }
+        case 0xA:
+            emit8(e, 0x66);
+            emit_mem(e, 0xC7, 0, FIELD(I)); // mov word [I], nnn
+            emit16(e, nnn);
+            return TRANSLATED;
+        case 0xB:
+            emit_load_zx(e, V_AT(Quirks::jump_vx ? x : 0));
+            emit8(e, 0x05); emit32(e, nnn); // add eax, nnn
+            emit8(e, 0x25); emit32(e, 0xFFF); // and eax, 0xFFF
+            emit_continue(e);
+            return ENDS_BLOCK;
+        case 0xC:
+            emit_call(e, (const void *)helper_rnd, x, lo, 0);
+            return TRANSLATED;
+        case 0xD:
+            emit_memory_check(e, lo & 0xF, pc);
+            emit_call(e, (const void *)helper_drw<Quirks>, x, y, lo & 0xF);
+            return TRANSLATED;
+        case 0xE:
+            emit_mem(e, 0x80, 7, V_AT(x)); emit8(e, 0xF); // cmp byte [Vx], 0xF
+            emit_trap_unless(e, 0x76, pc); // jbe
+            emit_mem(e, 0xFF, 0, FIELD(key_reads)); // inc dword [key_reads]
+            emit_load_zx(e, V_AT(x));
+            emit8(e, 0x41); emit8(e, 0x80); emit8(e, 0x3C); emit8(e, 0x04); emit8(e, 0x00); // cmp byte [r12 + rax], 0
+            emit_skip(e, lo == 0x9E ? 0x85 : 0x84, pc);
+            return ENDS_BLOCK;
+        case 0xF:
+            switch (lo) {
+                case 0x07:
+                    emit_load(e, AL, FIELD(delay_timer));
+                    emit_store(e, V_AT(x), AL);
+                    return TRANSLATED;
+                case 0x15:
+                case 0x18:
+                    emit_load(e, AL, V_AT(x));
+                    emit_store(e, lo == 0x15 ? FIELD(delay_timer) : FIELD(sound_timer), AL);
+                    return TRANSLATED;
+                case 0x1E:
+                    emit_load_zx(e, V_AT(x));
+                    emit8(e, 0x66);
+                    emit_mem(e, 0x01, AL, FIELD(I)); // add word [I], ax
+                    return TRANSLATED;
+                case 0x29:
+                    emit_load_zx(e, V_AT(x));
+                    emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x80); // lea eax, [rax + rax*4]: 5-row font glyphs
+                    emit8(e, 0x66);
+                    emit_mem(e, 0x89, AL, FIELD(I)); // mov word [I], ax
+                    return TRANSLATED;
+                // Stores that touched translated code, this very block
+                // included, go back to chip8_jit_run to revalidate. Stores to
+                // data leave every block good, so the block goes on.
+                case 0x33:
+                case 0x55:
+                    emit_memory_check(e, lo == 0x33 ? 3 : x + 1, pc);
+                    if (lo == 0x33) emit_call(e, (const void *)helper_bcd, x, 0, (uint64_t)e->jit);
+                    else emit_call(e, (const void *)helper_store<Quirks>, x, 0, (uint64_t)e->jit);
+                    emit8(e, 0x85); emit8(e, 0xC0); // test eax, eax
+                    emit_mov_eax(e, pc + 2);
+                    emit8(e, 0x0F); emit8(e, 0x85); emit_rel32(e, e->exit); // jnz exit
+                    return TRANSLATED;
+                case 0x65:
+                    emit_memory_check(e, x + 1, pc);
+                    emit_call(e, (const void *)helper_load<Quirks>, x, 0, 0);
+                    return TRANSLATED;
+            }
+            break;
+    }
+    assert(!"translatable() accepted an instruction translate_op does not handle");
+    return NOT_TRANSLATED;
+}
+
+static void make_entry(Chip8Jit *jit, const Chip8 *c8, uint16_t addr, uint8_t kind, uint32_t bytes) {
+    jit->kind[addr] = kind;
+    memcpy(jit->shadow + addr, c8->M + addr, bytes);
+    for (uint32_t a = addr; a < addr + bytes; ++a) jit->covered[a / 64] |= 1ull << (a % 64);
+    jit->entries.push_back(addr);
+}
+
+// Translates the block starting at `start`, or marks the address for the
+// interpreter when its first instruction has no translation.
+template <typename Quirks>
+static void translate(Chip8Jit *jit, const Chip8 *c8, uint16_t start) {
+    if (!jit->arena || !translatable<Quirks>(c8->M, start)) {
+        make_entry(jit, c8, start, ENTRY_INTERPRET, 2);
+        return;
+    }
+    if (jit->arena_used + MAX_BLOCK_BYTES > ARENA_SIZE) chip8_jit_flush(jit);
+
+    mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_WRITE);
+    uint8_t *const begin = jit->arena + jit->arena_used;
+    Emitter e;
+    e.jit = jit;
+    e.p = begin;
+    e.dispatch = jit->arena + jit->dispatch;
+    e.early_exit = jit->arena + jit->early_exit;
+    e.segment_end = jit->arena + jit->segment_end;
+    e.exit = jit->arena + jit->exit;
+    e.start = start;
+    e.begin = begin;
+    uint32_t pc = start;
+    uint32_t length = 0;
+    uint32_t result = TRANSLATED;
+    while (length < MAX_BLOCK_LENGTH && pc + 1 < MEMORY_SIZE && translatable<Quirks>(c8->M, pc)) {
+        emit_budget_check(&e, pc, length == 0);
+        result = translate_op<Quirks>(&e, c8->M, pc);
+        length++;
+        if (result == ENDS_BLOCK) break;
+        pc += 2;
+    }
+    if (result != ENDS_BLOCK) emit_goto(&e, pc);
+    assert(e.p - begin <= MAX_BLOCK_BYTES);
+    link_pending(jit, start, begin);
+    mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_EXEC);
+
+    jit->native[start] = begin;
+    jit->length[start] = (uint8_t)length;
+    jit->arena_used = (uint32_t)(e.p - jit->arena);
+    jit->stats.blocks_compiled++;
+    make_entry(jit, c8, start, ENTRY_NATIVE, 2 * length);
+}
+
+// Drops every entry whose bytes changed since it was made. Other blocks may
+// jump straight into a changed one, so that takes the whole cache with it.
+static void revalidate(Chip8Jit *jit, const Chip8 *c8) {
+    jit->memory_writes = c8->memory_writes;
+    const uint32_t invalidated = jit->stats.blocks_invalidated;
+    size_t kept = 0;
+    for (uint16_t addr : jit->entries) {
+        const uint32_t bytes = jit->kind[addr] == ENTRY_NATIVE ? 2 * jit->length[addr] : 2;
+        if (memcmp(c8->M + addr, jit->shadow + addr, bytes) == 0) {
+            jit->entries[kept++] = addr;
+            continue;
+        }
+        if (jit->kind[addr] == ENTRY_NATIVE) jit->stats.blocks_invalidated++;
+        jit->kind[addr] = ENTRY_NONE;
+        jit->native[addr] = NULL;
+    }
+    jit->entries.resize(kept);
+    if (jit->stats.blocks_invalidated != invalidated) chip8_jit_flush(jit);
+}
+
+#endif
+
+Chip8Jit *chip8_jit_create() {
+    Chip8Jit *jit = new Chip8Jit();
+    jit->machine = NULL;
+#if JIT_NATIVE
+    void *arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->arena = arena != MAP_FAILED ? (uint8_t *)arena : NULL;
+    if (jit->arena) {
+        mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_WRITE);
+        emit_stub(jit);
+        mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_EXEC);
+    }
+#else
+    jit->arena = NULL;
+#endif
+    chip8_jit_flush(jit);
+    return jit;
+}
+
+void chip8_jit_destroy(Chip8Jit *jit) {
+#if JIT_NATIVE
+    if (jit->arena) munmap(jit->arena, ARENA_SIZE);
+#endif
+    delete jit;
+}
+
+void chip8_jit_flush(Chip8Jit *jit) {
+    for (uint16_t addr : jit->entries) {
+        jit->kind[addr] = ENTRY_NONE;
+        jit->native[addr] = NULL;
+    }
+    jit->entries.clear();
+    jit->links.clear();
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->arena_used = jit->stub_size;
+}
+
+Chip8JitStats chip8_jit_stats(const Chip8Jit *jit) {
+    return jit->stats;
+}
+
+uint32_t chip8_jit_run(Chip8Jit *jit, Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]) {
+#if JIT_NATIVE
+    if (cycles == 0) return 0;
+    if (c8 != jit->machine || c8->generation != jit->generation || c8->quirks != jit->quirks) {
+        chip8_jit_flush(jit);
+        jit->machine = c8;
+        jit->generation = c8->generation;
+        jit->quirks = c8->quirks;
+        jit->memory_writes = c8->memory_writes;
+    }
+
+    uint32_t remaining = cycles;
+    bool trapped = false; // native code stopped before an instruction that faults
+    while (remaining > 0) {
+        if (c8->memory_writes != jit->memory_writes) revalidate(jit, c8);
+        const uint16_t pc = c8->PC;
+        if (pc + 1 < MEMORY_SIZE && jit->kind[pc] == ENTRY_NONE) {
+            switch (c8->quirks) {
+                case CHIP8_QUIRKS_VIP: translate<QuirksVip>(jit, c8, pc); break;
+                case CHIP8_QUIRKS_CHIP48: translate<QuirksChip48>(jit, c8, pc); break;
+                case CHIP8_QUIRKS_SCHIP: translate<QuirksSchip>(jit, c8, pc); break;
+                default:
+                    assert(c8->quirks == CHIP8_QUIRKS_LEGACY);
+                    translate<QuirksLegacy>(jit, c8, pc);
+                    break;
+            }
+        }
+
+        if (!trapped && !c8->fault && pc + 1 < MEMORY_SIZE && jit->kind[pc] == ENTRY_NATIVE) {
+            const EntryFunc entry = (EntryFunc)(void *)jit->arena;
+            const BlockResult result = entry(c8, remaining, keys, pc);
+            const uint32_t executed = remaining - (uint32_t)result.budget_left;
+            c8->PC = (uint16_t)result.pc;
+            trapped = (result.pc & TRAP) != 0;
+            remaining -= executed;
+            jit->stats.native_cycles += executed;
+            continue;
+        }
+
+        trapped = false;
+        const uint32_t chunk = c8->cycle_counter < remaining ? c8->cycle_counter : remaining;
+        const uint32_t run = chip8_interpret_cycles(c8, chunk, remaining, keys);
+        chip8_machine_run(c8, run, keys);
+        remaining -= run;
+        jit->stats.interpreted_cycles += run;
+    }
+    return cycles;
+#else
+    jit->stats.interpreted_cycles += cycles;
+    return chip8_machine_run(c8, cycles, keys);
+#endif
+}
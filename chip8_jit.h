@@ -0,0 +1,39 @@
+#pragma once
+
+#include "chip8.h"
+
+// Dynamic recompiler for x86-64 Linux. Straight runs of instructions up to the
+// next jump, call, return or skip are translated to native code once, cached
+// by start address and jump straight into each other; only returns and Bnnn
+// look their target up. The translated code ticks the timers itself at the
+// cycle the interpreter would, and stores to memory that holds no translated
+// code stay in the block.
+// Idle loops, Fx0A and unknown opcodes go through chip8_machine_run, so
+// timers, keys and results match the interpreter cycle for cycle. On other
+// platforms chip8_jit_run simply is the interpreter.
+//
+// Blocks are checked against the bytes they were translated from whenever the
+// machine's memory_writes changes, so self-modifying code via Fx33/Fx55 or
+// chip8_machine_write_memory is picked up, and dropped when chip8_machine_init
+// starts a new generation. Profiling counters only see the interpreted
+// instructions.
+struct Chip8Jit;
+
+struct Chip8JitStats {
+    uint64_t native_cycles; // cycles executed by translated blocks
+    uint64_t interpreted_cycles; // cycles handed to chip8_machine_run
+    uint32_t blocks_compiled;
+    uint32_t blocks_invalidated;
+};
+
+// A Chip8Jit caches code for one machine at a time.
+Chip8Jit *chip8_jit_create();
+void chip8_jit_destroy(Chip8Jit *jit);
+// Drops every translated block. Only needed after direct writes to M, which
+// bypass memory_writes; switching machines or re-initializing one flushes by itself.
+void chip8_jit_flush(Chip8Jit *jit);
+
+// Same contract as chip8_machine_run.
+uint32_t chip8_jit_run(Chip8Jit *jit, Chip8 *c8, uint32_t cycles, const bool keys[CHIP8_NUM_KEYS]);
+
+Chip8JitStats chip8_jit_stats(const Chip8Jit *jit);
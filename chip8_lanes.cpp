@@ -0,0 +1,537 @@
+#include "chip8_lanes.h"
+#include "chip8_quirks.h"
+
+#include <memory.h>
+#include <assert.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Once lanes disagree on PC they usually stay apart for a while, so the
+// fallback runs a short burst per lane before checking for lockstep again.
+#define DIVERGENT_BURST 16
+#define MAX_DIVERGENT_BURST 1024
+
+typedef uint8_t LaneBytes[CHIP8_LANES];
+
+// Register-wide operations over all lanes. Each helper matches one statement of
+// the scalar handler in chip8.cpp, so statement order (and with it aliasing of
+// x, y and VF) behaves exactly like the scalar core.
+#if defined(__AVX2__)
+static_assert(CHIP8_LANES == 32, "AVX2 path assumes one ymm register per register file row");
+
+static inline __m256i load(const uint8_t *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void store(uint8_t *p, __m256i v) { _mm256_storeu_si256((__m256i *)p, v); }
+static inline __m256i splat(uint8_t value) { return _mm256_set1_epi8((char)value); }
+
+static void lanes_set(uint8_t *dst, uint8_t value) { store(dst, splat(value)); }
+static void lanes_add_imm(uint8_t *dst, uint8_t value) { store(dst, _mm256_add_epi8(load(dst), splat(value))); }
+static void lanes_copy(uint8_t *dst, const uint8_t *src) { store(dst, load(src)); }
+static void lanes_or(uint8_t *dst, const uint8_t *src) { store(dst, _mm256_or_si256(load(dst), load(src))); }
+static void lanes_and(uint8_t *dst, const uint8_t *src) { store(dst, _mm256_and_si256(load(dst), load(src))); }
+static void lanes_xor(uint8_t *dst, const uint8_t *src) { store(dst, _mm256_xor_si256(load(dst), load(src))); }
+
+// dst = a - b
+static void lanes_sub(uint8_t *dst, const uint8_t *a, const uint8_t *b) { store(dst, _mm256_sub_epi8(load(a), load(b))); }
+
+// dst = a > b (unsigned), as 0 or 1
+static void lanes_greater(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+    __m256i va = load(a), vb = load(b);
+    __m256i not_greater = _mm256_cmpeq_epi8(_mm256_max_epu8(va, vb), vb);
+    store(dst, _mm256_andnot_si256(not_greater, splat(1)));
+}
+
+// dst = a >= b (unsigned), as 0 or 1
+static void lanes_greater_equal(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+    __m256i va = load(a), vb = load(b);
+    __m256i greater_equal = _mm256_cmpeq_epi8(_mm256_max_epu8(va, vb), va);
+    store(dst, _mm256_and_si256(greater_equal, splat(1)));
+}
+
+// x += y; VF = 1 if it carried (VF left alone otherwise)
+static void lanes_add_carry(uint8_t *x, const uint8_t *y, uint8_t *vf) {
+    __m256i a = load(x), b = load(y);
+    __m256i sum = _mm256_add_epi8(a, b);
+    __m256i carry = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_adds_epu8(a, b), sum), splat(0xFF));
+    store(vf, _mm256_blendv_epi8(load(vf), splat(1), carry));
+    store(x, sum);
+}
+
+static void lanes_and_imm(uint8_t *dst, const uint8_t *src, uint8_t value) { store(dst, _mm256_and_si256(load(src), splat(value))); }
+static void lanes_shr1(uint8_t *dst) { store(dst, _mm256_and_si256(_mm256_srli_epi16(load(dst), 1), splat(0x7F))); }
+static void lanes_shl1(uint8_t *dst) { __m256i v = load(dst); store(dst, _mm256_add_epi8(v, v)); }
+#else
+static void lanes_set(uint8_t *dst, uint8_t value) { memset(dst, value, CHIP8_LANES); }
+static void lanes_add_imm(uint8_t *dst, uint8_t value) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] += value; }
+static void lanes_copy(uint8_t *dst, const uint8_t *src) { memmove(dst, src, CHIP8_LANES); }
+static void lanes_or(uint8_t *dst, const uint8_t *src) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] |= src[l]; }
+static void lanes_and(uint8_t *dst, const uint8_t *src) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] &= src[l]; }
+static void lanes_xor(uint8_t *dst, const uint8_t *src) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] ^= src[l]; }
+
+static void lanes_sub(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+    LaneBytes result;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) result[l] = a[l] - b[l];
+    memcpy(dst, result, CHIP8_LANES);
+}
+
+static void lanes_greater(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+    LaneBytes result;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) result[l] = a[l] > b[l];
+    memcpy(dst, result, CHIP8_LANES);
+}
+
+static void lanes_greater_equal(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+    LaneBytes result;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) result[l] = a[l] >= b[l];
+    memcpy(dst, result, CHIP8_LANES);
+}
+
+static void lanes_add_carry(uint8_t *x, const uint8_t *y, uint8_t *vf) {
+    LaneBytes sum, carry;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) {
+        uint32_t result = x[l] + y[l];
+        sum[l] = result & 0xFF;
+        carry[l] = result > 0xFF;
+    }
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) if (carry[l]) vf[l] = 1;
+    memcpy(x, sum, CHIP8_LANES);
+}
+
+static void lanes_and_imm(uint8_t *dst, const uint8_t *src, uint8_t value) {
+    LaneBytes result;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) result[l] = src[l] & value;
+    memcpy(dst, result, CHIP8_LANES);
+}
+
+static void lanes_shr1(uint8_t *dst) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] >>= 1; }
+static void lanes_shl1(uint8_t *dst) { for (uint32_t l = 0; l < CHIP8_LANES; ++l) dst[l] <<= 1; }
+#endif
+
+void chip8_lanes_init(Chip8Lanes *lanes, const uint8_t *program, uint32_t program_size, uint32_t num_lanes) {
+    assert(num_lanes > 0 && num_lanes <= CHIP8_LANES);
+    lanes->num_lanes = num_lanes;
+    lanes->lockstep_cycles = 0;
+    lanes->divergent_cycles = 0;
+    lanes->memory_writes = 0;
+    chip8_machine_init(&lanes->machines[0], program, program_size);
+    for (uint32_t l = 1; l < CHIP8_LANES; ++l) lanes->machines[l] = lanes->machines[0];
+}
+
+// Lanes past num_lanes are never compared or stored back; they just mirror lane 0.
+static void gather(Chip8Lanes *lanes) {
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) {
+        const Chip8 *c8 = &lanes->machines[l < lanes->num_lanes ? l : 0];
+        for (uint32_t r = 0; r < CHIP8_NUM_REGISTERS; ++r) lanes->V[r][l] = c8->V[r];
+        lanes->I[l] = c8->I;
+        lanes->PC[l] = c8->PC;
+        lanes->delay_timer[l] = c8->delay_timer;
+        lanes->sound_timer[l] = c8->sound_timer;
+    }
+    lanes->cycle_counter = lanes->machines[0].cycle_counter;
+}
+
+static void scatter_lane(Chip8Lanes *lanes, uint32_t l) {
+    Chip8 *c8 = &lanes->machines[l];
+    for (uint32_t r = 0; r < CHIP8_NUM_REGISTERS; ++r) c8->V[r] = lanes->V[r][l];
+    c8->I = lanes->I[l];
+    c8->PC = lanes->PC[l];
+    c8->delay_timer = lanes->delay_timer[l];
+    c8->sound_timer = lanes->sound_timer[l];
+    c8->cycle_counter = lanes->cycle_counter;
+}
+
+static void gather_lane(Chip8Lanes *lanes, uint32_t l) {
+    const Chip8 *c8 = &lanes->machines[l];
+    for (uint32_t r = 0; r < CHIP8_NUM_REGISTERS; ++r) lanes->V[r][l] = c8->V[r];
+    lanes->I[l] = c8->I;
+    lanes->PC[l] = c8->PC;
+    lanes->delay_timer[l] = c8->delay_timer;
+    lanes->sound_timer[l] = c8->sound_timer;
+}
+
+static bool any_fault(const Chip8Lanes *lanes) {
+    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+        if (lanes->machines[l].fault) return true;
+    }
+    return false;
+}
+
+static uint64_t total_memory_writes(const Chip8Lanes *lanes) {
+    uint64_t writes = 0;
+    for (uint32_t l = 0; l < lanes->num_lanes; ++l) writes += lanes->machines[l].memory_writes;
+    return writes;
+}
+
+// Stores into one lane's memory. Opcodes overlapping the write may now differ
+// between lanes, so they lose their verified mark.
+static void lane_write(Chip8Lanes *lanes, uint32_t l, uint16_t addr, const uint8_t *data, uint32_t size) {
+    Chip8 *c8 = &lanes->machines[l];
+    const uint32_t writes = c8->memory_writes;
+    chip8_machine_write_memory(c8, addr, data, size);
+    lanes->memory_writes += c8->memory_writes - writes;
+    for (uint32_t a = addr > 0 ? addr - 1 : 0; a < addr + size && a < CHIP8_MEMORY_SIZE; ++a) {
+        lanes->same_opcode[a >> 3] &= ~(1 << (a & 7));
+    }
+}
+
+// Whether `size` bytes from every lane's I lie inside M.
+static bool in_memory(const Chip8Lanes *lanes, uint32_t size) {
+    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+        if (lanes->I[l] + size > CHIP8_MEMORY_SIZE) return false;
+    }
+    return true;
+}
+
+// Returns the opcode all lanes are about to execute, or -1 if they disagree.
+static int32_t common_opcode(Chip8Lanes *lanes) {
+    const uint16_t pc = lanes->PC[0];
+    for (uint32_t l = 1; l < lanes->num_lanes; ++l) {
+        if (lanes->PC[l] != pc) return -1;
+    }
+    if (pc + 1 >= CHIP8_MEMORY_SIZE) return -1; // faults in the scalar core
+    const uint8_t hi = lanes->machines[0].M[pc];
+    const uint8_t lo = lanes->machines[0].M[pc + 1];
+    if (!(lanes->same_opcode[pc >> 3] & (1 << (pc & 7)))) {
+        for (uint32_t l = 1; l < lanes->num_lanes; ++l) {
+            if (lanes->machines[l].M[pc] != hi || lanes->machines[l].M[pc + 1] != lo) return -1;
+        }
+        lanes->same_opcode[pc >> 3] |= 1 << (pc & 7);
+    }
+    return (hi << 8) | lo;
+}
+
+static void set_pc(Chip8Lanes *lanes, uint16_t pc) {
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->PC[l] = pc;
+}
+
+// Skip instructions: lanes that take the skip move 4 bytes, the rest 2.
+static void skip_if(Chip8Lanes *lanes, const uint8_t *take) {
+    const uint16_t pc = lanes->PC[0];
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->PC[l] = pc + (take[l] ? 4 : 2);
+}
+
+// I after Fx55/Fx65 with end register x.
+template <typename Quirks>
+static void advance_i(Chip8Lanes *lanes, uint8_t x) {
+    if (Quirks::store_i == STORE_I_KEEP) return;
+    const uint16_t amount = Quirks::store_i == STORE_I_PLUS_X ? x : x + 1;
+    for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->I[l] += amount;
+}
+
+// Executes one instruction for all lanes. Returns false, touching nothing,
+// when the instruction would fault in the scalar core.
+template <typename Quirks>
+static bool step_lockstep(Chip8Lanes *lanes, uint16_t opcode, const bool (*keys)[CHIP8_NUM_KEYS]) {
+    const uint8_t x = (opcode >> 8) & 0xF;
+    const uint8_t y = (opcode >> 4) & 0xF;
+    const uint8_t kk = opcode & 0xFF;
+    const uint16_t nnn = opcode & 0xFFF;
+    uint8_t *Vx = lanes->V[x];
+    uint8_t *Vy = lanes->V[y];
+    uint8_t *VF = lanes->V[0xF];
+    LaneBytes take, flag, source;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            // Screen and stack live in the machines; walk the lanes but skip the
+            // scatter/gather a scalar fallback would cost.
+            if (opcode == 0x00e0) {
+                for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                    Chip8 *c8 = &lanes->machines[l];
+                    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+                        if (c8->screen[row]) c8->dirty_rows |= 1u << row;
+                    }
+                    memset(c8->screen, 0, sizeof(c8->screen));
+                }
+                break;
+            }
+            if (opcode == 0x00ee) {
+                for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                    if (lanes->machines[l].SP == 0) return false;
+                }
+                for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                    Chip8 *c8 = &lanes->machines[l];
+                    lanes->PC[l] = c8->stack[--c8->SP];
+                }
+                return true;
+            }
+            return false;
+        case 0x1:
+            if (nnn == lanes->PC[0]) return false; // idle, the scalar core skips it in one go
+            set_pc(lanes, nnn);
+            return true;
+        case 0x2:
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                if (lanes->machines[l].SP >= CHIP8_STACK_SIZE) return false;
+            }
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                Chip8 *c8 = &lanes->machines[l];
+                c8->stack[c8->SP++] = lanes->PC[0] + 2;
+            }
+            set_pc(lanes, nnn);
+            return true;
+        case 0x3:
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) take[l] = Vx[l] == kk;
+            skip_if(lanes, take);
+            return true;
+        case 0x4:
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) take[l] = Vx[l] != kk;
+            skip_if(lanes, take);
+            return true;
+        case 0x5:
+            if ((opcode & 0xF) != 0) return false;
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) take[l] = Vx[l] == Vy[l];
+            skip_if(lanes, take);
+            return true;
+        case 0x6:
+            lanes_set(Vx, kk);
+            break;
+        case 0x7:
+            lanes_add_imm(Vx, kk);
+            break;
+        case 0x8:
+            switch (opcode & 0xF) {
+                case 0x0: lanes_copy(Vx, Vy); break;
+                case 0x1: lanes_or(Vx, Vy); break;
+                case 0x2: lanes_and(Vx, Vy); break;
+                case 0x3: lanes_xor(Vx, Vy); break;
+                default: break;
+            }
+            if (Quirks::legacy_flags) {
+                switch (opcode & 0xF) {
+                    case 0x4: lanes_add_carry(Vx, Vy, VF); break;
+                    case 0x5:
+                        lanes_greater(VF, Vx, Vy);
+                        lanes_sub(Vx, Vx, Vy);
+                        break;
+                    case 0x6:
+                        lanes_and_imm(VF, Vx, 0x1);
+                        lanes_shr1(Vx);
+                        break;
+                    case 0x7:
+                        lanes_greater(VF, Vy, Vx);
+                        lanes_sub(Vx, Vy, Vx);
+                        break;
+                    case 0xe:
+                        lanes_and_imm(VF, Vx, 0x80);
+                        lanes_shl1(Vx);
+                        break;
+                }
+            }
+            else {
+                // Result first, flag last, as in the scalar handlers.
+                switch (opcode & 0xF) {
+                    case 0x4:
+                        lanes_set(flag, 0);
+                        lanes_add_carry(Vx, Vy, flag);
+                        lanes_copy(VF, flag);
+                        break;
+                    case 0x5:
+                        lanes_greater_equal(flag, Vx, Vy);
+                        lanes_sub(Vx, Vx, Vy);
+                        lanes_copy(VF, flag);
+                        break;
+                    case 0x6:
+                        lanes_copy(source, Quirks::shift_vy ? Vy : Vx);
+                        lanes_and_imm(flag, source, 0x1);
+                        lanes_shr1(source);
+                        lanes_copy(Vx, source);
+                        lanes_copy(VF, flag);
+                        break;
+                    case 0x7:
+                        lanes_greater_equal(flag, Vy, Vx);
+                        lanes_sub(Vx, Vy, Vx);
+                        lanes_copy(VF, flag);
+                        break;
+                    case 0xe:
+                        lanes_copy(source, Quirks::shift_vy ? Vy : Vx);
+                        lanes_set(flag, 0x7F);
+                        lanes_greater(flag, source, flag);
+                        lanes_shl1(source);
+                        lanes_copy(Vx, source);
+                        lanes_copy(VF, flag);
+                        break;
+                }
+            }
+            switch (opcode & 0xF) {
+                case 0x1: case 0x2: case 0x3:
+                    if (Quirks::vf_reset) lanes_set(VF, 0);
+                    break;
+                case 0x0: case 0x4: case 0x5: case 0x6: case 0x7: case 0xe:
+                    break;
+                default: return false;
+            }
+            break;
+        case 0x9:
+            if ((opcode & 0xF) != 0) return false;
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) take[l] = Vx[l] != Vy[l];
+            skip_if(lanes, take);
+            return true;
+        case 0xa:
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->I[l] = nnn;
+            break;
+        case 0xb:
+            if (!Quirks::has_jump) return false;
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->PC[l] = (nnn + lanes->V[Quirks::jump_vx ? x : 0][l]) & 0xFFF;
+            return true;
+        case 0xc:
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                Vx[l] = (chip8_machine_random(&lanes->machines[l]) % 0x100) & kk;
+            }
+            break;
+        case 0xd: {
+            const uint8_t n = opcode & 0xF;
+            if (!in_memory(lanes, n)) return false;
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                Chip8 *c8 = &lanes->machines[l];
+                const uint8_t x0 = Quirks::wrap_start ? Vx[l] % CHIP8_SCR_W : Vx[l];
+                const uint8_t y0 = Quirks::wrap_start ? Vy[l] % CHIP8_SCR_H : Vy[l];
+                const uint16_t sprite = lanes->I[l];
+                uint64_t collision = 0;
+                if (x0 < CHIP8_SCR_W) {
+                    for (uint8_t row = 0; row < n; ++row) {
+                        uint8_t curY = y0 + row;
+                        if (curY >= CHIP8_SCR_H) break;
+                        uint64_t bits = ((uint64_t)c8->M[sprite + row] << (CHIP8_SCR_W - 8)) >> x0;
+                        collision |= c8->screen[curY] & bits;
+                        c8->screen[curY] ^= bits;
+                        if (bits) c8->dirty_rows |= 1u << curY;
+                    }
+                }
+                VF[l] = collision != 0;
+            }
+            break;
+        }
+        case 0xe: {
+            if (kk != 0x9e && kk != 0xa1) return false;
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                if (Vx[l] > 0xF) return false; // let the scalar core deal with it
+            }
+            for (uint32_t l = 0; l < lanes->num_lanes; ++l) lanes->machines[l].key_reads++;
+            const bool want = kk == 0x9e;
+            for (uint32_t l = 0; l < CHIP8_LANES; ++l) take[l] = l < lanes->num_lanes && keys[l][Vx[l]] == want;
+            skip_if(lanes, take);
+            return true;
+        }
+        case 0xf:
+            switch (kk) {
+                case 0x07: memcpy(Vx, lanes->delay_timer, CHIP8_LANES); break;
+                case 0x15: memcpy(lanes->delay_timer, Vx, CHIP8_LANES); break;
+                case 0x18: memcpy(lanes->sound_timer, Vx, CHIP8_LANES); break;
+                case 0x1e: for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->I[l] += Vx[l]; break;
+                case 0x29:
+                    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                        if (Vx[l] > 0xF) return false;
+                    }
+                    for (uint32_t l = 0; l < CHIP8_LANES; ++l) lanes->I[l] = 5 * Vx[l]; // built-in glyphs are 5 bytes tall
+                    break;
+                case 0x33:
+                    if (!in_memory(lanes, 3)) return false;
+                    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                        const uint8_t value = Vx[l];
+                        const uint8_t digits[3] = { (uint8_t)(value / 100), (uint8_t)((value % 100) / 10), (uint8_t)(value % 10) };
+                        lane_write(lanes, l, lanes->I[l], digits, 3);
+                    }
+                    break;
+                case 0x55:
+                    if (!in_memory(lanes, x + 1)) return false;
+                    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                        uint8_t regs[CHIP8_NUM_REGISTERS];
+                        for (uint8_t i = 0; i <= x; ++i) regs[i] = lanes->V[i][l];
+                        lane_write(lanes, l, lanes->I[l], regs, x + 1);
+                    }
+                    advance_i<Quirks>(lanes, x);
+                    break;
+                case 0x65:
+                    if (!in_memory(lanes, x + 1)) return false;
+                    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+                        const uint8_t *src = &lanes->machines[l].M[lanes->I[l]];
+                        for (uint8_t i = 0; i <= x; ++i) lanes->V[i][l] = src[i];
+                    }
+                    advance_i<Quirks>(lanes, x);
+                    break;
+                default: return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    set_pc(lanes, lanes->PC[0] + 2);
+    return true;
+}
+
+static void tick(Chip8Lanes *lanes) {
+    if (--lanes->cycle_counter == 0) {
+        lanes->cycle_counter = lanes->machines[0].cycles_per_timer;
+        for (uint32_t l = 0; l < CHIP8_LANES; ++l) {
+            if (lanes->delay_timer[l] > 0) lanes->delay_timer[l]--;
+            if (lanes->sound_timer[l] > 0) lanes->sound_timer[l]--;
+        }
+    }
+}
+
+template <typename Quirks>
+static void run(Chip8Lanes *lanes, uint32_t cycles, const bool (*keys)[CHIP8_NUM_KEYS]) {
+    gather(lanes);
+    // Lanes may have been modified from outside since the last run.
+    memset(lanes->same_opcode, 0, sizeof(lanes->same_opcode));
+
+    uint32_t done = 0;
+    uint32_t lockstep = 0;
+    uint32_t divergent_burst = DIVERGENT_BURST;
+    // Faulted machines stand still, which is left to the scalar core.
+    bool faulted = any_fault(lanes);
+    while (done < cycles) {
+        int32_t opcode = faulted ? -1 : common_opcode(lanes);
+        if (opcode >= 0 && step_lockstep<Quirks>(lanes, (uint16_t)opcode, keys)) {
+            tick(lanes);
+            lanes->lockstep_cycles++;
+            lockstep++;
+            divergent_burst = DIVERGENT_BURST;
+            done++;
+            continue;
+        }
+
+        // Divergent, or an instruction with per-lane side effects: let every lane
+        // run on its own machine for a little while. Lanes that stay apart get
+        // longer bursts so the switching cost is paid less often.
+        uint32_t burst = 1;
+        if (opcode == (0x1000 | lanes->PC[0])) burst = cycles - done;
+        else if (opcode < 0) {
+            burst = divergent_burst;
+            if (divergent_burst < MAX_DIVERGENT_BURST) divergent_burst *= 2;
+        }
+        if (burst > cycles - done) burst = cycles - done;
+        for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+            scatter_lane(lanes, l);
+            chip8_machine_run(&lanes->machines[l], burst, keys[l]);
+            gather_lane(lanes, l);
+        }
+        lanes->cycle_counter = lanes->machines[0].cycle_counter;
+        lanes->divergent_cycles += burst;
+        faulted = any_fault(lanes);
+
+        uint64_t writes = total_memory_writes(lanes);
+        if (writes != lanes->memory_writes) {
+            lanes->memory_writes = writes;
+            memset(lanes->same_opcode, 0, sizeof(lanes->same_opcode));
+        }
+        done += burst;
+    }
+
+    for (uint32_t l = 0; l < lanes->num_lanes; ++l) {
+        scatter_lane(lanes, l);
+        lanes->machines[l].cycles += lockstep; // the scalar bursts counted themselves
+    }
+}
+
+void chip8_lanes_run(Chip8Lanes *lanes, uint32_t cycles, const bool (*keys)[CHIP8_NUM_KEYS]) {
+    switch (lanes->machines[0].quirks) {
+        case CHIP8_QUIRKS_VIP: run<QuirksVip>(lanes, cycles, keys); break;
+        case CHIP8_QUIRKS_CHIP48: run<QuirksChip48>(lanes, cycles, keys); break;
+        case CHIP8_QUIRKS_SCHIP: run<QuirksSchip>(lanes, cycles, keys); break;
+        default: run<QuirksLegacy>(lanes, cycles, keys); break;
+    }
+}
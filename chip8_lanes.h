@@ -0,0 +1,37 @@
+#pragma once
+
+#include "chip8.h"
+
+#define CHIP8_LANES 32
+
+// Up to CHIP8_LANES machines running the same program in lockstep. While all
+// lanes sit at the same PC on the same opcode, the instruction is executed once
+// for all lanes on the structure-of-arrays registers below (AVX2 when the
+// compiler targets it); memory, stack and screen stay in the per-lane machines.
+// Cycles where lanes disagree on PC fall back to chip8_machine_run per lane.
+// All lanes must use the same quirk profile.
+struct Chip8Lanes {
+    uint8_t V[CHIP8_NUM_REGISTERS][CHIP8_LANES];
+    uint16_t I[CHIP8_LANES];
+    uint16_t PC[CHIP8_LANES];
+    uint8_t delay_timer[CHIP8_LANES];
+    uint8_t sound_timer[CHIP8_LANES];
+    uint32_t cycle_counter; // shared, every lane always runs the same number of cycles
+    uint32_t num_lanes;
+
+    // Bit per address whose opcode is known to be identical in every lane.
+    // Cleared around every write to lane memory.
+    uint8_t same_opcode[CHIP8_MEMORY_SIZE / 8];
+    uint64_t memory_writes; // sum of the machines' memory_writes when same_opcode was last valid
+
+    // Everything else about each lane. Fully up to date between chip8_lanes_run calls,
+    // so lanes can be inspected, saved or modified through these.
+    Chip8 machines[CHIP8_LANES];
+
+    uint64_t lockstep_cycles; // cycles executed once for all lanes
+    uint64_t divergent_cycles; // cycles executed lane by lane
+};
+
+void chip8_lanes_init(Chip8Lanes *lanes, const uint8_t *program, uint32_t program_size, uint32_t num_lanes);
+// keys holds one key array per lane.
+void chip8_lanes_run(Chip8Lanes *lanes, uint32_t cycles, const bool (*keys)[CHIP8_NUM_KEYS]);
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "chip8.h"
+#include "chip8_quirks.h"
+
+#include <string.h>
+
+// Instruction semantics for code that executes programs outside the
+// interpreter loop: the JIT's helpers and ahead-of-time translations. Each
+// function matches the interpreter handler of the same name under the same
+// Quirks and leaves PC to the caller. With constant operands they inline down
+// to what the interpreter handler does once decoded.
+
+template <typename Quirks>
+inline void chip8_op_or(uint8_t *V, uint32_t x, uint32_t y) {
+    V[x] |= V[y];
+    if (Quirks::vf_reset) V[0xF] = 0;
+}
+
+template <typename Quirks>
+inline void chip8_op_and(uint8_t *V, uint32_t x, uint32_t y) {
+    V[x] &= V[y];
+    if (Quirks::vf_reset) V[0xF] = 0;
+}
+
+template <typename Quirks>
+inline void chip8_op_xor(uint8_t *V, uint32_t x, uint32_t y) {
+    V[x] ^= V[y];
+    if (Quirks::vf_reset) V[0xF] = 0;
+}
+
+template <typename Quirks>
+inline void chip8_op_add_v(uint8_t *V, uint32_t x, uint32_t y) {
+    uint32_t result = V[x] + V[y];
+    if (Quirks::legacy_flags) {
+        if (result > 0xFF) V[0xF] = 1;
+        V[x] = result & 0xFF;
+    }
+    else {
+        V[x] = result & 0xFF;
+        V[0xF] = result > 0xFF;
+    }
+}
+
+template <typename Quirks>
+inline void chip8_op_sub(uint8_t *V, uint32_t x, uint32_t y) {
+    if (Quirks::legacy_flags) {
+        V[0xF] = V[x] > V[y];
+        V[x] = V[x] - V[y];
+    }
+    else {
+        const uint8_t flag = V[x] >= V[y];
+        V[x] = V[x] - V[y];
+        V[0xF] = flag;
+    }
+}
+
+template <typename Quirks>
+inline void chip8_op_subn(uint8_t *V, uint32_t x, uint32_t y) {
+    if (Quirks::legacy_flags) {
+        V[0xF] = V[y] > V[x];
+        V[x] = V[y] - V[x];
+    }
+    else {
+        const uint8_t flag = V[y] >= V[x];
+        V[x] = V[y] - V[x];
+        V[0xF] = flag;
+    }
+}
+
+template <typename Quirks>
+inline void chip8_op_shr(uint8_t *V, uint32_t x, uint32_t y) {
+    if (Quirks::legacy_flags) {
+        V[0xF] = V[x] & 0x1;
+        V[x] >>= 1;
+    }
+    else {
+        const uint8_t source = V[Quirks::shift_vy ? y : x];
+        V[x] = source >> 1;
+        V[0xF] = source & 0x1;
+    }
+}
+
+template <typename Quirks>
+inline void chip8_op_shl(uint8_t *V, uint32_t x, uint32_t y) {
+    if (Quirks::legacy_flags) {
+        V[0xF] = V[x] & 0x80;
+        V[x] <<= 1;
+    }
+    else {
+        const uint8_t source = V[Quirks::shift_vy ? y : x];
+        V[x] = source << 1;
+        V[0xF] = source >> 7;
+    }
+}
+
+inline void chip8_op_cls(Chip8 *c8) {
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        if (c8->screen[row]) c8->dirty_rows |= 1u << row;
+    }
+    memset(c8->screen, 0, sizeof(c8->screen));
+}
+
+inline void chip8_op_rnd(Chip8 *c8, uint32_t x, uint32_t kk) {
+    c8->V[x] = (chip8_machine_random(c8) % 0x100) & kk;
+}
+
+template <typename Quirks>
+inline void chip8_op_drw(Chip8 *c8, uint32_t x, uint32_t y, uint32_t n) {
+    const uint8_t x0 = Quirks::wrap_start ? c8->V[x] % CHIP8_SCR_W : c8->V[x];
+    const uint8_t y0 = Quirks::wrap_start ? c8->V[y] % CHIP8_SCR_H : c8->V[y];
+    uint64_t collision = 0;
+    if (x0 < CHIP8_SCR_W) {
+        for (uint8_t row = 0; row < n; ++row) {
+            uint8_t curY = y0 + row;
+            if (curY >= CHIP8_SCR_H) break;
+            uint64_t bits = ((uint64_t)c8->M[c8->I + row] << (CHIP8_SCR_W - 8)) >> x0;
+            collision |= c8->screen[curY] & bits;
+            c8->screen[curY] ^= bits;
+            if (bits) c8->dirty_rows |= 1u << curY;
+        }
+    }
+    c8->V[0xF] = collision != 0;
+}
+
+// Whether `size` bytes from I lie inside M. Dxyn, Fx33, Fx55 and Fx65 fault
+// in the interpreter otherwise, so translated code leaves them to it.
+inline bool chip8_in_memory(const Chip8 *c8, uint32_t size) {
+    return c8->I + size <= CHIP8_MEMORY_SIZE;
+}
+
+// What chip8_machine_write_memory does for the few bytes an instruction
+// stores: writes them without comparing first, bumps memory_writes and drops
+// the decode cache over the range and the fused sequences that reach into it.
+// Inline, since Fx33 and Fx55 are little more than this.
+inline void chip8_machine_store(Chip8 *c8, uint32_t addr, const uint8_t *data, uint32_t size) {
+    memcpy(c8->M + addr, data, size);
+    c8->memory_writes++;
+    for (uint32_t at = addr > 5 ? addr - 5 : 0; at < addr + size; ++at) c8->decoded[at].handler = CHIP8_OP_DECODE;
+}
+
+inline void chip8_op_bcd(Chip8 *c8, uint32_t x) {
+    const uint8_t value = c8->V[x];
+    const uint8_t digits[3] = { (uint8_t)(value / 100), (uint8_t)((value % 100) / 10), (uint8_t)(value % 10) };
+    chip8_machine_store(c8, c8->I, digits, 3);
+}
+
+template <typename Quirks>
+inline void chip8_op_store(Chip8 *c8, uint32_t x) {
+    chip8_machine_store(c8, c8->I, c8->V, x + 1);
+    if (Quirks::store_i == STORE_I_PLUS_X) c8->I += x;
+    if (Quirks::store_i == STORE_I_PLUS_X_PLUS_1) c8->I += x + 1;
+}
+
+template <typename Quirks>
+inline void chip8_op_load(Chip8 *c8, uint32_t x) {
+    for (uint32_t i = 0; i <= x; ++i) c8->V[i] = c8->M[c8->I + i];
+    if (Quirks::store_i == STORE_I_PLUS_X) c8->I += x;
+    if (Quirks::store_i == STORE_I_PLUS_X_PLUS_1) c8->I += x + 1;
+}
+
+// Books `executed` cycles run outside chip8_machine_run, which must not have
+// crossed a timer tick, and ticks the timers when they end exactly on one.
+inline void chip8_account_cycles(Chip8 *c8, uint32_t executed) {
+    c8->cycles += executed;
+    c8->cycle_counter -= executed;
+    if (c8->cycle_counter == 0) {
+        c8->cycle_counter = c8->cycles_per_timer;
+        if (c8->delay_timer > 0) c8->delay_timer--;
+        if (c8->sound_timer > 0) c8->sound_timer--;
+    }
+}
+
+// How many cycles to hand to chip8_machine_run at an instruction that is left
+// to the interpreter. Idle loops get as much as it can skip in one go: jumps
+// to self and Fx0A without keys the whole run, delay timer polling up to the
+// next tick, and so does a faulted machine. Anything else gets one cycle.
+inline uint32_t chip8_interpret_cycles(const Chip8 *c8, uint32_t chunk, uint32_t remaining, const bool keys[CHIP8_NUM_KEYS]) {
+    const uint16_t pc = c8->PC;
+    if (c8->fault) return remaining;
+    if (pc + 1 >= CHIP8_MEMORY_SIZE) return 1;
+    const uint8_t hi = c8->M[pc];
+    const uint8_t lo = c8->M[pc + 1];
+    if ((hi >> 4) == 0x1 && (((hi & 0xF) << 8) | lo) == pc) return remaining;
+    if ((hi >> 4) == 0xF && lo == 0x0A) {
+        bool any_key = false;
+        for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) any_key |= keys[key];
+        return any_key ? 1 : remaining;
+    }
+    if ((hi >> 4) == 0xF && lo == 0x07) return chunk;
+    return 1;
+}
+
+// Whether the instruction at pc is a delay timer polling loop
+// "Fx07; 3xkk; 1nnn back to the Fx07", which the interpreter skips over.
+inline bool chip8_is_timer_poll(const uint8_t *M, uint32_t pc) {
+    return pc + 5 < CHIP8_MEMORY_SIZE && (M[pc] >> 4) == 0xF && M[pc + 1] == 0x07 &&
+        M[pc + 2] == (0x30 | (M[pc] & 0xF)) &&
+        (M[pc + 4] >> 4) == 0x1 && (((M[pc + 4] & 0xF) << 8) | M[pc + 5]) == pc;
+}
@@ -0,0 +1,116 @@
+#include "chip8_profile.h"
+
+#include <algorithm>
+#include <vector>
+#include <memory.h>
+#include <string.h>
+
+#define OP_DECODE CHIP8_OP_DECODE
+
+void chip8_profile_reset(Chip8Profile *profile) {
+    memset(profile, 0, sizeof(*profile));
+}
+
+void chip8_profile_add(Chip8Profile *dst, const Chip8Profile *src) {
+    for (uint32_t op = 0; op < CHIP8_MAX_OPS; ++op) dst->op_counts[op] += src->op_counts[op];
+    for (uint32_t pc = 0; pc < CHIP8_MEMORY_SIZE; ++pc) dst->pc_counts[pc] += src->pc_counts[pc];
+    dst->draw_ns += src->draw_ns;
+    dst->idle_cycles += src->idle_cycles;
+}
+
+static uint32_t find_op(const char *name) {
+    uint32_t op = 0;
+    while (chip8_op_name(op) && strcmp(chip8_op_name(op), name) != 0) op++;
+    return op;
+}
+
+static uint64_t total_instructions(const Chip8Profile *profile) {
+    uint64_t total = 0;
+    for (uint32_t op = 0; chip8_op_name(op); ++op) {
+        if (op != OP_DECODE) total += profile->op_counts[op];
+    }
+    return total;
+}
+
+static uint16_t opcode_at(const uint8_t *memory, uint32_t pc) {
+    return pc + 1 < CHIP8_MEMORY_SIZE ? (memory[pc] << 8) | memory[pc + 1] : memory[pc] << 8;
+}
+
+// Indices of the nonzero entries of `counts`, busiest first.
+static std::vector<uint32_t> sorted_nonzero(const uint64_t *counts, uint32_t size) {
+    std::vector<uint32_t> indices;
+    for (uint32_t i = 0; i < size; ++i) {
+        if (counts[i]) indices.push_back(i);
+    }
+    std::stable_sort(indices.begin(), indices.end(), [counts](uint32_t a, uint32_t b) { return counts[a] > counts[b]; });
+    return indices;
+}
+
+void chip8_profile_write_json(const Chip8Profile *profile, const uint8_t *memory, FILE *file) {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"instructions\": %llu,\n", (unsigned long long)total_instructions(profile));
+    fprintf(file, "  \"decodes\": %llu,\n", (unsigned long long)profile->op_counts[OP_DECODE]);
+    fprintf(file, "  \"draw_ns\": %llu,\n", (unsigned long long)profile->draw_ns);
+    fprintf(file, "  \"idle_cycles\": %llu,\n", (unsigned long long)profile->idle_cycles);
+
+    fprintf(file, "  \"ops\": {");
+    const char *separator = "\n";
+    for (uint32_t op = 0; chip8_op_name(op); ++op) {
+        if (op == OP_DECODE || !profile->op_counts[op]) continue;
+        fprintf(file, "%s    \"%s\": %llu", separator, chip8_op_name(op), (unsigned long long)profile->op_counts[op]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  },\n");
+
+    fprintf(file, "  \"pcs\": [");
+    separator = "\n";
+    for (uint32_t pc = 0; pc < CHIP8_MEMORY_SIZE; ++pc) {
+        if (!profile->pc_counts[pc]) continue;
+        fprintf(file, "%s    { \"pc\": %u, \"opcode\": \"%04x\", \"count\": %llu }",
+                separator, pc, opcode_at(memory, pc), (unsigned long long)profile->pc_counts[pc]);
+        separator = ",\n";
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+void chip8_profile_write_csv(const Chip8Profile *profile, const uint8_t *memory, FILE *file) {
+    fprintf(file, "kind,key,opcode,count\n");
+    fprintf(file, "total,instructions,,%llu\n", (unsigned long long)total_instructions(profile));
+    fprintf(file, "total,decodes,,%llu\n", (unsigned long long)profile->op_counts[OP_DECODE]);
+    fprintf(file, "total,draw_ns,,%llu\n", (unsigned long long)profile->draw_ns);
+    fprintf(file, "total,idle_cycles,,%llu\n", (unsigned long long)profile->idle_cycles);
+    for (uint32_t op = 0; chip8_op_name(op); ++op) {
+        if (op == OP_DECODE || !profile->op_counts[op]) continue;
+        fprintf(file, "op,%s,,%llu\n", chip8_op_name(op), (unsigned long long)profile->op_counts[op]);
+    }
+    for (uint32_t pc = 0; pc < CHIP8_MEMORY_SIZE; ++pc) {
+        if (!profile->pc_counts[pc]) continue;
+        fprintf(file, "pc,%03x,%04x,%llu\n", pc, opcode_at(memory, pc), (unsigned long long)profile->pc_counts[pc]);
+    }
+}
+
+void chip8_profile_write_hotspots(const Chip8Profile *profile, const uint8_t *memory, uint32_t count, FILE *file) {
+    const uint64_t total = total_instructions(profile);
+    const double scale = total ? 100.0 / total : 0.0;
+
+    fprintf(file, "%-8s %-8s %14s %7s\n", "address", "opcode", "count", "share");
+    std::vector<uint32_t> pcs = sorted_nonzero(profile->pc_counts, CHIP8_MEMORY_SIZE);
+    for (uint32_t i = 0; i < pcs.size() && i < count; ++i) {
+        const uint32_t pc = pcs[i];
+        fprintf(file, "%03x      %04x     %14llu %6.2f%%\n",
+                pc, opcode_at(memory, pc), (unsigned long long)profile->pc_counts[pc], profile->pc_counts[pc] * scale);
+    }
+
+    fprintf(file, "\n%-8s %-8s %14s %7s\n", "op", "", "count", "share");
+    std::vector<uint32_t> ops = sorted_nonzero(profile->op_counts, CHIP8_MAX_OPS);
+    for (uint32_t op : ops) {
+        if (op == OP_DECODE) continue;
+        fprintf(file, "%-17s %14llu %6.2f%%\n", chip8_op_name(op), (unsigned long long)profile->op_counts[op], profile->op_counts[op] * scale);
+    }
+
+    fprintf(file, "\ndecode cache misses: %llu\n", (unsigned long long)profile->op_counts[OP_DECODE]);
+    fprintf(file, "idle cycles skipped: %llu\n", (unsigned long long)profile->idle_cycles);
+    const uint64_t draws = profile->op_counts[find_op("DRW")];
+    fprintf(file, "time in Dxyn:        %.3f ms (%.1f ns per draw)\n",
+            profile->draw_ns / 1e6, draws ? (double)profile->draw_ns / draws : 0.0);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdio.h>
+
+// Execution counters filled in by chip8_machine_run when the core is built with
+// CHIP8_PROFILE and Chip8::profile points here. Without CHIP8_PROFILE nothing is
+// counted and the run loop carries no instrumentation at all.
+struct Chip8Profile {
+    uint64_t op_counts[CHIP8_MAX_OPS]; // by decoded handler id, see chip8_op_name
+    uint64_t pc_counts[CHIP8_MEMORY_SIZE]; // instructions executed at each address
+    uint64_t draw_ns; // wall time spent inside Dxyn
+    uint64_t idle_cycles; // cycles skipped by idle detection or a fault, in no op count
+};
+
+void chip8_profile_reset(Chip8Profile *profile);
+// Adds src into dst, e.g. to combine the profiles of a batch of machines.
+void chip8_profile_add(Chip8Profile *dst, const Chip8Profile *src);
+
+// Reports. `memory` is the machine's M, used to show the opcode found at each address.
+// JSON has every nonzero counter; CSV has one "kind,key,opcode,count" line per counter.
+void chip8_profile_write_json(const Chip8Profile *profile, const uint8_t *memory, FILE *file);
+void chip8_profile_write_csv(const Chip8Profile *profile, const uint8_t *memory, FILE *file);
+// Human-readable list of the `count` busiest addresses and the instruction mix.
+void chip8_profile_write_hotspots(const Chip8Profile *profile, const uint8_t *memory, uint32_t count, FILE *file);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+// Quirk policies, one per Chip8Quirks value. Interpreters take them as a
+// template argument, so every profile compiles to its own loop with the
+// choices folded away instead of tested per instruction.
+
+enum { STORE_I_KEEP, STORE_I_PLUS_X, STORE_I_PLUS_X_PLUS_1 };
+
+// What this emulator always did: 8xy4 leaves VF alone without carry,
+// 8xy5/8xy7 flag with > instead of >=, 8xyE flags with 0x80, flags are written
+// before the result, sprites starting off screen are not drawn, no Bnnn.
+struct QuirksLegacy {
+    static const bool legacy_flags = true; // the flag behavior above
+    static const bool shift_vy = false; // 8xy6/8xyE shift Vy into Vx
+    static const bool vf_reset = false; // 8xy1/8xy2/8xy3 clear VF
+    static const uint8_t store_i = STORE_I_KEEP; // how Fx55/Fx65 leave I
+    static const bool wrap_start = false; // Dxyn wraps the start position onto the screen
+    static const bool has_jump = false; // Bnnn exists
+    static const bool jump_vx = false; // Bxnn jumps to xnn + Vx rather than nnn + V0
+};
+
+struct QuirksVip {
+    static const bool legacy_flags = false;
+    static const bool shift_vy = true;
+    static const bool vf_reset = true;
+    static const uint8_t store_i = STORE_I_PLUS_X_PLUS_1;
+    static const bool wrap_start = true;
+    static const bool has_jump = true;
+    static const bool jump_vx = false;
+};
+
+struct QuirksChip48 {
+    static const bool legacy_flags = false;
+    static const bool shift_vy = false;
+    static const bool vf_reset = false;
+    static const uint8_t store_i = STORE_I_PLUS_X;
+    static const bool wrap_start = true;
+    static const bool has_jump = true;
+    static const bool jump_vx = true;
+};
+
+struct QuirksSchip {
+    static const bool legacy_flags = false;
+    static const bool shift_vy = false;
+    static const bool vf_reset = false;
+    static const uint8_t store_i = STORE_I_KEEP;
+    static const bool wrap_start = true;
+    static const bool has_jump = true;
+    static const bool jump_vx = true;
+};
@@ -0,0 +1,57 @@
+#include "chip8_state.h"
+
+#include <memory.h>
+
+void chip8_save_state(const Chip8 *c8, Chip8State *state) {
+    state->magic = CHIP8_STATE_MAGIC;
+    state->version = CHIP8_STATE_VERSION;
+    state->reserved = 0;
+    memcpy(state->M, c8->M, sizeof(state->M));
+    memcpy(state->screen, c8->screen, sizeof(state->screen));
+    memcpy(state->stack, c8->stack, sizeof(state->stack));
+    state->PC = c8->PC;
+    state->I = c8->I;
+    memcpy(state->V, c8->V, sizeof(state->V));
+    state->delay_timer = c8->delay_timer;
+    state->sound_timer = c8->sound_timer;
+    state->SP = c8->SP;
+    state->quirks = c8->quirks;
+    state->cycle_counter = c8->cycle_counter;
+    state->cycles_per_timer = c8->cycles_per_timer;
+    state->rng_state = c8->rng_state;
+    state->dirty_rows = c8->dirty_rows;
+    state->cycles = c8->cycles;
+}
+
+bool chip8_load_state(Chip8 *c8, const Chip8State *state) {
+    if (state->magic != CHIP8_STATE_MAGIC || state->version != CHIP8_STATE_VERSION) return false;
+    if (state->quirks >= CHIP8_NUM_QUIRKS) return false;
+    // Nothing the interpreter can reach, and it does not check for them.
+    if (state->PC > CHIP8_MAX_PC || state->SP > CHIP8_STACK_SIZE) return false;
+    for (uint32_t i = 0; i < state->SP; ++i) {
+        if (state->stack[i] > CHIP8_MAX_PC) return false;
+    }
+    if (state->cycles_per_timer == 0 || state->cycle_counter == 0 || state->cycle_counter > state->cycles_per_timer) return false;
+
+    chip8_machine_write_memory(c8, 0, state->M, sizeof(state->M));
+    // Whatever was presented last no longer matches the restored screen.
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        if (c8->screen[row] != state->screen[row]) c8->dirty_rows |= 1u << row;
+    }
+    memcpy(c8->screen, state->screen, sizeof(c8->screen));
+    memcpy(c8->stack, state->stack, sizeof(c8->stack));
+    c8->PC = state->PC;
+    c8->I = state->I;
+    memcpy(c8->V, state->V, sizeof(c8->V));
+    c8->delay_timer = state->delay_timer;
+    c8->sound_timer = state->sound_timer;
+    c8->SP = state->SP;
+    c8->quirks = state->quirks;
+    c8->cycle_counter = state->cycle_counter;
+    c8->cycles_per_timer = state->cycles_per_timer;
+    c8->rng_state = state->rng_state;
+    c8->dirty_rows |= state->dirty_rows;
+    c8->cycles = state->cycles;
+    c8->fault = CHIP8_FAULT_NONE;
+    return true;
+}
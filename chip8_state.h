@@ -0,0 +1,35 @@
+#pragma once
+
+#include "chip8.h"
+
+#define CHIP8_STATE_MAGIC 0x54533843u // "C8ST"
+#define CHIP8_STATE_VERSION 2
+
+// Snapshot of everything observable about a machine. The struct is its own
+// binary format: fixed size, no pointers, host byte order. The decode cache is
+// not part of it; it is rebuilt lazily after a load.
+struct Chip8State {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint8_t M[CHIP8_MEMORY_SIZE];
+    uint64_t screen[CHIP8_SCR_H];
+    uint16_t stack[CHIP8_STACK_SIZE];
+    uint16_t PC;
+    uint16_t I;
+    uint8_t V[CHIP8_NUM_REGISTERS];
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t SP;
+    uint8_t quirks; // Chip8Quirks, was always 0 = legacy before it existed
+    uint32_t cycle_counter;
+    uint32_t cycles_per_timer;
+    uint32_t rng_state;
+    uint32_t dirty_rows;
+    uint64_t cycles; // since version 2
+};
+
+void chip8_save_state(const Chip8 *c8, Chip8State *state);
+// Returns false, leaving the machine untouched, if the snapshot has the wrong
+// magic or version or holds a state the machine cannot be in. Clears any fault.
+bool chip8_load_state(Chip8 *c8, const Chip8State *state);
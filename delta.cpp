@@ -0,0 +1,87 @@
+#include "delta.h"
+
+#include <memory.h>
+
+// Equal bytes shorter than this inside a changed span are cheaper to keep in
+// the literal than to end the record for.
+#define MIN_SKIP 4
+#define MAX_VARINT_BYTES 5
+
+static uint8_t *write_varint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static bool read_varint(const uint8_t *in, uint32_t in_size, uint32_t *pos, uint32_t *value) {
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift < 7 * MAX_VARINT_BYTES; shift += 7) {
+        if (*pos >= in_size) return false;
+        uint8_t byte = in[(*pos)++];
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t delta_max_encoded_size(uint32_t size) {
+    return size + (size / MIN_SKIP + 1) * 2 * MAX_VARINT_BYTES;
+}
+
+template <bool HAS_REF>
+static uint32_t encode(const uint8_t *cur, const uint8_t *ref, uint32_t size, uint8_t *out) {
+    static const uint8_t zero_word[8] = {};
+    uint8_t *o = out;
+    uint32_t pos = 0;
+    while (pos < size) {
+        // Skip unchanged bytes, a word at a time while possible.
+        uint32_t skip_start = pos;
+        while (pos + 8 <= size && memcmp(cur + pos, HAS_REF ? ref + pos : zero_word, 8) == 0) pos += 8;
+        while (pos < size && cur[pos] == (HAS_REF ? ref[pos] : 0)) pos++;
+        if (pos == size) break;
+
+        // Extend the changed span until MIN_SKIP equal bytes in a row.
+        uint32_t literal_start = pos;
+        uint32_t literal_end = pos;
+        while (pos < size) {
+            if (cur[pos] != (HAS_REF ? ref[pos] : 0)) literal_end = pos + 1;
+            else if (pos + 1 - literal_end >= MIN_SKIP) break;
+            pos++;
+        }
+        pos = literal_end;
+
+        o = write_varint(o, literal_start - skip_start);
+        o = write_varint(o, literal_end - literal_start);
+        for (uint32_t i = literal_start; i < literal_end; ++i) *o++ = cur[i] ^ (HAS_REF ? ref[i] : 0);
+    }
+    return (uint32_t)(o - out);
+}
+
+uint32_t delta_encode(const uint8_t *cur, const uint8_t *ref, uint32_t size, uint8_t *out) {
+    return ref ? encode<true>(cur, ref, size, out) : encode<false>(cur, ref, size, out);
+}
+
+bool delta_decode(const uint8_t *in, uint32_t in_size, const uint8_t *ref, uint8_t *out, uint32_t size) {
+    if (!ref) memset(out, 0, size);
+    else if (ref != out) memcpy(out, ref, size);
+
+    uint32_t in_pos = 0;
+    uint32_t out_pos = 0;
+    while (in_pos < in_size) {
+        uint32_t skip, count;
+        if (!read_varint(in, in_size, &in_pos, &skip)) return false;
+        if (!read_varint(in, in_size, &in_pos, &count)) return false;
+        if (skip > size - out_pos || count > size - out_pos - skip || count > in_size - in_pos) return false;
+        out_pos += skip;
+        for (uint32_t i = 0; i < count; ++i) out[out_pos + i] ^= in[in_pos + i];
+        out_pos += count;
+        in_pos += count;
+    }
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// XOR + run-length delta coding of a fixed-size buffer against a reference.
+// The stream is a sequence of records: varint count of unchanged bytes to skip,
+// varint count of changed bytes, then that many bytes of (current XOR reference).
+// A NULL reference stands for all zeros, which turns the codec into a plain
+// zero-run compressor for keyframes.
+
+// Upper bound on the encoded size of a `size`-byte buffer.
+uint32_t delta_max_encoded_size(uint32_t size);
+
+// Returns the number of bytes written to out, which must hold delta_max_encoded_size(size).
+uint32_t delta_encode(const uint8_t *cur, const uint8_t *ref, uint32_t size, uint8_t *out);
+
+// Rebuilds the buffer into out. out may equal ref to apply a delta in place.
+// Returns false if the stream is malformed or does not fit in size bytes.
+bool delta_decode(const uint8_t *in, uint32_t in_size, const uint8_t *ref, uint8_t *out, uint32_t size);
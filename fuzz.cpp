@@ -0,0 +1,394 @@
+// chip8_fuzz: feeds arbitrary programs and key input to the interpreter and
+// checks that it stays inside the machine. Built with -DCHIP8_FUZZ=ON (Clang)
+// it is a libFuzzer target; otherwise it runs inputs from files, or mutations
+// of them, which is enough to reproduce a crash or measure throughput.
+//
+// Input: quirk profile byte, frame count byte, a 16-bit key mask per frame
+// (little endian), then the program. Missing bytes read as zero and program
+// bytes past CHIP8_MAX_PROGRAM_SIZE are ignored.
+
+#include "chip8.h"
+#include "chip8_jit.h"
+#include "chip8_lanes.h"
+#include "chip8_state.h"
+#include "rom.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+#define PROGRAM_OFFSET CHIP8_PROGRAM_OFFSET
+#define MAX_FRAMES 16
+#define HEADER_SIZE (2 + 2 * MAX_FRAMES)
+// Lanes compared against the interpreter: the first half hold the input's
+// keys, the rest the opposite ones, so lanes both agree and diverge.
+#define FUZZ_LANES 4
+// Everything in Chip8 between memory and the decode cache.
+#define CORE_BEGIN offsetof(Chip8, PC)
+#define CORE_END offsetof(Chip8, decoded)
+
+// A machine that is reset in place between inputs rather than initialized:
+// only memory the previous input can have changed is written back, so the
+// decode cache of whatever code two inputs share survives.
+struct Instance {
+    Chip8 machine;
+    uint32_t program_size; // of the program loaded by the last reset
+    uint32_t reset_writes; // machine.memory_writes right after it
+};
+
+struct Fuzzer {
+    Chip8 start; // chip8_machine_init'd without a program
+    Instance interpreter;
+    Instance jit_instance;
+    Chip8Jit *jit; // NULL = don't compare against the JIT
+    Instance inverted; // the interpreter with the opposite keys, for the second half of the lanes
+    Chip8Lanes *lanes; // NULL = don't compare against lanes
+};
+
+static Fuzzer *fuzzer;
+
+static void fail(const Chip8 *c8, const char *what) {
+    fprintf(stderr, "chip8_fuzz: %s (PC %03X SP %u I %03X fault %s at %03X)\n", what, c8->PC, c8->SP, c8->I,
+            chip8_fault_name(c8->fault), c8->fault_pc);
+    abort();
+}
+
+// Whether another way of running the program ended up exactly where the interpreter did.
+static bool same_machine(const Chip8 *a, const Chip8 *b) {
+    Chip8State state_a, state_b;
+    chip8_save_state(a, &state_a);
+    chip8_save_state(b, &state_b);
+    return memcmp(&state_a, &state_b, sizeof(state_a)) == 0 && a->fault == b->fault && a->fault_pc == b->fault_pc &&
+           a->key_reads == b->key_reads;
+}
+
+static void check(const Chip8 *c8, uint64_t cycles) {
+    if (c8->PC > CHIP8_MAX_PC) fail(c8, "PC past CHIP8_MAX_PC");
+    if (c8->SP > CHIP8_STACK_SIZE) fail(c8, "stack pointer past the stack");
+    if (c8->fault >= CHIP8_NUM_FAULTS) fail(c8, "unknown fault");
+    if (c8->fault && c8->PC != c8->fault_pc) fail(c8, "faulted machine moved on");
+    if (c8->cycles != cycles) fail(c8, "cycles lost");
+    if (c8->cycle_counter == 0 || c8->cycle_counter > c8->cycles_per_timer) fail(c8, "timer counter out of range");
+}
+
+static void reset(Instance *instance, const uint8_t *program, uint32_t size, uint32_t quirks) {
+    Chip8 *c8 = &instance->machine;
+    const Chip8 *start = &fuzzer->start;
+    const uint32_t end = PROGRAM_OFFSET + size;
+    if (c8->memory_writes != instance->reset_writes) {
+        // The program stored something, anywhere.
+        chip8_machine_write_memory(c8, 0, start->M, PROGRAM_OFFSET);
+        chip8_machine_write_memory(c8, end, start->M + end, MEMORY_SIZE - end);
+    }
+    else if (instance->program_size > size) {
+        chip8_machine_write_memory(c8, end, start->M + end, instance->program_size - size);
+    }
+    chip8_machine_write_memory(c8, PROGRAM_OFFSET, program, size);
+
+    // memory_writes only ever goes up, or the JIT would miss the new program.
+    const uint32_t writes = c8->memory_writes;
+    memcpy((uint8_t *)c8 + CORE_BEGIN, (const uint8_t *)start + CORE_BEGIN, CORE_END - CORE_BEGIN);
+    c8->memory_writes = writes;
+    c8->quirks = (uint8_t)quirks;
+    instance->program_size = size;
+    instance->reset_writes = writes;
+}
+
+static void fuzz_init(bool compare_jit, bool compare_lanes) {
+    fuzzer = new Fuzzer();
+    const uint8_t no_program = 0;
+    chip8_machine_init(&fuzzer->start, &no_program, 0);
+    Instance *instances[3] = { &fuzzer->interpreter, &fuzzer->jit_instance, &fuzzer->inverted };
+    for (Instance *instance : instances) {
+        instance->machine = fuzzer->start;
+        instance->program_size = 0;
+        instance->reset_writes = fuzzer->start.memory_writes;
+    }
+    fuzzer->jit = compare_jit ? chip8_jit_create() : NULL;
+    fuzzer->lanes = NULL;
+    if (compare_lanes) {
+        fuzzer->lanes = new Chip8Lanes;
+        chip8_lanes_init(fuzzer->lanes, &no_program, 0, FUZZ_LANES);
+    }
+}
+
+static void fuzz_one(const uint8_t *data, size_t size) {
+    uint8_t header[HEADER_SIZE] = {};
+    memcpy(header, data, size < HEADER_SIZE ? size : HEADER_SIZE);
+    const uint32_t quirks = header[0] % CHIP8_NUM_QUIRKS;
+    const uint32_t frames = 1 + header[1] % MAX_FRAMES;
+    const uint8_t *program = size > HEADER_SIZE ? data + HEADER_SIZE : header;
+    uint32_t program_size = size > HEADER_SIZE ? (uint32_t)(size - HEADER_SIZE) : 0;
+    if (program_size > CHIP8_MAX_PROGRAM_SIZE) program_size = CHIP8_MAX_PROGRAM_SIZE;
+
+    Chip8 *c8 = &fuzzer->interpreter.machine;
+    Chip8 *jit_c8 = &fuzzer->jit_instance.machine;
+    reset(&fuzzer->interpreter, program, program_size, quirks);
+    if (fuzzer->jit) reset(&fuzzer->jit_instance, program, program_size, quirks);
+    Chip8 *inverted_c8 = &fuzzer->inverted.machine;
+    if (fuzzer->lanes) {
+        reset(&fuzzer->inverted, program, program_size, quirks);
+        // Lane machines may be replaced between runs.
+        for (uint32_t l = 0; l < FUZZ_LANES; ++l) fuzzer->lanes->machines[l] = l < FUZZ_LANES / 2 ? *c8 : *inverted_c8;
+    }
+
+    uint64_t cycles = 0;
+    for (uint32_t frame = 0; frame < frames; ++frame) {
+        const uint32_t mask = header[2 + 2 * frame] | header[3 + 2 * frame] << 8;
+        bool keys[CHIP8_NUM_KEYS];
+        for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) keys[key] = (mask >> key) & 1;
+        // Ends on the frame boundary, so both machines tick at the same points.
+        const uint32_t run = c8->cycle_counter;
+        chip8_machine_run(c8, run, keys);
+        cycles += run;
+        check(c8, cycles);
+        if (fuzzer->jit) {
+            chip8_jit_run(fuzzer->jit, jit_c8, run, keys);
+            if (!same_machine(c8, jit_c8)) fail(jit_c8, "JIT and interpreter disagree");
+        }
+        if (fuzzer->lanes) {
+            bool lane_keys[FUZZ_LANES][CHIP8_NUM_KEYS];
+            for (uint32_t l = 0; l < FUZZ_LANES; ++l) {
+                for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) lane_keys[l][key] = keys[key] == (l < FUZZ_LANES / 2);
+            }
+            chip8_machine_run(inverted_c8, run, lane_keys[FUZZ_LANES - 1]);
+            chip8_lanes_run(fuzzer->lanes, run, lane_keys);
+            for (uint32_t l = 0; l < FUZZ_LANES; ++l) {
+                if (!same_machine(l < FUZZ_LANES / 2 ? c8 : inverted_c8, &fuzzer->lanes->machines[l])) {
+                    fail(&fuzzer->lanes->machines[l], "lanes and interpreter disagree");
+                }
+            }
+        }
+    }
+}
+
+#if CHIP8_LIBFUZZER
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void)argc;
+    (void)argv;
+    fuzz_init(getenv("CHIP8_FUZZ_JIT") != NULL, getenv("CHIP8_FUZZ_LANES") != NULL);
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+
+#else
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_fuzz [options] [FILE|DIR]...\n"
+        "Runs every input once (files in DIR too), or with --random mutations of them.\n"
+        "  --random N     run N inputs made by changing a few bytes or instructions of\n"
+        "                 a given one, or of generated ones if none is given, and\n"
+        "                 report executions per second\n"
+        "  --seed N       seed for --random and --write-corpus (default 1)\n"
+        "  --jit          also run every input on the JIT and compare the machines\n"
+        "  --lanes        also run every input on lanes with the input's keys and the\n"
+        "                 opposite ones, and compare each lane with the interpreter\n"
+        "  --write-corpus DIR\n"
+        "                 write the generated inputs to DIR and exit\n");
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> *content) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    content->resize(size > 0 ? size : 0);
+    bool ok = fread(content->data(), 1, content->size(), file) == content->size();
+    fclose(file);
+    return ok;
+}
+
+static void add_path(const char *path, void *user) {
+    ((std::vector<std::string> *)user)->push_back(path);
+}
+
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Every opcode each quirk profile has, by its top nibble, taken from the
+// decoder through chip8_op_exists.
+struct Opcodes {
+    std::vector<uint16_t> by_family[CHIP8_NUM_QUIRKS][16];
+
+    Opcodes() {
+        for (uint32_t quirks = 0; quirks < CHIP8_NUM_QUIRKS; ++quirks) {
+            for (uint32_t op = 0; op <= 0xFFFF; ++op) {
+                if (chip8_op_exists((uint8_t)(op >> 8), (uint8_t)op, quirks)) by_family[quirks][op >> 12].push_back((uint16_t)op);
+            }
+        }
+    }
+};
+
+// An instruction the profile has, every family equally likely so that the
+// few Fx and Ex opcodes come up as often as arithmetic. Jumps and calls go to
+// an instruction of the program, which keeps runs in it rather than in zeroed
+// memory, where they would fault at once.
+static uint16_t random_instruction(uint32_t *state, uint32_t quirks, uint32_t program_size) {
+    static const Opcodes opcodes;
+    for (;;) {
+        const std::vector<uint16_t> &family = opcodes.by_family[quirks][next_random(state) % 16];
+        if (family.empty()) continue;
+        uint16_t op = family[next_random(state) % family.size()];
+        const uint32_t top = op >> 12;
+        if ((top == 0x1 || top == 0x2 || top == 0xB) && program_size >= 2) {
+            op = (uint16_t)(top << 12 | (PROGRAM_OFFSET + 2 * (next_random(state) % (program_size / 2))));
+        }
+        return op;
+    }
+}
+
+#define GENERATED_INPUTS 64
+#define MAX_GENERATED_INSTRUCTIONS 64
+
+// Inputs for --random when none is given: random header, then a program of
+// random instructions for the header's profile.
+static std::vector<std::vector<uint8_t>> generate_inputs(uint32_t seed) {
+    uint32_t state = seed ? seed : 1;
+    std::vector<std::vector<uint8_t>> inputs(GENERATED_INPUTS);
+    for (std::vector<uint8_t> &input : inputs) {
+        input.resize(HEADER_SIZE);
+        for (uint8_t &byte : input) byte = (uint8_t)next_random(&state);
+        const uint32_t quirks = input[0] % CHIP8_NUM_QUIRKS;
+        const uint32_t size = 2 * (1 + next_random(&state) % MAX_GENERATED_INSTRUCTIONS);
+        for (uint32_t i = 0; i < size; i += 2) {
+            const uint16_t op = random_instruction(&state, quirks, size);
+            input.push_back((uint8_t)(op >> 8));
+            input.push_back((uint8_t)op);
+        }
+    }
+    return inputs;
+}
+
+static bool write_corpus(const char *dir, const std::vector<std::vector<uint8_t>> &inputs) {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/generated-%02u.bin", dir, (unsigned)i);
+        FILE *file = fopen(path, "wb");
+        if (!file) return false;
+        const bool ok = fwrite(inputs[i].data(), 1, inputs[i].size(), file) == inputs[i].size();
+        if (fclose(file) != 0 || !ok) return false;
+    }
+    return true;
+}
+
+// Changes 1 to 4 bytes, or whole instructions of the program.
+static void mutate(std::vector<uint8_t> *input, uint32_t *state) {
+    if (input->empty()) input->push_back(0);
+    const uint32_t program_size = input->size() > HEADER_SIZE + 1 ? (uint32_t)(input->size() - HEADER_SIZE) & ~1u : 0;
+    const uint32_t quirks = (*input)[0] % CHIP8_NUM_QUIRKS;
+    const uint32_t changes = 1 + next_random(state) % 4;
+    for (uint32_t i = 0; i < changes; ++i) {
+        if (program_size && (next_random(state) & 1)) {
+            const uint32_t at = HEADER_SIZE + 2 * (next_random(state) % (program_size / 2));
+            const uint16_t op = random_instruction(state, quirks, program_size);
+            (*input)[at] = (uint8_t)(op >> 8);
+            (*input)[at + 1] = (uint8_t)op;
+        }
+        else {
+            (*input)[next_random(state) % input->size()] = (uint8_t)next_random(state);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t random_runs = 0;
+    uint32_t seed = 1;
+    bool compare_jit = false;
+    bool compare_lanes = false;
+    const char *corpus_dir = NULL;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--random") == 0 && has_value) random_runs = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--seed") == 0 && has_value) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--jit") == 0) compare_jit = true;
+        else if (strcmp(arg, "--lanes") == 0) compare_lanes = true;
+        else if (strcmp(arg, "--write-corpus") == 0 && has_value) corpus_dir = argv[++i];
+        else if (arg[0] != '-') {
+            if (!rom_list_dir(arg, NULL, add_path, &paths)) paths.push_back(arg);
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (corpus_dir) {
+        if (!write_corpus(corpus_dir, generate_inputs(seed))) {
+            fprintf(stderr, "Unable to write the corpus to %s\n", corpus_dir);
+            return 1;
+        }
+        return 0;
+    }
+    if (paths.empty() && random_runs == 0) {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t>> inputs(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (!read_file(paths[i].c_str(), &inputs[i])) {
+            fprintf(stderr, "Unable to read %s\n", paths[i].c_str());
+            return 1;
+        }
+    }
+    fuzz_init(compare_jit, compare_lanes);
+
+    if (random_runs == 0) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            fuzz_one(inputs[i].data(), inputs[i].size());
+            printf("%s: %s\n", paths[i].c_str(), fuzzer->interpreter.machine.fault ? chip8_fault_name(fuzzer->interpreter.machine.fault) : "ok");
+        }
+        return 0;
+    }
+
+    if (inputs.empty()) inputs = generate_inputs(seed);
+    uint32_t state = seed ? seed : 1;
+    uint64_t faults[CHIP8_NUM_FAULTS] = {};
+    std::vector<uint8_t> input;
+    const auto start_time = std::chrono::steady_clock::now();
+    for (uint64_t run = 0; run < random_runs; ++run) {
+        const std::vector<uint8_t> &seed_input = inputs[next_random(&state) % inputs.size()];
+        input.assign(seed_input.begin(), seed_input.end());
+        mutate(&input, &state);
+        fuzz_one(input.data(), input.size());
+        faults[fuzzer->interpreter.machine.fault]++;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    printf("executions:       %llu\n", (unsigned long long)random_runs);
+    printf("seconds:          %.6f\n", seconds);
+    printf("executions/sec:   %.0f\n", seconds > 0 ? random_runs / seconds : 0.0);
+    for (uint32_t fault = 0; fault < CHIP8_NUM_FAULTS; ++fault) {
+        printf("%-17s %llu\n", (std::string(chip8_fault_name(fault)) + ":").c_str(), (unsigned long long)faults[fault]);
+    }
+    if (fuzzer->lanes) {
+        const uint64_t lane_cycles = fuzzer->lanes->lockstep_cycles + fuzzer->lanes->divergent_cycles;
+        printf("lanes lockstep:   %.1f%% of cycles\n", lane_cycles ? 100.0 * fuzzer->lanes->lockstep_cycles / lane_cycles : 0.0);
+    }
+    if (fuzzer->jit) chip8_jit_destroy(fuzzer->jit);
+    delete fuzzer->lanes;
+    delete fuzzer;
+    return 0;
+}
+
+#endif
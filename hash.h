@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HASH_FNV_OFFSET 0xcbf29ce484222325ull
+#define HASH_FNV_PRIME 0x100000001b3ull
+
+// 64-bit FNV-1a. Pass a previous result as `hash` to extend it over more data.
+inline uint64_t hash_fnv1a(const void *data, size_t size, uint64_t hash = HASH_FNV_OFFSET) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= HASH_FNV_PRIME;
+    }
+    return hash;
+}
+
+// Fast 64-bit hash of a buffer whose size is a multiple of 8, for hashing
+// whole machine states: four independent multiply-rotate lanes over 32-byte
+// blocks, folded together at the end. Not FNV-compatible; use it only for
+// in-memory lookups, never for hashes that are stored or compared across runs.
+inline uint64_t hash_words(const void *data, size_t size, uint64_t seed = 0) {
+    const uint64_t k0 = 0x9E3779B97F4A7C15ull;
+    const uint64_t k1 = 0xC2B2AE3D27D4EB4Full;
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t lane[4] = { seed ^ k0, seed ^ k1, seed + k0, seed - k1 };
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        for (uint32_t i = 0; i < 4; ++i) {
+            uint64_t word;
+            memcpy(&word, bytes + pos + i * 8, 8);
+            lane[i] = (lane[i] ^ word) * k1;
+            lane[i] = (lane[i] << 31) | (lane[i] >> 33);
+        }
+    }
+    for (; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + pos, 8);
+        lane[0] = (lane[0] ^ word) * k1;
+        lane[0] = (lane[0] << 31) | (lane[0] >> 33);
+    }
+    uint64_t hash = size * k0;
+    for (uint32_t i = 0; i < 4; ++i) hash = (hash ^ lane[i] * k0) * k1 + (hash >> 29);
+    hash ^= hash >> 32;
+    hash *= k0;
+    return hash ^ (hash >> 29);
+}
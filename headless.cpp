@@ -0,0 +1,517 @@
+#include "chip8.h"
+#include "chip8_aot.h"
+#include "chip8_batch.h"
+#include "chip8_jit.h"
+#include "chip8_profile.h"
+#include "thread_pool.h"
+#include "input_log.h"
+#include "render.h"
+#include "rom.h"
+#include "run_ahead.h"
+#include "scheduler.h"
+#include "session.h"
+#include "sound.h"
+#include "trace.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CYCLES 10000000ull
+#define WAV_SAMPLE_RATE 44100
+
+// Machines plus the logged input they are driven by.
+struct Runner {
+    std::vector<Chip8> machines;
+    std::vector<Chip8Lanes> lanes; // runs the machines CHIP8_LANES at a time in lockstep instead, empty = off
+    bool (*keys)[CHIP8_NUM_KEYS];
+    ThreadPool *pool;
+    Chip8Jit *jit; // runs the only machine instead of the interpreter, NULL = interpret
+    Chip8Aot *aot; // likewise, with a translation linked in ahead of time
+    Sound *sound; // gets the first machine's beeper edges, NULL = no audio
+    bool beeper;
+    Render *render; // gets the first machine's screen after every frame that changed it, NULL = none
+    SessionWriter *session; // records the first machine every frame, NULL = none
+    Chip8RunAhead *run_ahead; // shows render the first machine's future instead, NULL = off
+    uint64_t presented[CHIP8_SCR_H]; // last screen submitted from run_ahead
+    bool has_presented;
+    std::vector<InputEvent> events;
+    size_t next_event;
+    uint64_t done;
+};
+
+// Runs every machine up to cycle `target`, splitting the run wherever the key state changes.
+static void run_to(Runner *r, uint64_t target) {
+    const uint32_t num_instances = (uint32_t)r->machines.size();
+    // With lanes the machines are brought up to date when the run is over.
+    Chip8 *first = r->lanes.empty() ? &r->machines[0] : &r->lanes[0].machines[0];
+    while (r->done < target) {
+        while (r->next_event < r->events.size() && r->events[r->next_event].cycle <= r->done) {
+            const uint16_t mask = r->events[r->next_event].key_mask;
+            for (uint32_t i = 0; i < num_instances; ++i) input_mask_to_keys(mask, r->keys[i]);
+            // A replayed key is read as soon as it is pressed.
+            trace_instant(TRACE_KEY, mask);
+            trace_instant(TRACE_INPUT, mask);
+            r->next_event++;
+        }
+
+        uint64_t run = target - r->done;
+        if (r->next_event < r->events.size() && r->events[r->next_event].cycle - r->done < run) {
+            run = r->events[r->next_event].cycle - r->done;
+        }
+        if (run > 0xFFFFFFFFu) run = 0xFFFFFFFFu;
+        // Audio and frames are taken at frame boundaries. The sound timer only
+        // changes on Fx18 and ticks, so that is fine enough for the beeper too.
+        if ((r->sound || r->render || r->session || r->run_ahead) && run > first->cycle_counter) run = first->cycle_counter;
+
+        const uint64_t run_start = trace_begin();
+        if (!r->lanes.empty()) {
+            if (r->pool) chip8_batch_run_lanes(r->pool, r->lanes.data(), (uint32_t)r->lanes.size(), (uint32_t)run, r->keys);
+            else chip8_lanes_run(&r->lanes[0], (uint32_t)run, r->keys);
+        }
+        else if (r->pool) {
+            chip8_batch_run(r->pool, r->machines.data(), num_instances, (uint32_t)run, r->keys);
+        }
+        else if (r->jit) {
+            chip8_jit_run(r->jit, &r->machines[0], (uint32_t)run, r->keys[0]);
+        }
+        else if (r->aot) {
+            chip8_aot_run(r->aot, &r->machines[0], (uint32_t)run, r->keys[0]);
+        }
+        else {
+            chip8_machine_run(&r->machines[0], (uint32_t)run, r->keys[0]);
+        }
+        r->done += run;
+        trace_span(TRACE_RUN, run_start, first->cycles / first->cycles_per_timer);
+        if (r->sound && (first->sound_timer > 0) != r->beeper) {
+            r->beeper = !r->beeper;
+            sound_set_beeper(r->sound, first->cycles, r->beeper);
+        }
+        if (r->run_ahead && first->cycle_counter == first->cycles_per_timer) {
+            // The future screen can change without the real one changing, so compare rather than track dirty rows.
+            const Chip8 *ahead = chip8_run_ahead(r->run_ahead, first, r->keys[0]);
+            if (r->render && (!r->has_presented || memcmp(ahead->screen, r->presented, sizeof(r->presented)) != 0)) {
+                memcpy(r->presented, ahead->screen, sizeof(r->presented));
+                r->has_presented = true;
+                render_submit(r->render, ahead->screen, first->cycles / first->cycles_per_timer);
+                trace_instant(TRACE_SUBMIT, first->cycles / first->cycles_per_timer);
+            }
+        }
+        else if (r->render && first->cycle_counter == first->cycles_per_timer && chip8_machine_take_dirty_rows(first)) {
+            render_submit(r->render, first->screen, first->cycles / first->cycles_per_timer);
+            trace_instant(TRACE_SUBMIT, first->cycles / first->cycles_per_timer);
+        }
+        if (r->session && first->cycle_counter == first->cycles_per_timer) {
+            session_writer_add(r->session, first->screen, first->sound_timer);
+        }
+    }
+}
+
+struct RomDir {
+    RomCache *cache;
+    uint32_t quirks;
+    std::vector<const Rom *> roms;
+    std::vector<std::string> names; // of the files, which may share a Rom
+    uint32_t failed;
+};
+
+static void load_rom(const char *path, void *user) {
+    RomDir *dir = (RomDir *)user;
+    RomError error;
+    const Rom *rom = rom_cache_load(dir->cache, path, dir->quirks, &error);
+    if (rom) {
+        dir->roms.push_back(rom);
+        dir->names.push_back(rom_base_name(path));
+    }
+    else {
+        fprintf(stderr, "Skipping %s: %s\n", path, rom_error_string(error));
+        dir->failed++;
+    }
+}
+
+// --rom-dir: every program in the directory, one after the other, on the same pool.
+static int run_rom_dir(const char *path, uint32_t quirks, uint64_t cycles, uint32_t cycles_per_frame, uint32_t seed,
+                       uint32_t num_instances, uint32_t num_threads, const std::vector<InputEvent> &events) {
+    RomDir dir;
+    dir.cache = rom_cache_create();
+    dir.quirks = quirks;
+    dir.failed = 0;
+    auto load_start = std::chrono::steady_clock::now();
+    if (!rom_list_dir(path, ".ch8", load_rom, &dir)) {
+        fprintf(stderr, "Unable to list %s\n", path);
+        rom_cache_destroy(dir.cache);
+        return 1;
+    }
+    double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+    printf("loaded %u programs (%u distinct, %u skipped) in %.3f ms\n", (uint32_t)dir.roms.size(), rom_cache_size(dir.cache),
+           dir.failed, load_seconds * 1e3);
+    printf("%-24s %-16s %5s %5s %-6s %14s %-16s\n", "program", "hash", "size", "code", "quirks", "instructions/s", "screen hash");
+
+    Runner runner;
+    runner.machines.resize(num_instances);
+    runner.keys = new bool[num_instances][CHIP8_NUM_KEYS];
+    runner.pool = num_instances > 1 ? thread_pool_create(num_threads) : NULL;
+    runner.jit = NULL;
+    runner.aot = NULL;
+    runner.sound = NULL;
+    runner.render = NULL;
+    runner.session = NULL;
+    runner.run_ahead = NULL;
+    for (size_t i = 0; i < dir.roms.size(); ++i) {
+        const Rom *rom = dir.roms[i];
+        auto start_time = std::chrono::steady_clock::now();
+        for (Chip8 &c8 : runner.machines) {
+            rom_instance_init(rom, &c8);
+            chip8_machine_seed(&c8, seed);
+            c8.cycles_per_timer = cycles_per_frame;
+            c8.cycle_counter = cycles_per_frame;
+        }
+        memset(runner.keys, 0, sizeof(bool) * CHIP8_NUM_KEYS * num_instances);
+        runner.beeper = false;
+        runner.events = events;
+        runner.next_event = 0;
+        runner.done = 0;
+        run_to(&runner, cycles);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        double instructions = (double)cycles * num_instances;
+        printf("%-24s %016llx %5u %5u %-6s %14.0f %016llx\n", dir.names[i].c_str(), (unsigned long long)rom->hash, rom->size, rom->code_bytes,
+               rom->quirk_ops ? chip8_quirks_name(rom->quirks) : "any", seconds > 0 ? instructions / seconds : 0.0,
+               (unsigned long long)chip8_screen_hash(runner.machines[0].screen));
+    }
+    if (runner.pool) thread_pool_destroy(runner.pool);
+    delete[] runner.keys;
+    rom_cache_destroy(dir.cache);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_headless [options] path/to/program\n"
+        "       chip8_headless [options] --rom-dir DIR\n"
+        "  --cycles N     run N cycles (default %llu)\n"
+        "  --frames N     run N frames of --cycles-per-frame cycles\n"
+        "  --cycles-per-frame N\n"
+        "                 CPU speed in cycles per 60 Hz timer tick (default %d)\n"
+        "  --speed S      realtime, a frame multiplier N, or uncapped (default)\n"
+        "  --input FILE   replay an input log (see input_log.h), which may also set\n"
+        "                 the seed and --cycles-per-frame\n"
+        "  --seed N       PRNG seed, hex (default %08x)\n"
+        "  --quirks Q     legacy (default), vip, chip48 or schip\n"
+        "  --instances N  run N copies of the program side by side\n"
+        "  --threads N    worker threads for --instances (default: all cores)\n"
+        "  --lanes        run --instances in lockstep groups of %d (see chip8_lanes.h)\n"
+        "  --jit          translate the program to native code (x86-64 Linux, one instance)\n"
+        "  --aot          run the translation linked in with CHIP8_AOT_ROMS (one instance)\n"
+        "  --wav FILE     write the beeper of the (first) instance to a WAV file\n"
+        "  --dump-frames PREFIX\n"
+        "                 write every changed frame of the (first) instance to\n"
+        "                 PREFIX<frame>.ppm\n"
+        "  --frame-scale N\n"
+        "                 pixel size for --dump-frames (default 1)\n"
+        "  --session FILE record every frame of the (first) instance (see session.h)\n"
+        "  --run-ahead K  have --dump-frames show each frame K frames early, as predicted\n"
+        "                 with the keys held at the time, and report the extra work\n"
+        "  --trace FILE   record when keys, frames, presents and audio writes happen as\n"
+        "                 a Chrome trace (chrome://tracing, Perfetto) and print latency\n"
+        "                 and jitter percentiles; most telling with --speed realtime\n"
+        "  --rom-dir DIR  run every .ch8 program in DIR in turn and print a line for each;\n"
+        "                 takes the options above up to --threads\n"
+        "  --profile FILE write execution counts as JSON, or CSV if FILE ends in .csv,\n"
+        "                 and print the hot spots (needs a CHIP8_PROFILE build)\n",
+        DEFAULT_CYCLES, CHIP8_CYCLES_PER_TIMER, CHIP8_DEFAULT_SEED, CHIP8_LANES);
+}
+
+int main(int argc, char **argv) {
+    uint64_t cycles = DEFAULT_CYCLES;
+    uint64_t frames = 0;
+    uint32_t cycles_per_frame = 0;
+    uint32_t seed = 0;
+    uint32_t quirks = CHIP8_NUM_QUIRKS;
+    SchedulerMode mode = SCHEDULER_UNCAPPED;
+    uint32_t speed = 1;
+    const char *input_path = NULL;
+    const char *program_path = NULL;
+    uint32_t num_instances = 1;
+    uint32_t num_threads = 0;
+    const char *profile_path = NULL;
+    bool use_jit = false;
+    bool use_aot = false;
+    bool use_lanes = false;
+    const char *wav_path = NULL;
+    const char *frames_prefix = NULL;
+    uint32_t frame_scale = 1;
+    const char *session_path = NULL;
+    const char *rom_dir = NULL;
+    uint32_t run_ahead_frames = 0;
+    const char *trace_path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--cycles") == 0 && has_value) cycles = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--frames") == 0 && has_value) frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--cycles-per-frame") == 0 && has_value) cycles_per_frame = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--speed") == 0 && has_value) {
+            const char *value = argv[++i];
+            if (strcmp(value, "realtime") == 0) mode = SCHEDULER_REALTIME;
+            else if (strcmp(value, "uncapped") == 0) mode = SCHEDULER_UNCAPPED;
+            else {
+                mode = SCHEDULER_MULTIPLIER;
+                speed = strtoul(value, NULL, 10);
+            }
+        }
+        else if (strcmp(arg, "--input") == 0 && has_value) input_path = argv[++i];
+        else if (strcmp(arg, "--seed") == 0 && has_value) seed = strtoul(argv[++i], NULL, 16);
+        else if (strcmp(arg, "--quirks") == 0 && has_value) {
+            quirks = chip8_quirks_from_name(argv[++i]);
+            if (quirks == CHIP8_NUM_QUIRKS) {
+                usage();
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--instances") == 0 && has_value) num_instances = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--threads") == 0 && has_value) num_threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--profile") == 0 && has_value) profile_path = argv[++i];
+        else if (strcmp(arg, "--lanes") == 0) use_lanes = true;
+        else if (strcmp(arg, "--jit") == 0) use_jit = true;
+        else if (strcmp(arg, "--aot") == 0) use_aot = true;
+        else if (strcmp(arg, "--wav") == 0 && has_value) wav_path = argv[++i];
+        else if (strcmp(arg, "--dump-frames") == 0 && has_value) frames_prefix = argv[++i];
+        else if (strcmp(arg, "--frame-scale") == 0 && has_value) frame_scale = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--session") == 0 && has_value) session_path = argv[++i];
+        else if (strcmp(arg, "--rom-dir") == 0 && has_value) rom_dir = argv[++i];
+        else if (strcmp(arg, "--run-ahead") == 0 && has_value) run_ahead_frames = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--trace") == 0 && has_value) trace_path = argv[++i];
+        else if (arg[0] != '-' && !program_path) program_path = arg;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!program_path == !rom_dir || num_instances == 0 || frame_scale == 0 || ((use_jit || use_aot) && num_instances > 1) ||
+        (use_jit + use_aot + use_lanes > 1) || (use_lanes && profile_path)) {
+        usage();
+        return 1;
+    }
+    if (rom_dir && (use_jit || use_aot || use_lanes || wav_path || frames_prefix || session_path || profile_path || run_ahead_frames ||
+                    trace_path || mode != SCHEDULER_UNCAPPED)) {
+        usage();
+        return 1;
+    }
+
+#if !CHIP8_PROFILE
+    if (profile_path) {
+        fprintf(stderr, "--profile needs a build configured with -DCHIP8_PROFILE=ON\n");
+        return 1;
+    }
+#endif
+
+    InputLog input = {};
+    if (input_path && !input_log_read(input_path, &input)) {
+        fprintf(stderr, "Unable to read input log %s\n", input_path);
+        return 1;
+    }
+    // The command line wins over what the log says.
+    if (seed == 0) seed = input.seed;
+    if (cycles_per_frame == 0) cycles_per_frame = input.cycles_per_frame;
+    if (cycles_per_frame == 0) cycles_per_frame = CHIP8_CYCLES_PER_TIMER;
+    if (quirks == CHIP8_NUM_QUIRKS) quirks = input.quirks;
+    if (quirks == CHIP8_NUM_QUIRKS) quirks = CHIP8_QUIRKS_LEGACY;
+
+    if (frames > 0) cycles = frames * cycles_per_frame;
+    if (rom_dir) return run_rom_dir(rom_dir, quirks, cycles, cycles_per_frame, seed, num_instances, num_threads, input.events);
+
+    RomCache *rom_cache = rom_cache_create();
+    RomError rom_error;
+    const Rom *rom = rom_cache_load(rom_cache, program_path, quirks, &rom_error);
+    if (!rom) {
+        if (rom_error == ROM_TOO_LARGE) fprintf(stderr, "Program %s is larger than %u bytes\n", program_path, CHIP8_MAX_PROGRAM_SIZE);
+        else fprintf(stderr, "Unable to read program %s: %s\n", program_path, rom_error_string(rom_error));
+        return 1;
+    }
+
+    Runner runner;
+    runner.machines.resize(num_instances);
+    for (Chip8 &c8 : runner.machines) {
+        rom_instance_init(rom, &c8);
+        chip8_machine_seed(&c8, seed);
+        c8.cycles_per_timer = cycles_per_frame;
+        c8.cycle_counter = cycles_per_frame;
+    }
+    std::vector<Chip8Profile> profiles(profile_path ? num_instances : 0);
+    for (uint32_t i = 0; i < profiles.size(); ++i) {
+        chip8_profile_reset(&profiles[i]);
+        runner.machines[i].profile = &profiles[i];
+    }
+    if (use_lanes) {
+        runner.lanes.resize((num_instances + CHIP8_LANES - 1) / CHIP8_LANES);
+        for (uint32_t g = 0; g < runner.lanes.size(); ++g) {
+            const uint32_t left = num_instances - g * CHIP8_LANES;
+            const uint32_t num_lanes = left < CHIP8_LANES ? left : CHIP8_LANES;
+            chip8_lanes_init(&runner.lanes[g], rom->image.M + CHIP8_PROGRAM_OFFSET, rom->size, num_lanes);
+            for (uint32_t l = 0; l < num_lanes; ++l) runner.lanes[g].machines[l] = runner.machines[g * CHIP8_LANES + l];
+        }
+    }
+    runner.keys = new bool[num_instances][CHIP8_NUM_KEYS]();
+    runner.pool = num_instances > CHIP8_LANES || (!use_lanes && num_instances > 1) ? thread_pool_create(num_threads) : NULL;
+    runner.jit = use_jit ? chip8_jit_create() : NULL;
+    runner.aot = NULL;
+    if (use_aot) {
+        const Chip8AotProgram *translation = chip8_aot_find(rom->image.M + CHIP8_PROGRAM_OFFSET, rom->size, quirks);
+        if (translation) runner.aot = chip8_aot_create(translation);
+        else fprintf(stderr, "No ahead-of-time translation of %s for the %s quirks, interpreting\n", program_path, chip8_quirks_name(quirks));
+    }
+    // Before the render and synth threads start, so their first events are kept.
+    if (trace_path) trace_enable(true);
+    trace_thread_name("emulation");
+    runner.sound = NULL;
+    if (wav_path) {
+        SoundSink *sink = sound_wav_sink_create(wav_path, WAV_SAMPLE_RATE);
+        if (!sink) {
+            fprintf(stderr, "Unable to write %s\n", wav_path);
+            return 1;
+        }
+        runner.sound = sound_create(sink, CHIP8_TIMER_HZ * cycles_per_frame);
+    }
+    runner.beeper = false;
+    runner.render = frames_prefix ? render_create(render_ppm_sink_create(frames_prefix, frame_scale)) : NULL;
+    runner.run_ahead = run_ahead_frames > 0 ? chip8_run_ahead_create(run_ahead_frames) : NULL;
+    runner.has_presented = false;
+    runner.session = NULL;
+    if (session_path) {
+        runner.session = session_writer_create(session_path, cycles_per_frame, SESSION_DEFAULT_KEYFRAME_INTERVAL);
+        if (!runner.session) {
+            fprintf(stderr, "Unable to write %s\n", session_path);
+            return 1;
+        }
+    }
+    runner.events.swap(input.events);
+    runner.next_event = 0;
+    runner.done = 0;
+
+    auto start_time = std::chrono::steady_clock::now();
+    if (mode == SCHEDULER_UNCAPPED) {
+        run_to(&runner, cycles);
+    }
+    else {
+        Scheduler scheduler;
+        scheduler_init(&scheduler, mode, speed);
+        while (runner.done < cycles) {
+            uint64_t target = runner.done + (uint64_t)scheduler_frames_to_run(&scheduler) * cycles_per_frame;
+            run_to(&runner, target < cycles ? target : cycles);
+            const uint64_t wait_start = trace_begin();
+            scheduler_wait(&scheduler);
+            trace_span(TRACE_WAIT, wait_start, 0);
+        }
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    uint64_t lockstep_cycles = 0;
+    if (use_lanes) {
+        for (uint32_t i = 0; i < num_instances; ++i) runner.machines[i] = runner.lanes[i / CHIP8_LANES].machines[i % CHIP8_LANES];
+        for (const Chip8Lanes &group : runner.lanes) lockstep_cycles += group.lockstep_cycles * group.num_lanes;
+    }
+
+    if (runner.pool) thread_pool_destroy(runner.pool);
+    if (runner.render) render_destroy(runner.render);
+    if (runner.session && !session_writer_close(runner.session)) {
+        fprintf(stderr, "Unable to write %s\n", session_path);
+        return 1;
+    }
+    if (runner.sound) {
+        // Without edges the file would stop at the last one.
+        sound_set_beeper(runner.sound, runner.machines[0].cycles, runner.beeper);
+        sound_destroy(runner.sound);
+    }
+    Chip8JitStats jit_stats = {};
+    if (runner.jit) {
+        jit_stats = chip8_jit_stats(runner.jit);
+        chip8_jit_destroy(runner.jit);
+    }
+    Chip8AotStats aot_stats = {};
+    if (runner.aot) {
+        aot_stats = chip8_aot_stats(runner.aot);
+        chip8_aot_destroy(runner.aot);
+    }
+    delete[] runner.keys;
+    const std::vector<Chip8> &machines = runner.machines;
+
+    double seconds = std::chrono::duration<double>(end_time - start_time).count();
+    double instructions = (double)cycles * num_instances;
+
+    printf("program:          %s\n", program_path);
+    printf("instances:        %u\n", num_instances);
+    printf("cycles:           %llu\n", (unsigned long long)cycles);
+    printf("seconds:          %.6f\n", seconds);
+    printf("instructions/sec: %.0f\n", seconds > 0 ? instructions / seconds : 0.0);
+    printf("ns/instruction:   %.3f\n", instructions > 0 ? seconds * 1e9 / instructions : 0.0);
+    uint64_t idle_cycles = 0;
+    for (const Chip8 &c8 : machines) idle_cycles += c8.idle_cycles;
+    printf("idle cycles:      %llu\n", (unsigned long long)idle_cycles);
+    if (machines[0].fault) {
+        printf("fault:            %s at 0x%03X\n", chip8_fault_name(machines[0].fault), machines[0].fault_pc);
+    }
+    if (use_jit) {
+        printf("native cycles:    %llu\n", (unsigned long long)jit_stats.native_cycles);
+        printf("blocks:           %u translated, %u invalidated\n", jit_stats.blocks_compiled, jit_stats.blocks_invalidated);
+    }
+    if (use_aot) printf("native cycles:    %llu\n", (unsigned long long)aot_stats.native_cycles);
+    if (use_lanes) printf("lockstep cycles:  %llu (%.1f%%)\n", (unsigned long long)lockstep_cycles, instructions > 0 ? 100.0 * lockstep_cycles / instructions : 0.0);
+    if (runner.run_ahead) {
+        const Chip8RunAheadStats stats = chip8_run_ahead_stats(runner.run_ahead);
+        printf("run-ahead:        %u frames, %llu extra cycles (%.0f%% more), %llu of %llu copies full\n",
+               run_ahead_frames, (unsigned long long)stats.cycles, cycles > 0 ? 100.0 * stats.cycles / cycles : 0.0,
+               (unsigned long long)stats.full_copies, (unsigned long long)stats.calls);
+        printf("run-ahead time:   %.6f s (%.0f%% of the run)\n", stats.ns * 1e-9, seconds > 0 ? 100.0 * stats.ns * 1e-9 / seconds : 0.0);
+        chip8_run_ahead_destroy(runner.run_ahead);
+    }
+    printf("screen hash:      %016llx\n", (unsigned long long)chip8_screen_hash(machines[0].screen));
+    if (trace_path) {
+        if (!trace_write_json(trace_path)) {
+            fprintf(stderr, "Unable to write trace %s\n", trace_path);
+            return 1;
+        }
+        TraceSummary summary;
+        trace_summarize(&summary);
+        const struct {
+            const char *name;
+            const TracePercentiles *p;
+        } rows[] = {
+            { "key to input:    ", &summary.key_to_input },
+            { "key to submit:   ", &summary.key_to_submit },
+            { "key to present:  ", &summary.key_to_present },
+            { "frame interval:  ", &summary.frame_interval },
+            { "frame jitter:    ", &summary.frame_jitter },
+            { "tick interval:   ", &summary.tick_interval },
+            { "present:         ", &summary.present },
+            { "audio interval:  ", &summary.audio_interval },
+        };
+        for (const auto &row : rows) {
+            printf("%s p50 %.3f ms, p99 %.3f ms, max %.3f ms (%llu)\n", row.name, row.p->p50, row.p->p99, row.p->max,
+                   (unsigned long long)row.p->count);
+        }
+        printf("audio underruns:  %llu, %llu samples dropped\n", (unsigned long long)summary.audio_underruns,
+               (unsigned long long)summary.audio_dropped);
+        printf("trace events:     %llu, %llu lost\n", (unsigned long long)summary.events, (unsigned long long)summary.lost);
+    }
+
+    if (profile_path) {
+        for (uint32_t i = 1; i < profiles.size(); ++i) chip8_profile_add(&profiles[0], &profiles[i]);
+        FILE *file = fopen(profile_path, "w");
+        if (!file) {
+            fprintf(stderr, "Unable to write profile %s\n", profile_path);
+            return 1;
+        }
+        size_t length = strlen(profile_path);
+        if (length >= 4 && strcmp(profile_path + length - 4, ".csv") == 0) chip8_profile_write_csv(&profiles[0], machines[0].M, file);
+        else chip8_profile_write_json(&profiles[0], machines[0].M, file);
+        fclose(file);
+        printf("\n");
+        chip8_profile_write_hotspots(&profiles[0], machines[0].M, 10, stdout);
+    }
+    rom_cache_destroy(rom_cache);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "input_log.h"
+
+#include <string.h>
+
+bool input_log_read(const char *path, InputLog *log) {
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+
+    log->seed = 0;
+    log->cycles_per_frame = 0;
+    log->quirks = CHIP8_NUM_QUIRKS;
+    log->events.clear();
+
+    bool ok = true;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+        unsigned long long cycle;
+        unsigned int value;
+        char name[32];
+        if (sscanf(line, "seed %x", &value) == 1) log->seed = value;
+        else if (sscanf(line, "cycles-per-frame %u", &value) == 1) log->cycles_per_frame = value;
+        else if (sscanf(line, "quirks %31s", name) == 1) {
+            log->quirks = chip8_quirks_from_name(name);
+            ok = log->quirks < CHIP8_NUM_QUIRKS;
+        }
+        else if (sscanf(line, "%llu %x", &cycle, &value) == 2 && value <= 0xFFFF) {
+            ok = log->events.empty() || log->events.back().cycle <= cycle;
+            InputEvent event = { cycle, (uint16_t)value };
+            log->events.push_back(event);
+        }
+        else ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
+bool input_recorder_open(InputRecorder *recorder, const char *path, uint32_t seed, uint32_t cycles_per_frame, uint32_t quirks) {
+    recorder->file = fopen(path, "w");
+    if (!recorder->file) return false;
+    recorder->last_mask = 0x10000;
+    fprintf(recorder->file, "# chip8 input log\nseed %08x\ncycles-per-frame %u\nquirks %s\n",
+            seed, cycles_per_frame, chip8_quirks_name(quirks));
+    return true;
+}
+
+void input_recorder_add(InputRecorder *recorder, uint64_t cycle, const bool keys[CHIP8_NUM_KEYS]) {
+    if (!recorder->file) return;
+    const uint16_t mask = input_keys_to_mask(keys);
+    if (mask == recorder->last_mask) return;
+    recorder->last_mask = mask;
+    fprintf(recorder->file, "%llu %04x\n", (unsigned long long)cycle, mask);
+}
+
+void input_recorder_close(InputRecorder *recorder) {
+    if (recorder->file) fclose(recorder->file);
+    recorder->file = NULL;
+}
+
+uint16_t input_keys_to_mask(const bool keys[CHIP8_NUM_KEYS]) {
+    uint16_t mask = 0;
+    for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) mask |= (uint16_t)keys[key] << key;
+    return mask;
+}
+
+void input_mask_to_keys(uint16_t mask, bool keys[CHIP8_NUM_KEYS]) {
+    for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) keys[key] = (mask >> key) & 1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdio.h>
+#include <vector>
+
+// Text log of key input, one line per change of the key state:
+//
+//     # comment
+//     seed 2545f491            PRNG seed, hex (optional)
+//     cycles-per-frame 9       CPU speed (optional)
+//     quirks vip               quirk profile, see chip8_quirks_name (optional)
+//     <cycle> <hex key mask>   from machine cycle <cycle> on, key n is held iff bit n is set
+//
+// Cycles count from chip8_machine_init (Chip8::cycles) and must not decrease.
+// Replaying a log on the same program gives bit-identical results.
+
+struct InputEvent {
+    uint64_t cycle;
+    uint16_t key_mask;
+};
+
+struct InputLog {
+    uint32_t seed; // 0 if the log doesn't say
+    uint32_t cycles_per_frame; // 0 if the log doesn't say
+    uint32_t quirks; // CHIP8_NUM_QUIRKS if the log doesn't say
+    std::vector<InputEvent> events;
+};
+
+bool input_log_read(const char *path, InputLog *log);
+
+// Writes a log while a session runs. Call input_recorder_add before every run
+// of the machine; only changes of the key state are written.
+struct InputRecorder {
+    FILE *file;
+    uint32_t last_mask; // above 0xFFFF until the first event
+};
+
+bool input_recorder_open(InputRecorder *recorder, const char *path, uint32_t seed, uint32_t cycles_per_frame, uint32_t quirks);
+void input_recorder_add(InputRecorder *recorder, uint64_t cycle, const bool keys[CHIP8_NUM_KEYS]);
+void input_recorder_close(InputRecorder *recorder);
+
+uint16_t input_keys_to_mask(const bool keys[CHIP8_NUM_KEYS]);
+void input_mask_to_keys(uint16_t mask, bool keys[CHIP8_NUM_KEYS]);
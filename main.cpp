@@ -1,10 +1,19 @@
 #include "chip8.h"
 #include "sound.h"
+#include "scheduler.h"
+#include "input_log.h"
+#include "render.h"
+#include "rom.h"
+#include "run_ahead.h"
+#include "trace.h"
 
 #include <windows.h>
+#include <mmsystem.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
 
 void debug_log(const char *format, ...) {
     va_list argptr;
@@ -15,39 +24,17 @@ void debug_log(const char *format, ...) {
     OutputDebugString(str);
 }
 
-bool read_file(const char *path, uint8_t **content, uint32_t *size) {
-    BOOL success;
-
-    HANDLE fileHandle = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (fileHandle == INVALID_HANDLE_VALUE) return false;
-
-    LARGE_INTEGER fileSize;
-    success = GetFileSizeEx(fileHandle, &fileSize);
-    assert(success);
-
-    *size = fileSize.LowPart;
-    *content = (uint8_t *)malloc(*size);
-
-    DWORD numBytesRead;
-    success = ReadFile(fileHandle, *content, *size, &numBytesRead, NULL);
-    assert(success);
-    assert(numBytesRead == *size);
-
-    success = CloseHandle(fileHandle);
-    assert(success);
-    
-    return true;
-}
-
-#define BACKBUFFER_BYTES (CHIP8_SCR_W * CHIP8_SCR_H * sizeof(uint32_t))
-
 static int window_width, window_height;
-static int dst_x, dst_y, dst_w, dst_h;
-static uint32_t backbuffer[BACKBUFFER_BYTES];
-static BITMAPINFO bmp_info;
+// Set on the window thread, read by the render thread.
+static std::atomic<int> dst_x, dst_y, dst_w, dst_h;
+static Render *render;
 
 static bool running = true;
 static bool keys[CHIP8_NUM_KEYS];
+static Chip8 machine;
+static Scheduler scheduler;
+static uint32_t speed = 1;
+static InputRecorder recorder;
 
 LRESULT CALLBACK wnd_proc(HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) {
     switch (msg) {
@@ -59,16 +46,18 @@ LRESULT CALLBACK wnd_proc(HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) {
             window_height = HIWORD(lparam);
             const float window_aspect = (float)window_width / window_height;
             if (window_aspect < CHIP8_ASPECT) {
+                const int h = (int)(window_width / CHIP8_ASPECT);
                 dst_x = 0;
                 dst_w = window_width;
-                dst_h = window_width / CHIP8_ASPECT;
-                dst_y = (window_height - dst_h) / 2;
+                dst_h = h;
+                dst_y = (window_height - h) / 2;
             }
             else {
+                const int w = (int)(window_height * CHIP8_ASPECT);
                 dst_y = 0;
                 dst_h = window_height;
-                dst_w = window_height * CHIP8_ASPECT;
-                dst_x = (window_width - dst_w) / 2;
+                dst_w = w;
+                dst_x = (window_width - w) / 2;
             }
             break;
         }
@@ -76,16 +65,22 @@ LRESULT CALLBACK wnd_proc(HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) {
             PAINTSTRUCT ps;
             HDC hdc = BeginPaint(wnd, &ps);
             FillRect(hdc, &ps.rcPaint, (HBRUSH)GetStockObject(DKGRAY_BRUSH));
-            StretchDIBits(hdc, dst_x, dst_y, dst_w, dst_h, 0, 0, CHIP8_SCR_W, CHIP8_SCR_H, backbuffer, &bmp_info, DIB_RGB_COLORS, SRCCOPY);
             EndPaint(wnd, &ps);
+            if (render) render_refresh(render);
             break;
         }
         case WM_KEYDOWN:
         case WM_KEYUP: {
             bool is_down = ((lparam & (1 << 31)) == 0);
+            const uint16_t old_mask = input_keys_to_mask(keys);
             //debug_log("key %x, is down %x\n", wparam, is_down);
             switch (wparam) {
                 case VK_ESCAPE: running = false; break;
+                case VK_TAB: scheduler_set_mode(&scheduler, is_down ? SCHEDULER_UNCAPPED : (speed > 1 ? SCHEDULER_MULTIPLIER : SCHEDULER_REALTIME), speed); break;
+                case VK_F1: speed = 1; scheduler_set_mode(&scheduler, SCHEDULER_REALTIME, speed); break;
+                case VK_F2: speed = 2; scheduler_set_mode(&scheduler, SCHEDULER_MULTIPLIER, speed); break;
+                case VK_F3: speed = 4; scheduler_set_mode(&scheduler, SCHEDULER_MULTIPLIER, speed); break;
+                case VK_F4: speed = 8; scheduler_set_mode(&scheduler, SCHEDULER_MULTIPLIER, speed); break;
                 case '1': keys[0x1] = is_down; break;
                 case '2': keys[0x2] = is_down; break;
                 case '3': keys[0x3] = is_down; break;
@@ -103,6 +98,9 @@ LRESULT CALLBACK wnd_proc(HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) {
                 case 'C': keys[0xb] = is_down; break;
                 case 'V': keys[0xf] = is_down; break;
             }
+            // Auto-repeat sends key downs that change nothing.
+            const uint16_t mask = input_keys_to_mask(keys);
+            if (mask != old_mask) trace_instant(TRACE_KEY, mask);
             break;
         }
         default:
@@ -111,6 +109,43 @@ LRESULT CALLBACK wnd_proc(HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) {
     return 0;
 }
 
+// Presents on the render thread; GDI does the scaling to the window.
+struct GdiSink {
+    RenderSink base;
+    HWND wnd;
+    BITMAPINFO bmp_info;
+};
+
+static void gdi_present(RenderSink *sink, const uint32_t *pixels, uint32_t width, uint32_t height, uint64_t frame) {
+    GdiSink *gdi = (GdiSink *)sink;
+    HDC hdc = GetDC(gdi->wnd);
+    if (!hdc) return;
+    StretchDIBits(hdc, dst_x, dst_y, dst_w, dst_h, 0, 0, width, height, pixels, &gdi->bmp_info, DIB_RGB_COLORS, SRCCOPY);
+    ReleaseDC(gdi->wnd, hdc);
+}
+
+static void gdi_destroy(RenderSink *sink) {
+    delete (GdiSink *)sink;
+}
+
+static RenderSink *gdi_sink_create(HWND wnd) {
+    GdiSink *gdi = new GdiSink();
+    gdi->base.scale = 1;
+    gdi->base.on_color = 0xffffffff;
+    gdi->base.off_color = 0xff000000;
+    gdi->base.every_frame = false; // show the newest screen, never hold up emulation
+    gdi->base.present = gdi_present;
+    gdi->base.destroy = gdi_destroy;
+    gdi->wnd = wnd;
+    gdi->bmp_info.bmiHeader.biSize = sizeof(gdi->bmp_info.bmiHeader);
+    gdi->bmp_info.bmiHeader.biWidth = CHIP8_SCR_W;
+    gdi->bmp_info.bmiHeader.biHeight = -CHIP8_SCR_H;
+    gdi->bmp_info.bmiHeader.biPlanes = 1;
+    gdi->bmp_info.bmiHeader.biBitCount = 32;
+    gdi->bmp_info.bmiHeader.biCompression = BI_RGB;
+    return &gdi->base;
+}
+
 int CALLBACK WinMain(HINSTANCE inst, HINSTANCE prev_inst, LPSTR cmd_line, int cmd_show) {
     WNDCLASS wnd_class = { 0 };
     wnd_class.style = CS_HREDRAW | CS_VREDRAW;
@@ -138,67 +173,143 @@ int CALLBACK WinMain(HINSTANCE inst, HINSTANCE prev_inst, LPSTR cmd_line, int cm
     ShowWindow(wnd, cmd_show);
     UpdateWindow(wnd);
 
+    // chip8 [--record input.log] [--run-ahead K] [--trace trace.json] path/to/program
     const char *program_path = cmd_line;
+    char record_path[MAX_PATH] = "";
+    char trace_path[MAX_PATH] = "";
+    uint32_t run_ahead_frames = 0;
+    for (;;) {
+        if (strncmp(program_path, "--record ", 9) == 0) {
+            program_path += 9;
+            uint32_t length = 0;
+            while (*program_path && *program_path != ' ' && length + 1 < sizeof(record_path)) record_path[length++] = *program_path++;
+            record_path[length] = 0;
+        }
+        else if (strncmp(program_path, "--trace ", 8) == 0) {
+            program_path += 8;
+            uint32_t length = 0;
+            while (*program_path && *program_path != ' ' && length + 1 < sizeof(trace_path)) trace_path[length++] = *program_path++;
+            trace_path[length] = 0;
+        }
+        else if (strncmp(program_path, "--run-ahead ", 12) == 0) {
+            char *end;
+            run_ahead_frames = strtoul(program_path + 12, &end, 10);
+            program_path = end;
+        }
+        else {
+            break;
+        }
+        while (*program_path == ' ') program_path++;
+    }
     if (*program_path == 0) {
-        MessageBox(wnd, "Usage: chip8 path/to/program", "Error", MB_OK);
+        MessageBox(wnd, "Usage: chip8 [--record input.log] [--run-ahead K] [--trace trace.json] path/to/program", "Error", MB_OK);
         return 0;
     }
 
+    RomCache *rom_cache = rom_cache_create();
     {
-        uint8_t *program = NULL;
-        uint32_t program_size = 0;
-        if (!read_file(program_path, &program, &program_size)) {
-            char str[128];
-            sprintf(str, "Unable to read program %s", cmd_line);
+        RomError error;
+        const Rom *rom = rom_cache_load(rom_cache, program_path, CHIP8_NUM_QUIRKS, &error);
+        if (!rom) {
+            char str[1024];
+            snprintf(str, sizeof(str), "Unable to load program %s: %s", program_path, rom_error_string(error));
             MessageBox(wnd, str, "Error", MB_OK);
             return 0;
         }
-        chip8_init(program, program_size);
-        free(program);
+        rom_instance_init(rom, &machine);
     }
 
-    const HDC hdc = GetDC(wnd);
+    if (*record_path && !input_recorder_open(&recorder, record_path, machine.rng_state, machine.cycles_per_timer, machine.quirks)) {
+        MessageBox(wnd, "Unable to create the input log", "Error", MB_OK);
+        return 0;
+    }
 
-    bmp_info.bmiHeader.biSize = sizeof(bmp_info.bmiHeader);
-    bmp_info.bmiHeader.biWidth = CHIP8_SCR_W;
-    bmp_info.bmiHeader.biHeight = -CHIP8_SCR_H;
-    bmp_info.bmiHeader.biPlanes = 1;
-    bmp_info.bmiHeader.biBitCount = 32;
-    bmp_info.bmiHeader.biCompression = BI_RGB;
+    // Before the render and synth threads start, so their first events are kept.
+    if (*trace_path) trace_enable(true);
+    trace_thread_name("main");
 
-    sound_init();
+    render = render_create(gdi_sink_create(wnd));
+    Sound *sound = sound_create(sound_wasapi_sink_create(), CHIP8_TIMER_HZ * machine.cycles_per_timer);
+    // Shows the machine's predicted future instead of its present; sound and the input log stay on the real machine.
+    Chip8RunAhead *run_ahead = run_ahead_frames > 0 ? chip8_run_ahead_create(run_ahead_frames) : NULL;
+    uint64_t presented[CHIP8_SCR_H];
+    bool has_presented = false;
+    uint16_t input_mask = 0;
 
-    uint8_t prev_sound_timer = 0;
-    static uint8_t screen[CHIP8_SCR_H][CHIP8_SCR_W];
+    timeBeginPeriod(1);
+    scheduler_init(&scheduler, SCHEDULER_REALTIME, speed);
 
     while (running) {
         MSG msg;
-        if (PeekMessage(&msg, 0, 0, 0, PM_REMOVE)) {
+        while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE)) {
             TranslateMessage(&msg);
             DispatchMessage(&msg);
             if (msg.message == WM_QUIT) running = false;
-            continue;
         }
+        if (!running) break;
 
-        chip8_do_cycle(screen, keys);
+        // Run whole frames in one burst; the timers tick once at the end of each.
+        uint32_t frames = scheduler_frames_to_run(&scheduler);
+        for (uint32_t frame = 0; frame < frames; ++frame) {
+            // Keys only change between runs, so logging them here is enough to replay the session.
+            input_recorder_add(&recorder, machine.cycles, keys);
+            const uint16_t mask = input_keys_to_mask(keys);
+            if (mask != input_mask) {
+                input_mask = mask;
+                trace_instant(TRACE_INPUT, mask);
+            }
+            const uint64_t run_start = trace_begin();
+            chip8_machine_run(&machine, machine.cycles_per_timer, keys);
+            trace_span(TRACE_RUN, run_start, machine.cycles / machine.cycles_per_timer);
+            sound_set_beeper(sound, machine.cycles, machine.sound_timer > 0);
+        }
 
-        uint8_t sound_timer = chip8_get_sound_timer();
-        if (prev_sound_timer == 0 && sound_timer > 0) {
-            sound_start();
+        // Only 00E0 and Dxyn touch the screen, so most frames leave nothing to present.
+        // Handing a frame over never waits on the render thread.
+        if (run_ahead) {
+            if (frames > 0) {
+                const Chip8 *ahead = chip8_run_ahead(run_ahead, &machine, keys);
+                if (!has_presented || memcmp(ahead->screen, presented, sizeof(presented)) != 0) {
+                    memcpy(presented, ahead->screen, sizeof(presented));
+                    has_presented = true;
+                    render_submit(render, presented, machine.cycles / machine.cycles_per_timer);
+                    trace_instant(TRACE_SUBMIT, machine.cycles / machine.cycles_per_timer);
+                }
+            }
         }
-        else if (prev_sound_timer > 0 && sound_timer == 0) {
-            sound_stop();
+        else if (chip8_machine_take_dirty_rows(&machine)) {
+            render_submit(render, machine.screen, machine.cycles / machine.cycles_per_timer);
+            trace_instant(TRACE_SUBMIT, machine.cycles / machine.cycles_per_timer);
         }
-        sound_update();
-        prev_sound_timer = sound_timer;
 
-        for (uint32_t row = 0; row < CHIP8_SCR_H; ++row)
-            for (uint32_t col = 0; col < CHIP8_SCR_W; ++col)
-                backbuffer[row*CHIP8_SCR_W + col] = screen[row][col] ? 0xffffffff : 0xff000000;
-
-        StretchDIBits(hdc, dst_x, dst_y, dst_w, dst_h, 0, 0, CHIP8_SCR_W, CHIP8_SCR_H, backbuffer, &bmp_info, DIB_RGB_COLORS, SRCCOPY);
-        Sleep(CHIP8_CYCLE_INTERVAL * 1000);
+        const uint64_t wait_start = trace_begin();
+        scheduler_wait(&scheduler);
+        trace_span(TRACE_WAIT, wait_start, 0);
     }
 
+    timeEndPeriod(1);
+    render_destroy(render);
+    render = NULL;
+    sound_destroy(sound);
+    if (run_ahead) {
+        const Chip8RunAheadStats stats = chip8_run_ahead_stats(run_ahead);
+        debug_log("run-ahead: %u frames, %llu extra cycles over %llu real, %llu of %llu copies full, %.3f s\n",
+                  run_ahead_frames, (unsigned long long)stats.cycles, (unsigned long long)machine.cycles,
+                  (unsigned long long)stats.full_copies, (unsigned long long)stats.calls, stats.ns * 1e-9);
+        chip8_run_ahead_destroy(run_ahead);
+    }
+    if (*trace_path) {
+        if (!trace_write_json(trace_path)) debug_log("Unable to write the trace to %s\n", trace_path);
+        TraceSummary summary;
+        trace_summarize(&summary);
+        debug_log("trace: key to present p50 %.2f p99 %.2f max %.2f ms (%llu), frame jitter p99 %.2f ms, "
+                  "audio underruns %llu, dropped %llu samples, %llu events, %llu lost\n",
+                  summary.key_to_present.p50, summary.key_to_present.p99, summary.key_to_present.max,
+                  (unsigned long long)summary.key_to_present.count, summary.frame_jitter.p99,
+                  (unsigned long long)summary.audio_underruns, (unsigned long long)summary.audio_dropped,
+                  (unsigned long long)summary.events, (unsigned long long)summary.lost);
+    }
+    rom_cache_destroy(rom_cache);
+    input_recorder_close(&recorder);
     return 0;
 }
@@ -0,0 +1,217 @@
+#include "render.h"
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RENDER_SSE2 1
+#include <emmintrin.h>
+#else
+#define RENDER_SSE2 0
+#endif
+
+#define NUM_SLOTS 3
+#define SLOT_MASK 0x3
+#define FRESH 0x4 // set in `middle` while it holds a screen the render thread has not taken
+#define IDLE_SLEEP_MS 1
+
+struct RenderFrame {
+    uint64_t screen[CHIP8_SCR_H];
+    uint64_t frame;
+};
+
+struct Render {
+    RenderSink *sink;
+    std::thread thread;
+    std::atomic<bool> quit;
+    std::atomic<bool> refresh;
+
+    // Triple buffer: the emulation thread owns slots[back], the render thread
+    // slots[front], and the two swap their slot with `middle` to hand over.
+    RenderFrame slots[NUM_SLOTS];
+    std::atomic<uint32_t> middle;
+    uint32_t back;
+    uint32_t front;
+    // every_frame only: signalled whenever `middle` gains or loses FRESH.
+    std::mutex mutex;
+    std::condition_variable handed_over;
+
+    // Render thread only.
+    std::vector<uint32_t> pixels;
+    bool has_frame;
+};
+
+// One screen row at scale 1.
+static void expand_row(uint64_t bits, uint32_t on_color, uint32_t off_color, uint32_t *out) {
+#if RENDER_SSE2
+    // Four pixels at a time: spread a nibble over the lanes, leftmost pixel in
+    // lane 0, and turn each lane into an all-ones or all-zeros mask.
+    const __m128i lane_bits = _mm_set_epi32(1, 2, 4, 8);
+    const __m128i on = _mm_set1_epi32((int)on_color);
+    const __m128i off = _mm_set1_epi32((int)off_color);
+    for (uint32_t col = 0; col < CHIP8_SCR_W; col += 4) {
+        const int nibble = (int)(bits >> (CHIP8_SCR_W - 4 - col)) & 0xF;
+        const __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(nibble), lane_bits), lane_bits);
+        const __m128i pixels = _mm_or_si128(_mm_and_si128(mask, on), _mm_andnot_si128(mask, off));
+        _mm_storeu_si128((__m128i *)(out + col), pixels);
+    }
+#else
+    const uint32_t diff = on_color ^ off_color;
+    for (uint32_t col = 0; col < CHIP8_SCR_W; ++col) {
+        uint32_t pixel = (uint32_t)(bits >> (CHIP8_SCR_W - 1 - col)) & 1;
+        out[col] = off_color ^ (diff & (0 - pixel));
+    }
+#endif
+}
+
+void render_expand(const uint64_t screen[CHIP8_SCR_H], uint32_t scale, uint32_t on_color, uint32_t off_color, uint32_t *out) {
+    const uint32_t width = CHIP8_SCR_W * scale;
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        uint32_t *dst = out + row * scale * width;
+        if (scale == 1) {
+            expand_row(screen[row], on_color, off_color, dst);
+            continue;
+        }
+        // Expand at scale 1 into the row's tail, then widen front to back: pixel
+        // i is only overwritten once its own copies are written.
+        uint32_t *narrow = dst + width - CHIP8_SCR_W;
+        expand_row(screen[row], on_color, off_color, narrow);
+        for (uint32_t col = 0; col < CHIP8_SCR_W; ++col) {
+            const uint32_t pixel = narrow[col];
+            for (uint32_t i = 0; i < scale; ++i) dst[col * scale + i] = pixel;
+        }
+        for (uint32_t i = 1; i < scale; ++i) memcpy(dst + i * width, dst, width * sizeof(uint32_t));
+    }
+}
+
+static void present(Render *r) {
+    RenderSink *sink = r->sink;
+    const RenderFrame *frame = &r->slots[r->front];
+    const uint64_t start = trace_begin();
+    render_expand(frame->screen, sink->scale, sink->on_color, sink->off_color, r->pixels.data());
+    sink->present(sink, r->pixels.data(), CHIP8_SCR_W * sink->scale, CHIP8_SCR_H * sink->scale, frame->frame);
+    trace_span(TRACE_PRESENT, start, frame->frame);
+}
+
+// Taking the lock first means a waiter has either not checked `middle` yet or
+// is already waiting, so the wakeup cannot be lost.
+static void notify(Render *r) {
+    { std::lock_guard<std::mutex> lock(r->mutex); }
+    r->handed_over.notify_all();
+}
+
+static void render_main(Render *r) {
+    trace_thread_name("render");
+    for (;;) {
+        // Read quit first so a screen submitted before it is still presented.
+        const bool quit = r->quit.load(std::memory_order_acquire);
+        if (r->middle.load(std::memory_order_relaxed) & FRESH) {
+            r->front = r->middle.exchange(r->front, std::memory_order_acq_rel) & SLOT_MASK;
+            if (r->sink->every_frame) notify(r);
+            r->has_frame = true;
+            present(r);
+        }
+        else if (r->refresh.exchange(false, std::memory_order_relaxed) && r->has_frame) {
+            present(r);
+        }
+        else if (quit) {
+            break;
+        }
+        else if (r->sink->every_frame) {
+            // The emulation thread may be blocked on this one, so don't oversleep.
+            std::unique_lock<std::mutex> lock(r->mutex);
+            r->handed_over.wait_for(lock, std::chrono::milliseconds(IDLE_SLEEP_MS),
+                                    [r] { return (r->middle.load(std::memory_order_acquire) & FRESH) != 0; });
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+        }
+    }
+}
+
+Render *render_create(RenderSink *sink) {
+    Render *r = new Render();
+    r->sink = sink;
+    r->quit = false;
+    r->refresh = false;
+    r->middle = 1;
+    r->back = 0;
+    r->front = 2;
+    r->pixels.resize(CHIP8_SCR_W * CHIP8_SCR_H * sink->scale * sink->scale);
+    r->has_frame = false;
+    r->thread = std::thread(render_main, r);
+    return r;
+}
+
+void render_destroy(Render *r) {
+    r->quit.store(true, std::memory_order_release);
+    r->thread.join();
+    r->sink->destroy(r->sink);
+    delete r;
+}
+
+void render_submit(Render *r, const uint64_t screen[CHIP8_SCR_H], uint64_t frame) {
+    RenderFrame *slot = &r->slots[r->back];
+    memcpy(slot->screen, screen, sizeof(slot->screen));
+    slot->frame = frame;
+    if (r->sink->every_frame) {
+        std::unique_lock<std::mutex> lock(r->mutex);
+        r->handed_over.wait(lock, [r] { return (r->middle.load(std::memory_order_acquire) & FRESH) == 0; });
+    }
+    r->back = r->middle.exchange(r->back | FRESH, std::memory_order_acq_rel) & SLOT_MASK;
+    if (r->sink->every_frame) notify(r);
+}
+
+void render_refresh(Render *r) {
+    r->refresh.store(true, std::memory_order_relaxed);
+}
+
+struct PpmSink {
+    RenderSink base;
+    std::vector<char> prefix;
+    std::vector<uint8_t> rgb;
+};
+
+static void ppm_present(RenderSink *sink, const uint32_t *pixels, uint32_t width, uint32_t height, uint64_t frame) {
+    PpmSink *ppm = (PpmSink *)sink;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", ppm->prefix.data(), (unsigned long long)frame);
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Unable to write %s\n", path);
+        return;
+    }
+    ppm->rgb.resize(width * height * 3);
+    for (uint32_t i = 0; i < width * height; ++i) {
+        ppm->rgb[3 * i + 0] = (pixels[i] >> 16) & 0xFF;
+        ppm->rgb[3 * i + 1] = (pixels[i] >> 8) & 0xFF;
+        ppm->rgb[3 * i + 2] = pixels[i] & 0xFF;
+    }
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    fwrite(ppm->rgb.data(), 1, ppm->rgb.size(), file);
+    fclose(file);
+}
+
+static void ppm_destroy(RenderSink *sink) {
+    delete (PpmSink *)sink;
+}
+
+RenderSink *render_ppm_sink_create(const char *prefix, uint32_t scale) {
+    if (scale == 0) return NULL;
+    PpmSink *ppm = new PpmSink();
+    ppm->base.scale = scale;
+    ppm->base.on_color = 0xffffffff;
+    ppm->base.off_color = 0xff000000;
+    ppm->base.every_frame = true;
+    ppm->base.present = ppm_present;
+    ppm->base.destroy = ppm_destroy;
+    ppm->prefix.assign(prefix, prefix + strlen(prefix) + 1);
+    return &ppm->base;
+}
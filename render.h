@@ -0,0 +1,43 @@
+#pragma once
+
+#include "chip8.h"
+
+// Presentation on a thread of its own. The emulation thread submits finished
+// screens into a lock-free triple buffer; the render thread picks up the newest
+// one, expands it to 32bpp at the sink's integer scale and presents it. For a
+// live display the emulation thread never waits and screens submitted faster
+// than the sink presents are skipped. Sinks that set every_frame get every
+// screen instead, and render_submit waits while the previous one is still
+// waiting to be taken.
+
+// Where frames go. present gets (CHIP8_SCR_W * scale) x (CHIP8_SCR_H * scale)
+// pixels, rows top to bottom, and the number the frame was submitted with.
+struct RenderSink {
+    uint32_t scale;
+    uint32_t on_color;
+    uint32_t off_color;
+    bool every_frame; // lossless, e.g. for files: output must not depend on timing
+    void (*present)(RenderSink *sink, const uint32_t *pixels, uint32_t width, uint32_t height, uint64_t frame);
+    void (*destroy)(RenderSink *sink);
+};
+
+// Writes every submitted frame to <prefix><frame>.ppm, frame zero-padded to six
+// digits. NULL for a scale of 0.
+RenderSink *render_ppm_sink_create(const char *prefix, uint32_t scale);
+
+struct Render;
+
+// Takes ownership of sink.
+Render *render_create(RenderSink *sink);
+// Presents the last submitted screen if it has not been yet, stops the render
+// thread and destroys the sink.
+void render_destroy(Render *render);
+// From the emulation thread only. Copies the screen and returns, immediately
+// unless the sink wants every frame.
+void render_submit(Render *render, const uint64_t screen[CHIP8_SCR_H], uint64_t frame);
+// Has the render thread present the newest screen again, e.g. after a window was uncovered.
+void render_refresh(Render *render);
+
+// Expands a packed screen to one 32-bit color per pixel, each pixel a scale x
+// scale square. Uses SSE2 where available.
+void render_expand(const uint64_t screen[CHIP8_SCR_H], uint32_t scale, uint32_t on_color, uint32_t off_color, uint32_t *out);
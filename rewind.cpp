@@ -0,0 +1,164 @@
+#include "rewind.h"
+#include "chip8_state.h"
+#include "delta.h"
+
+#include <memory.h>
+
+struct RewindEntry {
+    uint32_t offset;
+    uint32_t size;
+    bool keyframe;
+};
+
+struct Chip8Rewind {
+    uint8_t *arena;
+    uint32_t capacity;
+    uint32_t head; // where the next entry goes
+    uint32_t bytes_used;
+
+    RewindEntry *entries; // ring, oldest at `first`
+    uint32_t max_entries;
+    uint32_t first;
+    uint32_t count;
+
+    uint32_t keyframe_interval;
+    uint32_t frames_since_key;
+    Chip8State key_state; // decoded keyframe of the newest group
+    Chip8State state;
+    uint8_t *encoded;
+};
+
+// Entries are rarely smaller than this; it only sizes the metadata ring.
+#define MIN_EXPECTED_ENTRY_SIZE 16
+
+Chip8Rewind *chip8_rewind_create(uint32_t capacity_bytes, uint32_t keyframe_interval) {
+    Chip8Rewind *r = new Chip8Rewind();
+    r->arena = new uint8_t[capacity_bytes];
+    r->capacity = capacity_bytes;
+    r->head = 0;
+    r->bytes_used = 0;
+    r->max_entries = capacity_bytes / MIN_EXPECTED_ENTRY_SIZE + 1;
+    r->entries = new RewindEntry[r->max_entries];
+    r->first = 0;
+    r->count = 0;
+    r->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    r->frames_since_key = 0;
+    r->encoded = new uint8_t[delta_max_encoded_size(sizeof(Chip8State))];
+    return r;
+}
+
+void chip8_rewind_destroy(Chip8Rewind *r) {
+    delete[] r->encoded;
+    delete[] r->entries;
+    delete[] r->arena;
+    delete r;
+}
+
+static RewindEntry *entry_at(Chip8Rewind *r, uint32_t age_index) {
+    return &r->entries[(r->first + age_index) % r->max_entries];
+}
+
+static void drop_oldest_group(Chip8Rewind *r) {
+    do {
+        r->bytes_used -= entry_at(r, 0)->size;
+        r->first = (r->first + 1) % r->max_entries;
+        r->count--;
+    } while (r->count > 0 && !entry_at(r, 0)->keyframe);
+}
+
+// Finds room for `size` contiguous bytes, dropping the oldest groups as needed.
+static bool reserve(Chip8Rewind *r, uint32_t size, uint32_t *offset) {
+    if (size > r->capacity) return false;
+    for (;;) {
+        if (r->count == 0) {
+            r->head = 0;
+            *offset = 0;
+            return true;
+        }
+        if (r->count < r->max_entries) {
+            // The oldest entry is always a non-empty keyframe, so tail == head means full.
+            uint32_t tail = entry_at(r, 0)->offset;
+            if (tail < r->head) {
+                if (r->head + size <= r->capacity) {
+                    *offset = r->head;
+                    return true;
+                }
+                if (size <= tail) {
+                    *offset = 0;
+                    return true;
+                }
+            }
+            else if (r->head + size <= tail) {
+                *offset = r->head;
+                return true;
+            }
+        }
+        drop_oldest_group(r);
+    }
+}
+
+void chip8_rewind_push(Chip8Rewind *r, const Chip8 *c8) {
+    chip8_save_state(c8, &r->state);
+    for (;;) {
+        const bool keyframe = r->count == 0 || r->frames_since_key + 1 >= r->keyframe_interval;
+        const uint8_t *ref = keyframe ? NULL : (const uint8_t *)&r->key_state;
+        uint32_t size = delta_encode((const uint8_t *)&r->state, ref, sizeof(Chip8State), r->encoded);
+
+        uint32_t offset;
+        if (!reserve(r, size, &offset)) return;
+        // Making room dropped the group this delta refers to; start a new one.
+        if (!keyframe && r->count == 0) continue;
+
+        memcpy(r->arena + offset, r->encoded, size);
+        RewindEntry *entry = &r->entries[(r->first + r->count) % r->max_entries];
+        entry->offset = offset;
+        entry->size = size;
+        entry->keyframe = keyframe;
+        r->count++;
+        r->head = offset + size;
+        r->bytes_used += size;
+
+        if (keyframe) {
+            r->key_state = r->state;
+            r->frames_since_key = 0;
+        }
+        else {
+            r->frames_since_key++;
+        }
+        return;
+    }
+}
+
+bool chip8_rewind_pop(Chip8Rewind *r, Chip8 *c8) {
+    if (r->count == 0) return false;
+
+    const RewindEntry entry = *entry_at(r, r->count - 1);
+    const uint8_t *ref = entry.keyframe ? NULL : (const uint8_t *)&r->key_state;
+    bool ok = delta_decode(r->arena + entry.offset, entry.size, ref, (uint8_t *)&r->state, sizeof(Chip8State));
+
+    r->count--;
+    r->head = entry.offset;
+    r->bytes_used -= entry.size;
+
+    if (!entry.keyframe) {
+        r->frames_since_key--;
+    }
+    else if (r->count > 0) {
+        // The newest group is now the previous one; bring its keyframe back.
+        uint32_t key_index = r->count - 1;
+        while (!entry_at(r, key_index)->keyframe) key_index--;
+        const RewindEntry *key = entry_at(r, key_index);
+        delta_decode(r->arena + key->offset, key->size, NULL, (uint8_t *)&r->key_state, sizeof(Chip8State));
+        r->frames_since_key = r->count - 1 - key_index;
+    }
+
+    return ok && chip8_load_state(c8, &r->state);
+}
+
+uint32_t chip8_rewind_frames(const Chip8Rewind *r) {
+    return r->count;
+}
+
+uint32_t chip8_rewind_bytes_used(const Chip8Rewind *r) {
+    return r->bytes_used;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "chip8.h"
+
+// History of machine snapshots for stepping backwards frame by frame. Each
+// group starts with a keyframe, run-length coded on its own, followed by
+// XOR deltas against that keyframe. When the arena is full the oldest group
+// is dropped, so memory stays fixed no matter how long the session runs.
+struct Chip8Rewind;
+
+Chip8Rewind *chip8_rewind_create(uint32_t capacity_bytes, uint32_t keyframe_interval);
+void chip8_rewind_destroy(Chip8Rewind *r);
+
+// Records the machine's current state; call once per frame.
+void chip8_rewind_push(Chip8Rewind *r, const Chip8 *c8);
+// Restores the most recently pushed state and forgets it. Returns false when the history is empty.
+bool chip8_rewind_pop(Chip8Rewind *r, Chip8 *c8);
+
+uint32_t chip8_rewind_frames(const Chip8Rewind *r);
+uint32_t chip8_rewind_bytes_used(const Chip8Rewind *r);
@@ -0,0 +1,233 @@
+#include "rom.h"
+#include "chip8_flow.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_SIZE CHIP8_MEMORY_SIZE
+
+struct RomCache {
+    std::mutex mutex;
+    std::map<std::pair<uint64_t, uint32_t>, Rom *> roms; // by content hash and quirk profile
+};
+
+// Takes the code chip8_flow finds under the Rom's quirk profile and notes
+// which of it the profile affects. Bnnn counts even where the profile faults
+// on it, since others jump.
+static void discover(Rom *rom) {
+    const uint8_t *M = rom->image.M;
+    Chip8Flow flow;
+    chip8_flow_discover(M, 0, MEMORY_SIZE, rom->quirks, &flow);
+    memcpy(rom->code, flow.code, sizeof(rom->code));
+    rom->code_complete = flow.complete;
+    rom->code_bytes = 0;
+    rom->quirk_ops = 0;
+    for (uint32_t pc = 0; pc < MEMORY_SIZE; ++pc) {
+        if (!flow.code[pc] && !flow.faults[pc]) continue;
+        const uint8_t hi = M[pc];
+        const uint8_t lo = M[pc + 1];
+        if (flow.code[pc]) rom->code_bytes += 2;
+        switch (hi >> 4) {
+            case 0x8: {
+                const uint8_t n = lo & 0xF;
+                if ((n == 0x6 || n == 0xE) && (hi & 0xF) != (lo >> 4)) rom->quirk_ops |= ROM_USES_SHIFT;
+                if (n >= 0x1 && n <= 0x3) rom->quirk_ops |= ROM_USES_LOGIC;
+                break;
+            }
+            case 0xB:
+                rom->quirk_ops |= ROM_USES_JUMP_OFFSET;
+                break;
+            case 0xF:
+                if (lo == 0x55 || lo == 0x65) rom->quirk_ops |= ROM_USES_LOAD_STORE;
+                break;
+        }
+    }
+}
+
+const char *rom_base_name(const char *path) {
+    const char *name = path;
+    for (const char *p = path; *p; ++p) {
+        if (*p == '/' || *p == '\\') name = p + 1;
+    }
+    return name;
+}
+
+static Rom *build(const char *name, const uint8_t *program, uint32_t size, uint64_t hash, uint32_t quirks) {
+    Rom *rom = new Rom();
+    strncpy(rom->name, name, ROM_MAX_NAME - 1);
+    rom->hash = hash;
+    rom->size = size;
+    rom->quirks = (uint8_t)quirks;
+    chip8_machine_init(&rom->image, program, size);
+    rom->image.quirks = (uint8_t)quirks;
+    discover(rom);
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; ++addr) {
+        if (rom->code[addr]) chip8_machine_predecode(&rom->image, addr);
+    }
+    return rom;
+}
+
+static RomError check_size(uint64_t size) {
+    if (size == 0) return ROM_EMPTY;
+    if (size > CHIP8_MAX_PROGRAM_SIZE) return ROM_TOO_LARGE;
+    return ROM_OK;
+}
+
+RomCache *rom_cache_create() {
+    return new RomCache();
+}
+
+void rom_cache_destroy(RomCache *cache) {
+    for (auto &entry : cache->roms) delete entry.second;
+    delete cache;
+}
+
+uint32_t rom_cache_size(const RomCache *cache) {
+    return (uint32_t)cache->roms.size();
+}
+
+const Rom *rom_cache_add(RomCache *cache, const char *name, const uint8_t *program, uint32_t size, uint32_t quirks, RomError *error) {
+    const RomError status = check_size(size);
+    if (error) *error = status;
+    if (status != ROM_OK) return NULL;
+
+    if (quirks >= CHIP8_NUM_QUIRKS) quirks = CHIP8_QUIRKS_LEGACY;
+    const std::pair<uint64_t, uint32_t> key(hash_fnv1a(program, size), quirks);
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto it = cache->roms.find(key);
+        if (it != cache->roms.end()) return it->second;
+    }
+    // Built outside the lock so loads of different programs run in parallel.
+    Rom *rom = build(rom_base_name(name), program, size, key.first, quirks);
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto inserted = cache->roms.insert(std::make_pair(key, rom));
+    if (!inserted.second) delete rom;
+    return inserted.first->second;
+}
+
+#ifdef _WIN32
+
+const Rom *rom_cache_load(RomCache *cache, const char *path, uint32_t quirks, RomError *error) {
+    if (error) *error = ROM_UNREADABLE;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER size;
+    const Rom *rom = NULL;
+    if (!GetFileSizeEx(file, &size)) {
+        // Unreadable.
+    }
+    else if (check_size(size.QuadPart) != ROM_OK) {
+        if (error) *error = check_size(size.QuadPart);
+    }
+    else {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            const uint8_t *data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data) {
+                rom = rom_cache_add(cache, path, data, (uint32_t)size.QuadPart, quirks, error);
+                UnmapViewOfFile(data);
+            }
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return rom;
+}
+
+bool rom_list_dir(const char *dir, const char *extension, void (*visit)(const char *path, void *user), void *user) {
+    std::string pattern = std::string(dir) + "\\*";
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(pattern.c_str(), &found);
+    if (find == INVALID_HANDLE_VALUE) return false;
+    std::vector<std::string> names;
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) names.push_back(found.cFileName);
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+
+    std::sort(names.begin(), names.end());
+    const size_t extension_length = extension ? strlen(extension) : 0;
+    for (const std::string &name : names) {
+        if (name.size() < extension_length || _stricmp(name.c_str() + name.size() - extension_length, extension ? extension : "") != 0) continue;
+        visit((std::string(dir) + "\\" + name).c_str(), user);
+    }
+    return true;
+}
+
+#else
+
+const Rom *rom_cache_load(RomCache *cache, const char *path, uint32_t quirks, RomError *error) {
+    if (error) *error = ROM_UNREADABLE;
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    const Rom *rom = NULL;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        // Unreadable.
+    }
+    else if (check_size(info.st_size) != ROM_OK) {
+        if (error) *error = check_size(info.st_size);
+    }
+    else {
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rom = rom_cache_add(cache, path, (const uint8_t *)data, (uint32_t)info.st_size, quirks, error);
+            munmap(data, info.st_size);
+        }
+    }
+    close(fd);
+    return rom;
+}
+
+bool rom_list_dir(const char *dir, const char *extension, void (*visit)(const char *path, void *user), void *user) {
+    DIR *d = opendir(dir);
+    if (!d) return false;
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(d)) names.push_back(entry->d_name);
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+    const size_t extension_length = extension ? strlen(extension) : 0;
+    for (const std::string &name : names) {
+        if (name.size() < extension_length || strcasecmp(name.c_str() + name.size() - extension_length, extension ? extension : "") != 0) continue;
+        const std::string path = std::string(dir) + "/" + name;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+        visit(path.c_str(), user);
+    }
+    return true;
+}
+
+#endif
+
+void rom_instance_init(const Rom *rom, Chip8 *c8) {
+    memcpy(c8, &rom->image, sizeof(*c8));
+}
+
+const char *rom_error_string(RomError error) {
+    switch (error) {
+        case ROM_OK: return "ok";
+        case ROM_UNREADABLE: return "unreadable";
+        case ROM_EMPTY: return "empty";
+        case ROM_TOO_LARGE: return "too large";
+    }
+    return "unknown error";
+}
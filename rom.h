@@ -0,0 +1,68 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Program loading. Files are memory-mapped, checked against
+// CHIP8_MAX_PROGRAM_SIZE and identified by the hash of their contents; what is
+// derived from a program is worked out once per content and shared by every
+// instance through a RomCache, so starting one more instance is a single copy
+// of a machine that is already initialized and predecoded.
+
+#define ROM_MAX_NAME 256
+
+enum RomError {
+    ROM_OK,
+    ROM_UNREADABLE, // missing, not a regular file, or mapping failed
+    ROM_EMPTY,
+    ROM_TOO_LARGE, // more than CHIP8_MAX_PROGRAM_SIZE bytes
+};
+
+// Bits of Rom::quirk_ops: discovered instructions whose result depends on the
+// quirk profile.
+#define ROM_USES_SHIFT 0x1 // 8xy6, 8xyE with x != y
+#define ROM_USES_LOAD_STORE 0x2 // Fx55, Fx65
+#define ROM_USES_LOGIC 0x4 // 8xy1-8xy3
+#define ROM_USES_JUMP_OFFSET 0x8 // Bnnn
+
+struct Rom {
+    char name[ROM_MAX_NAME]; // file name without the directory
+    uint64_t hash; // hash_fnv1a of the program, as chip8_aot_find keys it
+    uint32_t size;
+    uint8_t quirks; // Chip8Quirks instances start with
+    // Instruction starts chip8_flow_discover finds under `quirks`. Bnnn
+    // targets are guessed, so the map may miss or add code when the program
+    // uses it on a profile that has it.
+    bool code[CHIP8_MEMORY_SIZE];
+    bool code_complete; // no reachable Bnnn the profile jumps on
+    uint32_t code_bytes;
+    uint32_t quirk_ops; // ROM_USES_* found in code, 0 = every quirk profile runs it the same
+    // chip8_machine_init'd with the program, the decode cache filled for all of `code`.
+    Chip8 image;
+};
+
+struct RomCache;
+
+RomCache *rom_cache_create();
+// Frees every Rom the cache handed out.
+void rom_cache_destroy(RomCache *cache);
+// Loads the program at path, or finds it in the cache by content and quirk
+// profile (CHIP8_NUM_QUIRKS = legacy). Safe to call from any thread. NULL on
+// failure, with the reason in *error if error is not NULL.
+const Rom *rom_cache_load(RomCache *cache, const char *path, uint32_t quirks, RomError *error);
+// Same for a program already in memory.
+const Rom *rom_cache_add(RomCache *cache, const char *name, const uint8_t *program, uint32_t size, uint32_t quirks, RomError *error);
+uint32_t rom_cache_size(const RomCache *cache);
+
+// Starts a machine on rom: one copy of rom->image, quirk profile included.
+void rom_instance_init(const Rom *rom, Chip8 *c8);
+
+const char *rom_error_string(RomError error);
+// The part of path after the last slash or backslash.
+const char *rom_base_name(const char *path);
+
+// Calls visit(path, user) for every regular file in dir whose name ends in
+// extension (e.g. ".ch8"; NULL = any), in name order. Returns false if dir
+// cannot be listed.
+bool rom_list_dir(const char *dir, const char *extension, void (*visit)(const char *path, void *user), void *user);
@@ -0,0 +1,69 @@
+#include "run_ahead.h"
+
+#include <chrono>
+#include <stddef.h>
+#include <string.h>
+
+// Everything in Chip8 between memory and the decode cache.
+#define CORE_BEGIN offsetof(Chip8, PC)
+#define CORE_END offsetof(Chip8, decoded)
+
+struct Chip8RunAhead {
+    uint32_t frames;
+    Chip8 ahead;
+    // ahead.M and ahead.decoded were copied from a machine whose generation
+    // and memory_writes were synced_generation and synced_writes. The decode
+    // cache only depends on M, so while neither side writes memory, the copy's
+    // entries stay as good as the original's.
+    bool synced;
+    uint32_t synced_generation;
+    uint32_t synced_writes;
+    Chip8RunAheadStats stats;
+};
+
+Chip8RunAhead *chip8_run_ahead_create(uint32_t frames) {
+    Chip8RunAhead *ra = new Chip8RunAhead();
+    ra->frames = frames;
+    ra->synced = false;
+    ra->synced_generation = 0;
+    ra->synced_writes = 0;
+    ra->stats = Chip8RunAheadStats();
+    return ra;
+}
+
+void chip8_run_ahead_destroy(Chip8RunAhead *ra) {
+    delete ra;
+}
+
+uint32_t chip8_run_ahead_frames(const Chip8RunAhead *ra) {
+    return ra->frames;
+}
+
+Chip8RunAheadStats chip8_run_ahead_stats(const Chip8RunAhead *ra) {
+    return ra->stats;
+}
+
+const Chip8 *chip8_run_ahead(Chip8RunAhead *ra, const Chip8 *c8, const bool keys[CHIP8_NUM_KEYS]) {
+    const auto start = std::chrono::steady_clock::now();
+    Chip8 *ahead = &ra->ahead;
+    if (ra->synced && c8->generation == ra->synced_generation && c8->memory_writes == ra->synced_writes &&
+        ahead->memory_writes == ra->synced_writes) {
+        memcpy((uint8_t *)ahead + CORE_BEGIN, (const uint8_t *)c8 + CORE_BEGIN, CORE_END - CORE_BEGIN);
+    }
+    else {
+        memcpy(ahead, c8, sizeof(*ahead));
+        ra->synced = true;
+        ra->synced_generation = c8->generation;
+        ra->synced_writes = c8->memory_writes;
+        ra->stats.full_copies++;
+    }
+    // Speculative instructions are not the program's; keep them out of its profile.
+    ahead->profile = NULL;
+    const uint64_t cycles_before = ahead->cycles;
+    for (uint32_t frame = 0; frame < ra->frames; ++frame) chip8_machine_run(ahead, ahead->cycle_counter, keys);
+
+    ra->stats.calls++;
+    ra->stats.cycles += ahead->cycles - cycles_before;
+    ra->stats.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return ahead;
+}
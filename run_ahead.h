@@ -0,0 +1,29 @@
+#pragma once
+
+#include "chip8.h"
+
+// Run-ahead: each frame, a copy of the machine is run `frames` frames into the
+// future with the current keys and its screen is shown instead of the real
+// one. Programs that react to a key within a frame or two then appear to react
+// immediately. The real machine is never touched, so nothing has to be rolled
+// back and sound, input logs and recordings stay on the real timeline.
+//
+// The copy is kept between frames. Only the registers, timers and screen are
+// refreshed unless either machine has written memory since the last full copy,
+// so most frames cost a few hundred bytes of copying plus the extra emulation.
+struct Chip8RunAhead;
+
+struct Chip8RunAheadStats {
+    uint64_t calls;
+    uint64_t cycles; // speculatively executed
+    uint64_t full_copies; // calls that had to copy memory and the decode cache
+    uint64_t ns; // spent in chip8_run_ahead
+};
+
+Chip8RunAhead *chip8_run_ahead_create(uint32_t frames);
+void chip8_run_ahead_destroy(Chip8RunAhead *ra);
+// Call at a frame boundary. Returns the machine as it will be `frames` frames
+// from now if keys stay as they are. Valid until the next call.
+const Chip8 *chip8_run_ahead(Chip8RunAhead *ra, const Chip8 *c8, const bool keys[CHIP8_NUM_KEYS]);
+uint32_t chip8_run_ahead_frames(const Chip8RunAhead *ra);
+Chip8RunAheadStats chip8_run_ahead_stats(const Chip8RunAhead *ra);
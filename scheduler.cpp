@@ -0,0 +1,64 @@
+#include "scheduler.h"
+#include "chip8.h"
+
+#include <thread>
+
+typedef std::chrono::steady_clock Clock;
+
+static const Clock::duration frame_duration =
+    std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / CHIP8_TIMER_HZ));
+
+// Sleeping is only trusted up to this close to the deadline; the rest is spun.
+static const Clock::duration spin_margin = std::chrono::microseconds(1500);
+
+// Once the host falls this far behind, catching up is abandoned instead of
+// running a burst of frames.
+static const Clock::duration max_lag = frame_duration * 4;
+
+// Upper bound on the uncapped batch, so a host that runs frames faster than
+// the clock can measure never doubles it until it wraps to 0.
+#define MAX_UNCAPPED_FRAMES 1024
+
+void scheduler_init(Scheduler *s, SchedulerMode mode, uint32_t speed) {
+    s->uncapped_frames = 1;
+    s->frame_start = Clock::now();
+    s->deadline = s->frame_start + frame_duration;
+    scheduler_set_mode(s, mode, speed);
+}
+
+void scheduler_set_mode(Scheduler *s, SchedulerMode mode, uint32_t speed) {
+    s->mode = mode;
+    s->speed = speed > 0 ? speed : 1;
+}
+
+uint32_t scheduler_frames_to_run(Scheduler *s) {
+    s->frame_start = Clock::now();
+    switch (s->mode) {
+        case SCHEDULER_REALTIME: return 1;
+        case SCHEDULER_MULTIPLIER: return s->speed;
+        case SCHEDULER_UNCAPPED: return s->uncapped_frames;
+    }
+    return 1;
+}
+
+void scheduler_wait(Scheduler *s) {
+    Clock::time_point now = Clock::now();
+
+    if (s->mode == SCHEDULER_UNCAPPED) {
+        // Grow or shrink the batch so that one batch takes about one host frame.
+        Clock::duration elapsed = now - s->frame_start;
+        if (elapsed < frame_duration / 2 && s->uncapped_frames < MAX_UNCAPPED_FRAMES) s->uncapped_frames *= 2;
+        else if (elapsed > frame_duration && s->uncapped_frames > 1) s->uncapped_frames /= 2;
+        s->deadline = now + frame_duration;
+        return;
+    }
+
+    if (now - s->deadline > max_lag) {
+        s->deadline = now + frame_duration;
+        return;
+    }
+
+    if (s->deadline - now > spin_margin) std::this_thread::sleep_until(s->deadline - spin_margin);
+    while (Clock::now() < s->deadline) std::this_thread::yield();
+    s->deadline += frame_duration;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+enum SchedulerMode {
+    SCHEDULER_REALTIME, // one emulated frame per 1/60 s
+    SCHEDULER_MULTIPLIER, // `speed` emulated frames per 1/60 s
+    SCHEDULER_UNCAPPED, // as many frames as the host can run, presenting at 60 Hz
+};
+
+// Paces a host loop that runs whole emulated frames in one burst and then waits
+// for the next 60 Hz deadline on a high-resolution clock.
+struct Scheduler {
+    SchedulerMode mode;
+    uint32_t speed;
+    uint32_t uncapped_frames; // adaptive batch size in uncapped mode
+    std::chrono::steady_clock::time_point frame_start;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+void scheduler_init(Scheduler *s, SchedulerMode mode, uint32_t speed);
+void scheduler_set_mode(Scheduler *s, SchedulerMode mode, uint32_t speed);
+// Number of emulated frames to run before the next present.
+uint32_t scheduler_frames_to_run(Scheduler *s);
+// Waits for the next host frame deadline. Returns immediately in uncapped mode.
+void scheduler_wait(Scheduler *s);
@@ -0,0 +1,147 @@
+// chip8_search: explores which screens a program can reach with which input,
+// breadth first over all cores. See state_search.h.
+
+#include "chip8.h"
+#include "input_log.h"
+#include "rom.h"
+#include "state_search.h"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_search [options] path/to/program\n"
+        "  --frames N     frames each input is held (default 4)\n"
+        "  --depth N      inputs in a row to try, 0 = until nothing new (default 0)\n"
+        "  --max-states N stop after the level that finds N distinct states\n"
+        "  --visited-mb N memory for the visited set, 8 bytes per state (default 256)\n"
+        "  --keys LIST    hex digits of the keys to try one at a time besides no key\n"
+        "                 (default: all 16)\n"
+        "  --threads N    worker threads (default: all cores)\n"
+        "  --seed N       PRNG seed, hex (default %08x)\n"
+        "  --quirks Q     legacy (default), vip, chip48 or schip\n"
+        "  --logs DIR     write an input log per distinct screen to DIR, replayable\n"
+        "                 with chip8_headless --input\n",
+        CHIP8_DEFAULT_SEED);
+}
+
+static bool write_logs(const Search *s, const char *dir, const Rom *rom, const SearchConfig *config) {
+    const uint32_t seed = config->seed ? config->seed : CHIP8_DEFAULT_SEED;
+    const uint32_t cycles_per_frame = rom->image.cycles_per_timer;
+    std::vector<uint16_t> inputs;
+    for (uint32_t i = 0; i < search_screens(s); ++i) {
+        const uint64_t hash = chip8_screen_hash(search_screen(s, i));
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.txt", (unsigned long long)hash);
+        const std::string path = std::string(dir) + name;
+
+        inputs.resize(search_screen_inputs(s, i, NULL));
+        search_screen_inputs(s, i, inputs.data());
+        InputRecorder recorder;
+        if (!input_recorder_open(&recorder, path.c_str(), seed, cycles_per_frame, rom->quirks)) return false;
+        fprintf(recorder.file, "# run --frames %u to reach screen hash %016llx\n",
+                (uint32_t)inputs.size() * config->frames_per_input, (unsigned long long)hash);
+        for (size_t step = 0; step < inputs.size(); ++step) {
+            bool keys[CHIP8_NUM_KEYS];
+            input_mask_to_keys(inputs[step], keys);
+            input_recorder_add(&recorder, (uint64_t)step * config->frames_per_input * cycles_per_frame, keys);
+        }
+        input_recorder_close(&recorder);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    SearchConfig config;
+    search_default_config(&config);
+    uint32_t quirks = CHIP8_NUM_QUIRKS;
+    const char *program_path = NULL;
+    const char *logs_dir = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--frames") == 0 && has_value) config.frames_per_input = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--depth") == 0 && has_value) config.max_depth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--max-states") == 0 && has_value) config.max_states = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--visited-mb") == 0 && has_value) config.visited_mb = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--threads") == 0 && has_value) config.num_threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--seed") == 0 && has_value) config.seed = strtoul(argv[++i], NULL, 16);
+        else if (strcmp(arg, "--logs") == 0 && has_value) logs_dir = argv[++i];
+        else if (strcmp(arg, "--keys") == 0 && has_value) {
+            const char *keys = argv[++i];
+            config.num_actions = 1;
+            config.actions[0] = 0;
+            for (const char *c = keys; *c; ++c) {
+                char digit[2] = { *c, 0 };
+                char *end;
+                const unsigned long key = strtoul(digit, &end, 16);
+                if (*end || config.num_actions == SEARCH_MAX_ACTIONS) {
+                    usage();
+                    return 1;
+                }
+                config.actions[config.num_actions++] = (uint16_t)(1u << key);
+            }
+        }
+        else if (strcmp(arg, "--quirks") == 0 && has_value) {
+            quirks = chip8_quirks_from_name(argv[++i]);
+            if (quirks == CHIP8_NUM_QUIRKS) {
+                usage();
+                return 1;
+            }
+        }
+        else if (arg[0] != '-' && !program_path) program_path = arg;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!program_path || config.frames_per_input == 0) {
+        usage();
+        return 1;
+    }
+
+    RomCache *rom_cache = rom_cache_create();
+    RomError rom_error;
+    const Rom *rom = rom_cache_load(rom_cache, program_path, quirks, &rom_error);
+    if (!rom) {
+        fprintf(stderr, "Unable to read program %s: %s\n", program_path, rom_error_string(rom_error));
+        return 1;
+    }
+    Search *s = search_create(rom, &config);
+
+    printf("%5s %12s %12s %12s %10s %12s %14s\n", "depth", "states", "frontier", "bytes/state", "screens", "dropped", "states/s");
+    while (search_step(s)) {
+        const SearchStats stats = search_stats(s);
+        printf("%5u %12llu %12llu %12.0f %10llu %12llu %14.0f\n", stats.depth, (unsigned long long)stats.states,
+               (unsigned long long)stats.frontier, stats.frontier ? (double)stats.frontier_bytes / stats.frontier : 0.0,
+               (unsigned long long)stats.screens, (unsigned long long)stats.dropped,
+               stats.seconds > 0 ? stats.expanded / stats.seconds : 0.0);
+        fflush(stdout);
+    }
+
+    const SearchStats stats = search_stats(s);
+    printf("threads:          %u\n", search_threads(s));
+    printf("seconds:          %.3f\n", stats.seconds);
+    printf("states expanded:  %llu\n", (unsigned long long)stats.expanded);
+    printf("states/sec:       %.0f\n", stats.seconds > 0 ? stats.expanded / stats.seconds : 0.0);
+    printf("distinct states:  %llu\n", (unsigned long long)stats.states);
+    printf("duplicates:       %llu\n", (unsigned long long)stats.duplicates);
+    printf("dropped:          %llu\n", (unsigned long long)stats.dropped);
+    printf("faulted:          %llu\n", (unsigned long long)stats.faults);
+    printf("not forked:       %llu\n", (unsigned long long)stats.unforked);
+    printf("distinct screens: %llu\n", (unsigned long long)stats.screens);
+
+    int result = 0;
+    if (logs_dir && !write_logs(s, logs_dir, rom, &config)) {
+        fprintf(stderr, "Unable to write input logs to %s\n", logs_dir);
+        result = 1;
+    }
+    search_destroy(s);
+    rom_cache_destroy(rom_cache);
+    return result;
+}
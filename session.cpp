@@ -0,0 +1,341 @@
+#include "session.h"
+#include "delta.h"
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#define SCREEN_BYTES (CHIP8_SCR_H * CHIP8_SCR_W / 8)
+#define HEADER_BYTES 16
+#define TRAILER_BYTES 12
+#define MAX_VARINT_BYTES 10
+#define WRITE_BUFFER_BYTES 65536 // records are collected and written in blocks of about this size
+#define RECORD_KEYFRAME 'K'
+#define RECORD_DELTA 'D'
+#define RECORD_INDEX 'I'
+
+struct SessionKey {
+    uint64_t frame;
+    uint64_t offset; // of the keyframe's record in the file
+};
+
+static void serialize_screen(const uint64_t screen[CHIP8_SCR_H], uint8_t out[SCREEN_BYTES]) {
+    // Spelled out so compilers merge the stores into one byte-swapped store.
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        const uint64_t bits = screen[row];
+        uint8_t *o = out + row * 8;
+        o[0] = (uint8_t)(bits >> 56);
+        o[1] = (uint8_t)(bits >> 48);
+        o[2] = (uint8_t)(bits >> 40);
+        o[3] = (uint8_t)(bits >> 32);
+        o[4] = (uint8_t)(bits >> 24);
+        o[5] = (uint8_t)(bits >> 16);
+        o[6] = (uint8_t)(bits >> 8);
+        o[7] = (uint8_t)bits;
+    }
+}
+
+static void deserialize_screen(const uint8_t in[SCREEN_BYTES], uint64_t screen[CHIP8_SCR_H]) {
+    for (uint32_t row = 0; row < CHIP8_SCR_H; ++row) {
+        uint64_t bits = 0;
+        for (uint32_t byte = 0; byte < 8; ++byte) bits = (bits << 8) | in[row * 8 + byte];
+        screen[row] = bits;
+    }
+}
+
+static uint8_t *write_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static bool read_varint(const std::vector<uint8_t> &in, uint64_t end, uint64_t *pos, uint64_t *value) {
+    uint64_t result = 0;
+    for (uint32_t shift = 0; shift < 7 * MAX_VARINT_BYTES; shift += 7) {
+        if (*pos >= end) return false;
+        uint8_t byte = in[(*pos)++];
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void put_le(uint8_t *p, uint64_t value, uint32_t bytes) {
+    for (uint32_t i = 0; i < bytes; ++i) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t *p, uint32_t bytes) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < bytes; ++i) value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+struct SessionWriter {
+    FILE *file;
+    bool ok;
+    uint64_t offset; // bytes written so far
+    uint32_t keyframe_interval;
+    uint64_t frames;
+    uint64_t prev_screen[CHIP8_SCR_H];
+    uint8_t prev[SCREEN_BYTES];
+    uint8_t cur[SCREEN_BYTES];
+    std::vector<uint8_t> buffer;
+    size_t buffered;
+    std::vector<SessionKey> keyframes;
+};
+
+static void flush(SessionWriter *w) {
+    if (fwrite(w->buffer.data(), 1, w->buffered, w->file) != w->buffered) w->ok = false;
+    w->buffered = 0;
+}
+
+// Reserves room for size bytes at the end of the buffer.
+static uint8_t *reserve(SessionWriter *w, size_t size) {
+    if (w->buffered + size > w->buffer.size()) flush(w);
+    if (size > w->buffer.size()) w->buffer.resize(size);
+    return w->buffer.data() + w->buffered;
+}
+
+static void commit(SessionWriter *w, size_t size) {
+    w->buffered += size;
+    w->offset += size;
+}
+
+static void write_bytes(SessionWriter *w, const uint8_t *data, size_t size) {
+    memcpy(reserve(w, size), data, size);
+    commit(w, size);
+}
+
+SessionWriter *session_writer_create(const char *path, uint32_t cycles_per_frame, uint32_t keyframe_interval) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return NULL;
+    SessionWriter *w = new SessionWriter();
+    w->file = file;
+    w->ok = true;
+    w->offset = 0;
+    w->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    w->frames = 0;
+    w->buffer.resize(WRITE_BUFFER_BYTES);
+    w->buffered = 0;
+
+    uint8_t header[HEADER_BYTES];
+    memcpy(header, SESSION_MAGIC, 4);
+    put_le(header + 4, SESSION_VERSION, 2);
+    put_le(header + 6, 0, 2);
+    put_le(header + 8, cycles_per_frame, 4);
+    put_le(header + 12, w->keyframe_interval, 4);
+    write_bytes(w, header, sizeof(header));
+    return w;
+}
+
+void session_writer_add(SessionWriter *w, const uint64_t screen[CHIP8_SCR_H], uint8_t sound_timer) {
+    const bool keyframe = w->frames % w->keyframe_interval == 0;
+    if (keyframe) {
+        SessionKey key = { w->frames, w->offset };
+        w->keyframes.push_back(key);
+    }
+    w->frames++;
+    // Most frames draw nothing: compare the packed rows before serializing anything.
+    const bool changed = memcmp(screen, w->prev_screen, sizeof(w->prev_screen)) != 0;
+    if (!keyframe && !changed) {
+        uint8_t *record = reserve(w, 3);
+        record[0] = RECORD_DELTA;
+        record[1] = sound_timer;
+        record[2] = 0;
+        commit(w, 3);
+        return;
+    }
+    if (changed) {
+        memcpy(w->prev_screen, screen, sizeof(w->prev_screen));
+        memcpy(w->prev, w->cur, SCREEN_BYTES);
+        serialize_screen(screen, w->cur);
+    }
+
+    // The payload goes behind room for the largest record header and the
+    // header is moved up against it once the size is known.
+    uint8_t *record = reserve(w, 2 + MAX_VARINT_BYTES + delta_max_encoded_size(SCREEN_BYTES));
+    uint8_t *payload = record + 2 + MAX_VARINT_BYTES;
+    const uint32_t size = keyframe ? delta_encode(w->cur, NULL, SCREEN_BYTES, payload) : delta_encode(w->cur, w->prev, SCREEN_BYTES, payload);
+    uint8_t header[2 + MAX_VARINT_BYTES];
+    header[0] = keyframe ? RECORD_KEYFRAME : RECORD_DELTA;
+    header[1] = sound_timer;
+    const uint32_t header_size = (uint32_t)(write_varint(header + 2, size) - header);
+    memcpy(record, header, header_size);
+    memmove(record + header_size, payload, size);
+    commit(w, header_size + size);
+}
+
+bool session_writer_close(SessionWriter *w) {
+    const uint64_t index_offset = w->offset;
+    std::vector<uint8_t> index(1 + MAX_VARINT_BYTES * (2 + 2 * w->keyframes.size()));
+    uint8_t *o = index.data();
+    *o++ = RECORD_INDEX;
+    o = write_varint(o, w->frames);
+    o = write_varint(o, w->keyframes.size());
+    for (const SessionKey &key : w->keyframes) {
+        o = write_varint(o, key.frame);
+        o = write_varint(o, key.offset);
+    }
+    write_bytes(w, index.data(), o - index.data());
+
+    uint8_t trailer[TRAILER_BYTES];
+    put_le(trailer, index_offset, 8);
+    memcpy(trailer + 8, SESSION_TRAILER_MAGIC, 4);
+    write_bytes(w, trailer, sizeof(trailer));
+    flush(w);
+
+    bool ok = w->ok;
+    if (fclose(w->file) != 0) ok = false;
+    delete w;
+    return ok;
+}
+
+struct SessionReader {
+    std::vector<uint8_t> data;
+    uint32_t cycles_per_frame;
+    uint64_t records_end; // where the record stream stops: the index, or past the last complete record
+    uint64_t frames;
+    std::vector<SessionKey> keyframes;
+
+    // Decoder position: `screen` holds frame next_frame - 1, the record of
+    // next_frame starts at next_offset. next_frame == 0 = nothing decoded yet.
+    uint64_t next_frame;
+    uint64_t next_offset;
+    uint8_t screen[SCREEN_BYTES];
+    uint8_t sound_timer;
+};
+
+struct SessionRecord {
+    uint8_t type;
+    uint8_t sound_timer;
+    uint64_t payload; // offset
+    uint64_t size;
+    uint64_t next; // offset of the following record
+};
+
+static bool parse_record(const SessionReader *r, uint64_t offset, SessionRecord *record) {
+    if (offset + 2 > r->records_end) return false;
+    record->type = r->data[offset];
+    record->sound_timer = r->data[offset + 1];
+    if (record->type != RECORD_KEYFRAME && record->type != RECORD_DELTA) return false;
+    uint64_t pos = offset + 2;
+    if (!read_varint(r->data, r->records_end, &pos, &record->size)) return false;
+    if (record->size > r->records_end - pos) return false;
+    record->payload = pos;
+    record->next = pos + record->size;
+    return true;
+}
+
+static bool parse_index(SessionReader *r) {
+    const uint64_t size = r->data.size();
+    if (size < HEADER_BYTES + TRAILER_BYTES) return false;
+    if (memcmp(&r->data[size - 4], SESSION_TRAILER_MAGIC, 4) != 0) return false;
+    const uint64_t index_offset = get_le(&r->data[size - TRAILER_BYTES], 8);
+    if (index_offset < HEADER_BYTES || index_offset >= size - TRAILER_BYTES) return false;
+    if (r->data[index_offset] != RECORD_INDEX) return false;
+
+    const uint64_t end = size - TRAILER_BYTES;
+    uint64_t pos = index_offset + 1;
+    uint64_t count;
+    if (!read_varint(r->data, end, &pos, &r->frames) || !read_varint(r->data, end, &pos, &count)) return false;
+    if (count > end - pos) return false;
+    r->keyframes.resize(count);
+    for (SessionKey &key : r->keyframes) {
+        if (!read_varint(r->data, end, &pos, &key.frame) || !read_varint(r->data, end, &pos, &key.offset)) return false;
+        if (key.offset >= index_offset || key.frame >= r->frames) return false;
+    }
+    r->records_end = index_offset;
+    return true;
+}
+
+// Without an index every record is visited once to find the keyframes.
+static void scan_records(SessionReader *r) {
+    r->records_end = r->data.size();
+    r->frames = 0;
+    r->keyframes.clear();
+    uint64_t offset = HEADER_BYTES;
+    SessionRecord record;
+    while (parse_record(r, offset, &record)) {
+        if (record.type == RECORD_KEYFRAME) {
+            SessionKey key = { r->frames, offset };
+            r->keyframes.push_back(key);
+        }
+        r->frames++;
+        offset = record.next;
+    }
+    r->records_end = offset;
+}
+
+SessionReader *session_reader_open(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    SessionReader *r = new SessionReader();
+    r->data.resize(size > 0 ? size : 0);
+    bool ok = fread(r->data.data(), 1, r->data.size(), file) == r->data.size();
+    fclose(file);
+    ok = ok && r->data.size() >= HEADER_BYTES && memcmp(r->data.data(), SESSION_MAGIC, 4) == 0 &&
+        get_le(&r->data[4], 2) == SESSION_VERSION;
+    if (!ok) {
+        delete r;
+        return NULL;
+    }
+    r->cycles_per_frame = (uint32_t)get_le(&r->data[8], 4);
+    if (!parse_index(r)) scan_records(r);
+    // A stream always starts with a keyframe.
+    if (r->frames > 0 && (r->keyframes.empty() || r->keyframes[0].frame != 0)) r->frames = 0;
+    r->next_frame = 0;
+    r->next_offset = 0;
+    return r;
+}
+
+void session_reader_close(SessionReader *r) {
+    delete r;
+}
+
+uint64_t session_reader_frames(const SessionReader *r) {
+    return r->frames;
+}
+
+uint32_t session_reader_keyframes(const SessionReader *r) {
+    return (uint32_t)r->keyframes.size();
+}
+
+uint32_t session_reader_cycles_per_frame(const SessionReader *r) {
+    return r->cycles_per_frame;
+}
+
+bool session_reader_frame(SessionReader *r, uint64_t frame, SessionFrame *out) {
+    if (frame >= r->frames) return false;
+    if (r->next_frame != frame + 1) {
+        // Continue from where the decoder is unless a keyframe comes closer.
+        SessionKey probe = { frame, 0 };
+        std::vector<SessionKey>::const_iterator key = std::upper_bound(r->keyframes.begin(), r->keyframes.end(), probe,
+            [](const SessionKey &a, const SessionKey &b) { return a.frame < b.frame; }) - 1;
+        if (r->next_frame == 0 || r->next_frame > frame || key->frame >= r->next_frame) {
+            r->next_frame = key->frame;
+            r->next_offset = key->offset;
+        }
+        while (r->next_frame <= frame) {
+            SessionRecord record;
+            if (!parse_record(r, r->next_offset, &record)) return false;
+            const uint8_t *ref = record.type == RECORD_KEYFRAME ? NULL : r->screen;
+            if (!delta_decode(&r->data[record.payload], (uint32_t)record.size, ref, r->screen, SCREEN_BYTES)) return false;
+            r->sound_timer = record.sound_timer;
+            r->next_frame++;
+            r->next_offset = record.next;
+        }
+    }
+    deserialize_screen(r->screen, out->screen);
+    out->sound_timer = r->sound_timer;
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Session recording: the screen and sound timer of a machine, one record per
+// frame, written as a stream while the session runs.
+//
+//     header   "C8SS", u16 version, u16 reserved, u32 cycles per frame, u32 keyframe interval
+//     record   u8 'K' or 'D', u8 sound timer, varint size, size bytes of delta_encode output
+//     ...
+//     index    u8 'I', varint frames, varint count, count x (varint frame, varint file offset)
+//     trailer  u64 offset of the index, "C8SX"
+//
+// A screen is 32 rows of 8 bytes, leftmost pixel in the top bit of the first
+// byte. 'K' records are coded against an empty screen and start a group,
+// 'D' records against the frame before. The index lists the keyframes and is
+// only written on close; a file without one, say from a crashed session, is
+// still read up to its last complete record. Integers are little-endian,
+// varints 7 bits per byte, low bits first.
+
+#define SESSION_MAGIC "C8SS"
+#define SESSION_TRAILER_MAGIC "C8SX"
+#define SESSION_VERSION 1
+#define SESSION_DEFAULT_KEYFRAME_INTERVAL 600 // frames, ten seconds at 60 Hz
+
+struct SessionWriter;
+
+// NULL if the file cannot be created.
+SessionWriter *session_writer_create(const char *path, uint32_t cycles_per_frame, uint32_t keyframe_interval);
+// Appends one frame. Cheap enough to call for every frame of every instance:
+// an unchanged screen costs three bytes and a memcmp.
+void session_writer_add(SessionWriter *w, const uint64_t screen[CHIP8_SCR_H], uint8_t sound_timer);
+// Writes the index and closes the file. Returns false if any write failed.
+bool session_writer_close(SessionWriter *w);
+
+struct SessionFrame {
+    uint64_t screen[CHIP8_SCR_H];
+    uint8_t sound_timer;
+};
+
+struct SessionReader;
+
+// NULL if the file cannot be read or is not a session.
+SessionReader *session_reader_open(const char *path);
+void session_reader_close(SessionReader *r);
+uint64_t session_reader_frames(const SessionReader *r);
+uint32_t session_reader_keyframes(const SessionReader *r);
+uint32_t session_reader_cycles_per_frame(const SessionReader *r);
+// Decodes frame `frame`. Reading frames in order decodes one record per call;
+// anything else starts over from the nearest keyframe before it. Returns false
+// past the end or on a malformed record.
+bool session_reader_frame(SessionReader *r, uint64_t frame, SessionFrame *out);
@@ -0,0 +1,113 @@
+// chip8_session: inspects session recordings and exports their frames.
+// See session.h for the format.
+
+#include "chip8.h"
+#include "render.h"
+#include "session.h"
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: chip8_session info FILE\n"
+        "       chip8_session export [options] FILE PREFIX\n"
+        "  --from N       first frame to export (default 0)\n"
+        "  --to N         one past the last frame to export (default: all)\n"
+        "  --scale N      pixel size (default 1)\n"
+        "Frames are numbered from 0 but written after they ran, so frame N goes to\n"
+        "PREFIX<N+1>.ppm, the name chip8_headless --dump-frames gives the same screen.\n");
+}
+
+static int info(SessionReader *r, const char *path) {
+    const uint64_t frames = session_reader_frames(r);
+    FILE *file = fopen(path, "rb");
+    long bytes = 0;
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        bytes = ftell(file);
+        fclose(file);
+    }
+    printf("frames:           %llu\n", (unsigned long long)frames);
+    printf("keyframes:        %u\n", session_reader_keyframes(r));
+    printf("cycles/frame:     %u\n", session_reader_cycles_per_frame(r));
+    printf("bytes:            %ld\n", bytes);
+    printf("bytes/frame:      %.2f\n", frames > 0 ? (double)bytes / frames : 0.0);
+
+    SessionFrame frame = {};
+    uint32_t beeping = 0;
+    for (uint64_t i = 0; i < frames; ++i) {
+        if (!session_reader_frame(r, i, &frame)) {
+            fprintf(stderr, "Frame %llu is malformed\n", (unsigned long long)i);
+            return 1;
+        }
+        beeping += frame.sound_timer > 0;
+    }
+    printf("beeping frames:   %u\n", beeping);
+    printf("last screen hash: %016llx\n", (unsigned long long)chip8_screen_hash(frame.screen));
+    return 0;
+}
+
+static int export_frames(SessionReader *r, const char *prefix, uint64_t from, uint64_t to, uint32_t scale) {
+    const uint64_t frames = session_reader_frames(r);
+    if (to > frames) to = frames;
+    RenderSink *sink = render_ppm_sink_create(prefix, scale);
+    std::vector<uint32_t> pixels(CHIP8_SCR_W * CHIP8_SCR_H * scale * scale);
+    int result = 0;
+    for (uint64_t i = from; i < to; ++i) {
+        SessionFrame frame;
+        if (!session_reader_frame(r, i, &frame)) {
+            fprintf(stderr, "Frame %llu is malformed\n", (unsigned long long)i);
+            result = 1;
+            break;
+        }
+        render_expand(frame.screen, scale, sink->on_color, sink->off_color, pixels.data());
+        // Recorded after the frame ran, so numbered by frames completed like --dump-frames.
+        sink->present(sink, pixels.data(), CHIP8_SCR_W * scale, CHIP8_SCR_H * scale, i + 1);
+    }
+    sink->destroy(sink);
+    if (result == 0) printf("exported %llu frames\n", (unsigned long long)(to > from ? to - from : 0));
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "info") != 0 && strcmp(argv[1], "export") != 0)) {
+        usage();
+        return 1;
+    }
+    const bool is_export = strcmp(argv[1], "export") == 0;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint32_t scale = 1;
+    const char *session_path = NULL;
+    const char *prefix = NULL;
+
+    for (int i = 2; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (is_export && strcmp(arg, "--from") == 0 && has_value) from = strtoull(argv[++i], NULL, 10);
+        else if (is_export && strcmp(arg, "--to") == 0 && has_value) to = strtoull(argv[++i], NULL, 10);
+        else if (is_export && strcmp(arg, "--scale") == 0 && has_value) scale = strtoul(argv[++i], NULL, 10);
+        else if (arg[0] != '-' && !session_path) session_path = arg;
+        else if (is_export && arg[0] != '-' && !prefix) prefix = arg;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!session_path || (is_export && (!prefix || scale == 0))) {
+        usage();
+        return 1;
+    }
+
+    SessionReader *r = session_reader_open(session_path);
+    if (!r) {
+        fprintf(stderr, "Unable to read session %s\n", session_path);
+        return 1;
+    }
+    int result = is_export ? export_frames(r, prefix, from, to, scale) : info(r, session_path);
+    session_reader_close(r);
+    return result;
+}
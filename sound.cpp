@@ -1,122 +1,228 @@
 #include "sound.h"
+#include "trace.h"
 
-#include <mmdeviceapi.h>
-#include <audioclient.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <math.h>
-#include <assert.h>
-
-static const CLSID CLSID_MMDeviceEnumerator = __uuidof(MMDeviceEnumerator);
-static const IID IID_IMMDeviceEnumerator = __uuidof(IMMDeviceEnumerator);
-static const IID IID_IAudioClient = __uuidof(IAudioClient);
-static const IID IID_IAudioRenderClient = __uuidof(IAudioRenderClient);
+#include <stdio.h>
+#include <string.h>
 
 #define PI 3.14159265359f
-#define TWO_PI (2.0f*PI)
-#define REFTIMES_PER_SEC 10000000
-#define MAX_BUFFER_DURATION_SEC ((1.0f / 60.0f)*2.0f)
-#define TONE_FREQUENCY 440.0f
-
-static IAudioClient *audio_client;
-static IAudioRenderClient *render_client;
-static UINT32 buffer_frames_count;
-
-static bool playing;
-static float phase;
-static float amplitude;
-static WAVEFORMATEX wave_format;
-
-void sound_init() {
-    HRESULT hr;
-
-    IMMDeviceEnumerator *enumerator;
-    CoInitialize(NULL);
-    hr = CoCreateInstance(CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, IID_IMMDeviceEnumerator, (void**)&enumerator);
-    assert(SUCCEEDED(hr));
+#define TONE_FREQUENCY 440
+#define FADE_SECONDS 0.25f
+#define WAVETABLE_SIZE 256 // one period of the tone, indexed by the top 8 bits of the phase
+#define FULL_AMPLITUDE (1 << 16)
+#define QUEUE_SIZE 1024 // events, a power of two
+#define BLOCK_SAMPLES 512
+#define IDLE_SLEEP_MS 1
+
+struct SoundEvent {
+    uint64_t cycle;
+    bool on;
+};
+
+struct Sound {
+    SoundSink *sink;
+    uint32_t cycles_per_second;
+    std::thread thread;
+    std::atomic<bool> quit;
+
+    // Single producer, single consumer ring: the emulation thread only moves
+    // head, the synth thread only moves tail. Both count up and wrap at 2^32.
+    SoundEvent queue[QUEUE_SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+
+    // Synth thread only.
+    int16_t wavetable[WAVETABLE_SIZE];
+    uint32_t phase; // 32-bit fixed point fraction of a period
+    uint32_t phase_step;
+    int32_t amplitude; // 0..FULL_AMPLITUDE
+    int32_t amplitude_step; // per sample while fading in or out
+    bool on;
+    uint64_t samples; // rendered since sound_create
+    int16_t block[BLOCK_SAMPLES];
+    uint32_t block_fill;
+};
+
+// Renders count samples into out. Fixed point throughout, so the output is the
+// same on every host.
+static void render_block(Sound *s, int16_t *out, uint32_t count) {
+    const int32_t target = s->on ? FULL_AMPLITUDE : 0;
+    if (!s->on && s->amplitude == 0) {
+        memset(out, 0, count * sizeof(int16_t));
+        s->phase += s->phase_step * count;
+        return;
+    }
+    if (s->amplitude == target) {
+        for (uint32_t i = 0; i < count; ++i) {
+            out[i] = s->wavetable[s->phase >> 24];
+            s->phase += s->phase_step;
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i] = (int16_t)((s->wavetable[s->phase >> 24] * s->amplitude) >> 16);
+        s->phase += s->phase_step;
+        if (s->on) {
+            s->amplitude += s->amplitude_step;
+            if (s->amplitude > FULL_AMPLITUDE) s->amplitude = FULL_AMPLITUDE;
+        }
+        else {
+            s->amplitude -= s->amplitude_step;
+            if (s->amplitude < 0) s->amplitude = 0;
+        }
+    }
+}
 
-    IMMDevice *device;
-    hr = enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
-    assert(SUCCEEDED(hr));
+static void flush(Sound *s) {
+    if (s->block_fill == 0) return;
+    const uint64_t start = trace_begin();
+    s->sink->write(s->sink, s->block, s->block_fill);
+    trace_span(TRACE_AUDIO_WRITE, start, s->block_fill);
+    s->block_fill = 0;
+}
 
-    hr = device->Activate(IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&audio_client);
-    assert(SUCCEEDED(hr));
+// Renders with the current beeper state up to sample `end`.
+static void render_until(Sound *s, uint64_t end) {
+    while (s->samples < end) {
+        uint64_t count = BLOCK_SAMPLES - s->block_fill;
+        if (count > end - s->samples) count = end - s->samples;
+        render_block(s, s->block + s->block_fill, (uint32_t)count);
+        s->block_fill += (uint32_t)count;
+        s->samples += count;
+        if (s->block_fill == BLOCK_SAMPLES) flush(s);
+    }
+}
 
-    WAVEFORMATEX *mix_format;
-    hr = audio_client->GetMixFormat(&mix_format);
-    assert(SUCCEEDED(hr));
+static void synth_main(Sound *s) {
+    trace_thread_name("synth");
+    const uint64_t sample_rate = s->sink->sample_rate;
+    for (;;) {
+        // Read quit first: whatever was queued before it was set is drained below.
+        const bool quit = s->quit.load(std::memory_order_acquire);
+        uint32_t tail = s->tail.load(std::memory_order_relaxed);
+        const uint32_t head = s->head.load(std::memory_order_acquire);
+        if (tail == head) {
+            if (quit) break;
+            // Nothing new: pass on what is rendered so a realtime sink is not kept waiting.
+            flush(s);
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+            continue;
+        }
+        for (; tail != head; ++tail) {
+            const SoundEvent *event = &s->queue[tail % QUEUE_SIZE];
+            render_until(s, event->cycle * sample_rate / s->cycles_per_second);
+            s->on = event->on;
+        }
+        s->tail.store(tail, std::memory_order_release);
+    }
+    flush(s);
+}
 
-    memcpy(&wave_format, mix_format, sizeof(WAVEFORMATEX));
-    wave_format.wFormatTag = WAVE_FORMAT_PCM;
-    wave_format.cbSize = 0;
+Sound *sound_create(SoundSink *sink, uint32_t cycles_per_second) {
+    Sound *s = new Sound();
+    s->sink = sink;
+    s->cycles_per_second = cycles_per_second;
+    s->quit = false;
+    s->head = 0;
+    s->tail = 0;
+    for (uint32_t i = 0; i < WAVETABLE_SIZE; ++i) {
+        s->wavetable[i] = (int16_t)lrintf(sinf(2.0f * PI * i / WAVETABLE_SIZE) * 32767.0f);
+    }
+    s->phase = 0;
+    s->phase_step = (uint32_t)(((uint64_t)TONE_FREQUENCY << 32) / sink->sample_rate);
+    s->amplitude = 0;
+    s->amplitude_step = (int32_t)(FULL_AMPLITUDE / (sink->sample_rate * FADE_SECONDS));
+    if (s->amplitude_step == 0) s->amplitude_step = 1;
+    s->on = false;
+    s->samples = 0;
+    s->block_fill = 0;
+    s->thread = std::thread(synth_main, s);
+    return s;
+}
 
-    REFERENCE_TIME duration = (REFERENCE_TIME)(MAX_BUFFER_DURATION_SEC*REFTIMES_PER_SEC);
-    hr = audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, duration, 0, &wave_format, NULL);
-    assert(SUCCEEDED(hr));
+void sound_destroy(Sound *s) {
+    s->quit.store(true, std::memory_order_release);
+    s->thread.join();
+    s->sink->destroy(s->sink);
+    delete s;
+}
 
-    hr = audio_client->GetBufferSize(&buffer_frames_count);
-    assert(SUCCEEDED(hr));
+void sound_set_beeper(Sound *s, uint64_t cycle, bool on) {
+    const uint32_t head = s->head.load(std::memory_order_relaxed);
+    while (head - s->tail.load(std::memory_order_acquire) == QUEUE_SIZE) std::this_thread::yield();
+    s->queue[head % QUEUE_SIZE].cycle = cycle;
+    s->queue[head % QUEUE_SIZE].on = on;
+    s->head.store(head + 1, std::memory_order_release);
+}
 
-    hr = audio_client->GetService(IID_IAudioRenderClient, (void**)&render_client);
-    assert(SUCCEEDED(hr));
+struct WavSink {
+    SoundSink base;
+    FILE *file;
+    uint32_t data_bytes;
+};
 
-    sound_update();
-    audio_client->Start();
+static void put_u16(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
 }
 
-void sound_start() {
-    playing = true;
+static void put_u32(uint8_t *p, uint32_t value) {
+    put_u16(p, value & 0xFFFF);
+    put_u16(p + 2, value >> 16);
 }
 
-void sound_stop() {
-    playing = false;
+// The 44-byte canonical PCM header for `data_bytes` of 16-bit mono samples.
+static void write_wav_header(FILE *file, uint32_t sample_rate, uint32_t data_bytes) {
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, 36 + data_bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, 1); // PCM
+    put_u16(header + 22, 1); // channels
+    put_u32(header + 24, sample_rate);
+    put_u32(header + 28, sample_rate * 2); // bytes per second
+    put_u16(header + 32, 2); // bytes per frame
+    put_u16(header + 34, 16); // bits per sample
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, data_bytes);
+    fwrite(header, 1, sizeof(header), file);
 }
 
-static UINT32 power(UINT32 base, UINT32 exponent) {
-    UINT32 result = 1;
-    while (exponent-- > 0) result *= base;
-    return result;
+static void wav_write(SoundSink *sink, const int16_t *samples, uint32_t count) {
+    WavSink *wav = (WavSink *)sink;
+    uint8_t bytes[2 * BLOCK_SAMPLES];
+    while (count > 0) {
+        const uint32_t n = count < BLOCK_SAMPLES ? count : BLOCK_SAMPLES;
+        for (uint32_t i = 0; i < n; ++i) put_u16(bytes + 2 * i, (uint16_t)samples[i]);
+        fwrite(bytes, 2, n, wav->file);
+        wav->data_bytes += 2 * n;
+        samples += n;
+        count -= n;
+    }
 }
 
-void sound_update() {
-    HRESULT hr;
-
-    UINT32 padding_frames_count;
-    hr = audio_client->GetCurrentPadding(&padding_frames_count);
-    assert(SUCCEEDED(hr));
-
-    UINT32 available_frames_count = buffer_frames_count - padding_frames_count;
-
-    BYTE *buffer;
-    hr = render_client->GetBuffer(available_frames_count, &buffer);
-    assert(SUCCEEDED(hr));
-
-    const float fade_time = 0.25f;
-    const float fade_frames = wave_format.nSamplesPerSec * fade_time;
-    const float amplitude_step = 1.0f / fade_frames;
-    
-    const float phase_increment = (TWO_PI*TONE_FREQUENCY / wave_format.nSamplesPerSec);
-    const INT32 max_sample_val = power(2, wave_format.wBitsPerSample - 1) - 1;
-    const int num_bytes = wave_format.wBitsPerSample / 8;
-
-    for (UINT32 frame = 0, b = 0; frame < available_frames_count; ++frame) {
-        INT32 val = sinf(phase) * amplitude * max_sample_val;
-        for (int channel = 0; channel < wave_format.nChannels; ++channel)
-            for (int byte = 0; byte < num_bytes; ++byte)
-                buffer[b++] = (val >> (byte * 8)) & 0xFF;
-        
-        phase += phase_increment;
-        if (phase >= TWO_PI) phase -= TWO_PI;
-
-        // fade in/out
-        if (playing) {
-            amplitude += amplitude_step;
-            if (amplitude > 1.0f) amplitude = 1.0f;
-        }
-        else {
-            amplitude -= amplitude_step;
-            if (amplitude < 0) amplitude = 0;
-        }
-    }
+static void wav_destroy(SoundSink *sink) {
+    WavSink *wav = (WavSink *)sink;
+    // The sizes are only known now.
+    fseek(wav->file, 0, SEEK_SET);
+    write_wav_header(wav->file, wav->base.sample_rate, wav->data_bytes);
+    fclose(wav->file);
+    delete wav;
+}
 
-    hr = render_client->ReleaseBuffer(available_frames_count, 0);
-    assert(SUCCEEDED(hr));
+SoundSink *sound_wav_sink_create(const char *path, uint32_t sample_rate) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return NULL;
+    write_wav_header(file, sample_rate, 0);
+    WavSink *wav = new WavSink();
+    wav->base.sample_rate = sample_rate;
+    wav->base.write = wav_write;
+    wav->base.destroy = wav_destroy;
+    wav->file = file;
+    wav->data_bytes = 0;
+    return &wav->base;
 }
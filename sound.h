@@ -1,6 +1,35 @@
 #pragma once
 
-void sound_init();
-void sound_start();
-void sound_stop();
-void sound_update();
+#include <stdint.h>
+
+// Beeper audio. The emulation thread reports the beeper state stamped with the
+// machine's cycle count; a synth thread of its own turns those events into
+// samples, a block at a time from a wavetable, and hands them to a sink. The
+// samples only depend on the events, never on host timing.
+
+// Where samples go: mono 16-bit at sample_rate, in blocks of any size.
+struct SoundSink {
+    uint32_t sample_rate;
+    void (*write)(SoundSink *sink, const int16_t *samples, uint32_t count);
+    void (*destroy)(SoundSink *sink);
+};
+
+// Writes a 16-bit mono WAV file. NULL if it cannot be created.
+SoundSink *sound_wav_sink_create(const char *path, uint32_t sample_rate);
+#ifdef _WIN32
+// Plays through WASAPI on the default device. Samples that do not fit in its
+// buffer are dropped rather than holding up the synth thread.
+SoundSink *sound_wasapi_sink_create();
+#endif
+
+struct Sound;
+
+// Takes ownership of sink. cycles_per_second maps machine cycles to sample time.
+Sound *sound_create(SoundSink *sink, uint32_t cycles_per_second);
+// Renders everything reported so far, stops the synth thread and destroys the sink.
+void sound_destroy(Sound *sound);
+// From the emulation thread only: the beeper is `on` from `cycle` on. Samples
+// are rendered up to the latest cycle reported, so a realtime sink wants a
+// report every frame, changed or not. Cycles must not go backwards. Never
+// blocks unless the synth thread is a full queue behind.
+void sound_set_beeper(Sound *sound, uint64_t cycle, bool on);
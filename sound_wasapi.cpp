@@ -0,0 +1,111 @@
+#include "sound.h"
+#include "trace.h"
+
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <string.h>
+#include <assert.h>
+
+static const CLSID CLSID_MMDeviceEnumerator = __uuidof(MMDeviceEnumerator);
+static const IID IID_IMMDeviceEnumerator = __uuidof(IMMDeviceEnumerator);
+static const IID IID_IAudioClient = __uuidof(IAudioClient);
+static const IID IID_IAudioRenderClient = __uuidof(IAudioRenderClient);
+
+#define REFTIMES_PER_SEC 10000000
+#define MAX_BUFFER_DURATION_SEC ((1.0f / 60.0f)*2.0f)
+
+struct WasapiSink {
+    SoundSink base;
+    IAudioClient *audio_client;
+    IAudioRenderClient *render_client;
+    UINT32 buffer_frames_count;
+    WAVEFORMATEX wave_format;
+    bool started; // written to at least once, so an empty buffer means it ran dry
+};
+
+// Runs on the synth thread. Converts mono 16-bit samples to the device's
+// integer format on every channel.
+static void wasapi_write(SoundSink *sink, const int16_t *samples, uint32_t count) {
+    WasapiSink *ws = (WasapiSink *)sink;
+    HRESULT hr;
+
+    UINT32 padding_frames_count;
+    hr = ws->audio_client->GetCurrentPadding(&padding_frames_count);
+    assert(SUCCEEDED(hr));
+
+    if (padding_frames_count == 0 && ws->started) trace_instant(TRACE_AUDIO_UNDERRUN, 0);
+    UINT32 available_frames_count = ws->buffer_frames_count - padding_frames_count;
+    if (count > available_frames_count) {
+        trace_instant(TRACE_AUDIO_DROPPED, count - available_frames_count);
+        count = available_frames_count;
+    }
+    if (count == 0) return;
+    ws->started = true;
+
+    BYTE *buffer;
+    hr = ws->render_client->GetBuffer(count, &buffer);
+    assert(SUCCEEDED(hr));
+
+    const int num_bytes = ws->wave_format.wBitsPerSample / 8;
+    for (UINT32 frame = 0, b = 0; frame < count; ++frame) {
+        INT32 val = (INT32)samples[frame] << (ws->wave_format.wBitsPerSample - 16);
+        for (int channel = 0; channel < ws->wave_format.nChannels; ++channel)
+            for (int byte = 0; byte < num_bytes; ++byte)
+                buffer[b++] = (val >> (byte * 8)) & 0xFF;
+    }
+
+    hr = ws->render_client->ReleaseBuffer(count, 0);
+    assert(SUCCEEDED(hr));
+}
+
+static void wasapi_destroy(SoundSink *sink) {
+    WasapiSink *ws = (WasapiSink *)sink;
+    ws->audio_client->Stop();
+    ws->render_client->Release();
+    ws->audio_client->Release();
+    delete ws;
+}
+
+SoundSink *sound_wasapi_sink_create() {
+    HRESULT hr;
+    WasapiSink *ws = new WasapiSink();
+
+    IMMDeviceEnumerator *enumerator;
+    CoInitialize(NULL);
+    hr = CoCreateInstance(CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, IID_IMMDeviceEnumerator, (void**)&enumerator);
+    assert(SUCCEEDED(hr));
+
+    IMMDevice *device;
+    hr = enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
+    assert(SUCCEEDED(hr));
+
+    hr = device->Activate(IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&ws->audio_client);
+    assert(SUCCEEDED(hr));
+
+    WAVEFORMATEX *mix_format;
+    hr = ws->audio_client->GetMixFormat(&mix_format);
+    assert(SUCCEEDED(hr));
+
+    memcpy(&ws->wave_format, mix_format, sizeof(WAVEFORMATEX));
+    ws->wave_format.wFormatTag = WAVE_FORMAT_PCM;
+    ws->wave_format.cbSize = 0;
+    assert(ws->wave_format.wBitsPerSample >= 16);
+
+    REFERENCE_TIME duration = (REFERENCE_TIME)(MAX_BUFFER_DURATION_SEC*REFTIMES_PER_SEC);
+    hr = ws->audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, duration, 0, &ws->wave_format, NULL);
+    assert(SUCCEEDED(hr));
+
+    hr = ws->audio_client->GetBufferSize(&ws->buffer_frames_count);
+    assert(SUCCEEDED(hr));
+
+    hr = ws->audio_client->GetService(IID_IAudioRenderClient, (void**)&ws->render_client);
+    assert(SUCCEEDED(hr));
+
+    ws->audio_client->Start();
+    ws->started = false;
+
+    ws->base.sample_rate = ws->wave_format.nSamplesPerSec;
+    ws->base.write = wasapi_write;
+    ws->base.destroy = wasapi_destroy;
+    return &ws->base;
+}
@@ -0,0 +1,319 @@
+#include "state_search.h"
+#include "chip8_state.h"
+#include "delta.h"
+#include "hash.h"
+#include "input_log.h"
+#include "rom.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <assert.h>
+#include <string.h>
+
+#define NO_PARENT 0xFFFFFFFFu
+#define MIN_TABLE_SLOTS 1024
+
+enum Insert {
+    INSERT_NEW,
+    INSERT_SEEN,
+    INSERT_FULL,
+};
+
+// Open-addressing set of nonzero 64-bit hashes that threads insert into
+// without locks. Filling stops at 3/4 of the slots so probes stay short and
+// always find an empty slot.
+struct HashSet {
+    std::atomic<uint64_t> *slots;
+    uint64_t mask;
+    uint64_t limit;
+    std::atomic<uint64_t> count;
+};
+
+static void hash_set_init(HashSet *set, uint64_t bytes) {
+    uint64_t slots = MIN_TABLE_SLOTS;
+    while (slots * 2 * sizeof(uint64_t) <= bytes) slots *= 2;
+    set->slots = new std::atomic<uint64_t>[slots]();
+    set->mask = slots - 1;
+    set->limit = slots / 4 * 3;
+    set->count = 0;
+}
+
+static Insert hash_set_insert(HashSet *set, uint64_t hash) {
+    if (hash == 0) hash = 1; // 0 marks an empty slot
+    for (uint64_t i = hash & set->mask;; i = (i + 1) & set->mask) {
+        uint64_t slot = set->slots[i].load(std::memory_order_relaxed);
+        if (slot == hash) return INSERT_SEEN;
+        if (slot != 0) continue;
+        if (set->count.load(std::memory_order_relaxed) >= set->limit) return INSERT_FULL;
+        if (set->slots[i].compare_exchange_strong(slot, hash, std::memory_order_relaxed)) {
+            set->count.fetch_add(1, std::memory_order_relaxed);
+            return INSERT_NEW;
+        }
+        if (slot == hash) return INSERT_SEEN;
+    }
+}
+
+// How a state was reached: the action taken in state `parent` of the level before.
+struct SearchNode {
+    uint32_t parent;
+    uint16_t action;
+};
+
+// A state of the level to expand next.
+struct FrontierEntry {
+    uint32_t node; // in the level's nodes
+    uint32_t size;
+    uint64_t offset; // of its Chip8State, delta-coded against the initial one
+    uint64_t memory_hash; // hash_words of its M
+};
+
+struct FoundScreen {
+    uint64_t screen[CHIP8_SCR_H];
+    uint32_t depth;
+    uint32_t node;
+};
+
+// What one thread produces while expanding a level, merged afterwards.
+struct SearchThread {
+    Chip8 machine;
+    Chip8State parent;
+    Chip8State child;
+    std::vector<uint8_t> encoded; // delta_max_encoded_size(sizeof(Chip8State))
+    std::vector<SearchNode> nodes;
+    std::vector<FrontierEntry> frontier; // node is an index into nodes, offset into data
+    std::vector<uint8_t> data;
+    std::vector<FoundScreen> screens; // node is an index into nodes
+    uint64_t expanded, duplicates, dropped, faults, unforked;
+};
+
+struct Search {
+    SearchConfig config;
+    ThreadPool *pool;
+    Chip8State root;
+    HashSet visited;
+    HashSet screen_set;
+    std::vector<std::vector<SearchNode>> levels; // levels[d] = how each state at depth d was reached
+    std::vector<FrontierEntry> frontier;
+    std::vector<uint8_t> frontier_data;
+    std::vector<FoundScreen> screens;
+    std::vector<SearchThread *> threads;
+    SearchStats stats;
+    bool done;
+};
+
+// Everything the search tells states apart by, given the hash of M.
+static uint64_t state_hash(const Chip8 *c8, uint64_t memory_hash) {
+    uint64_t registers[7] = {};
+    memcpy(&registers[0], c8->V, sizeof(c8->V));
+    memcpy(&registers[2], c8->stack, c8->SP * sizeof(c8->stack[0]));
+    registers[6] = c8->PC | (uint64_t)c8->I << 16 | (uint64_t)c8->SP << 32 |
+                   (uint64_t)c8->delay_timer << 40 | (uint64_t)c8->sound_timer << 48;
+    uint64_t hash = hash_words(c8->screen, sizeof(c8->screen), memory_hash);
+    return hash_words(registers, sizeof(registers), hash);
+}
+
+static void record_screen(HashSet *screen_set, const Chip8 *c8, uint32_t depth, uint32_t node, std::vector<FoundScreen> *screens) {
+    if (hash_set_insert(screen_set, hash_words(c8->screen, sizeof(c8->screen))) != INSERT_NEW) return;
+    FoundScreen found;
+    memcpy(found.screen, c8->screen, sizeof(found.screen));
+    found.depth = depth;
+    found.node = node;
+    screens->push_back(found);
+}
+
+static void expand_state(uint32_t index, uint32_t thread_index, void *user) {
+    Search *s = (Search *)user;
+    SearchThread *t = s->threads[thread_index];
+    const FrontierEntry &entry = s->frontier[index];
+    const bool decoded = delta_decode(s->frontier_data.data() + entry.offset, entry.size, (const uint8_t *)&s->root,
+                                      (uint8_t *)&t->parent, sizeof(t->parent));
+    assert(decoded);
+    (void)decoded;
+
+    Chip8 *c8 = &t->machine;
+    const uint32_t depth = s->stats.depth + 1;
+    uint32_t num_actions = s->config.num_actions;
+    for (uint32_t a = 0; a < num_actions; ++a) {
+        const uint16_t action = s->config.actions[a];
+        const bool loaded = chip8_load_state(c8, &t->parent);
+        assert(loaded);
+        (void)loaded;
+        const uint32_t writes = c8->memory_writes;
+        const uint32_t reads = c8->key_reads;
+        bool keys[CHIP8_NUM_KEYS];
+        input_mask_to_keys(action, keys);
+        for (uint32_t frame = 0; frame < s->config.frames_per_input; ++frame) chip8_machine_run(c8, c8->cycle_counter, keys);
+        t->expanded++;
+        // Every action runs the same up to the first key read, so if the first
+        // one got through its frames without any, the rest would end here too.
+        if (a == 0 && c8->key_reads == reads) {
+            num_actions = 1;
+            t->unforked++;
+        }
+
+        // Most frames store nothing, and hashing M dominates otherwise.
+        const uint64_t memory_hash = c8->memory_writes == writes ? entry.memory_hash : hash_words(c8->M, sizeof(c8->M));
+        const Insert insert = hash_set_insert(&s->visited, state_hash(c8, memory_hash));
+        if (insert == INSERT_SEEN) {
+            t->duplicates++;
+            continue;
+        }
+        if (insert == INSERT_FULL) {
+            t->dropped++;
+            continue;
+        }
+        const uint32_t node = (uint32_t)t->nodes.size();
+        SearchNode reached = { entry.node, action };
+        t->nodes.push_back(reached);
+        record_screen(&s->screen_set, c8, depth, node, &t->screens);
+        if (c8->fault) {
+            t->faults++;
+            continue;
+        }
+        chip8_save_state(c8, &t->child);
+        FrontierEntry next;
+        next.node = node;
+        next.size = delta_encode((const uint8_t *)&t->child, (const uint8_t *)&s->root, sizeof(t->child), t->encoded.data());
+        next.offset = t->data.size();
+        next.memory_hash = memory_hash;
+        t->data.insert(t->data.end(), t->encoded.begin(), t->encoded.begin() + next.size);
+        t->frontier.push_back(next);
+    }
+}
+
+void search_default_config(SearchConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->frames_per_input = 4;
+    config->visited_mb = 256;
+}
+
+Search *search_create(const Rom *rom, const SearchConfig *config) {
+    if (config->frames_per_input == 0 || config->num_actions > SEARCH_MAX_ACTIONS) return NULL;
+
+    Search *s = new Search();
+    s->config = *config;
+    if (s->config.num_actions == 0) {
+        s->config.num_actions = CHIP8_NUM_KEYS + 1;
+        s->config.actions[0] = 0;
+        for (uint32_t key = 0; key < CHIP8_NUM_KEYS; ++key) s->config.actions[key + 1] = (uint16_t)(1u << key);
+    }
+    s->pool = thread_pool_create(config->num_threads);
+    const uint64_t visited_bytes = (uint64_t)config->visited_mb << 20;
+    hash_set_init(&s->visited, visited_bytes);
+    hash_set_init(&s->screen_set, visited_bytes / 8);
+    s->stats = SearchStats();
+    s->done = false;
+
+    for (uint32_t i = 0; i < thread_pool_num_threads(s->pool); ++i) {
+        SearchThread *t = new SearchThread();
+        rom_instance_init(rom, &t->machine);
+        t->encoded.resize(delta_max_encoded_size(sizeof(Chip8State)));
+        s->threads.push_back(t);
+    }
+
+    // The search starts from the machine before its first frame.
+    Chip8 *c8 = &s->threads[0]->machine;
+    chip8_machine_seed(c8, config->seed);
+    chip8_save_state(c8, &s->root);
+    const uint64_t memory_hash = hash_words(c8->M, sizeof(c8->M));
+    hash_set_insert(&s->visited, state_hash(c8, memory_hash));
+    s->levels.resize(1);
+    SearchNode root = { NO_PARENT, 0 };
+    s->levels[0].push_back(root);
+    record_screen(&s->screen_set, c8, 0, 0, &s->screens);
+    FrontierEntry entry = { 0, 0, 0, memory_hash };
+    s->frontier.push_back(entry);
+    s->stats.states = 1;
+    s->stats.frontier = 1;
+    s->stats.screens = s->screens.size();
+    return s;
+}
+
+void search_destroy(Search *s) {
+    for (SearchThread *t : s->threads) delete t;
+    delete[] s->visited.slots;
+    delete[] s->screen_set.slots;
+    thread_pool_destroy(s->pool);
+    delete s;
+}
+
+bool search_step(Search *s) {
+    if (s->done) return false;
+    const auto start = std::chrono::steady_clock::now();
+    for (SearchThread *t : s->threads) {
+        t->nodes.clear();
+        t->frontier.clear();
+        t->data.clear();
+        t->screens.clear();
+        t->expanded = t->duplicates = t->dropped = t->faults = t->unforked = 0;
+    }
+    thread_pool_for(s->pool, (uint32_t)s->frontier.size(), expand_state, s);
+
+    // Concatenate what the threads found into the next level.
+    std::vector<SearchNode> level;
+    std::vector<FrontierEntry> frontier;
+    std::vector<uint8_t> data;
+    for (SearchThread *t : s->threads) {
+        const uint32_t node_base = (uint32_t)level.size();
+        const uint64_t data_base = data.size();
+        level.insert(level.end(), t->nodes.begin(), t->nodes.end());
+        data.insert(data.end(), t->data.begin(), t->data.end());
+        for (FrontierEntry entry : t->frontier) {
+            entry.node += node_base;
+            entry.offset += data_base;
+            frontier.push_back(entry);
+        }
+        for (FoundScreen found : t->screens) {
+            found.node += node_base;
+            s->screens.push_back(found);
+        }
+        s->stats.expanded += t->expanded;
+        s->stats.duplicates += t->duplicates;
+        s->stats.dropped += t->dropped;
+        s->stats.faults += t->faults;
+        s->stats.unforked += t->unforked;
+    }
+    s->levels.push_back(std::vector<SearchNode>());
+    s->levels.back().swap(level);
+    s->frontier.swap(frontier);
+    s->frontier_data.swap(data);
+
+    s->stats.depth++;
+    s->stats.states += s->levels.back().size();
+    s->stats.frontier = s->frontier.size();
+    s->stats.frontier_bytes = s->frontier_data.size();
+    s->stats.screens = s->screens.size();
+    s->stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    s->done = s->frontier.empty() || (s->config.max_depth && s->stats.depth >= s->config.max_depth) ||
+              (s->config.max_states && s->stats.states >= s->config.max_states);
+    return true;
+}
+
+SearchStats search_stats(const Search *s) {
+    return s->stats;
+}
+
+uint32_t search_threads(const Search *s) {
+    return thread_pool_num_threads(s->pool);
+}
+
+uint32_t search_screens(const Search *s) {
+    return (uint32_t)s->screens.size();
+}
+
+const uint64_t *search_screen(const Search *s, uint32_t i) {
+    return s->screens[i].screen;
+}
+
+uint32_t search_screen_inputs(const Search *s, uint32_t i, uint16_t *inputs) {
+    const FoundScreen &found = s->screens[i];
+    uint32_t node = found.node;
+    for (uint32_t depth = found.depth; depth > 0; --depth) {
+        const SearchNode &reached = s->levels[depth][node];
+        if (inputs) inputs[depth - 1] = reached.action;
+        node = reached.parent;
+    }
+    return found.depth;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Breadth-first search over the input a program can be given: starting from
+// the program's first frame, every state is forked once per action (a key
+// mask held for frames_per_input frames) and every state not seen before
+// joins the next level. States whose frames never read the keys (Ex9E, ExA1,
+// Fx0A) are only run with the first action, as the rest would end the same.
+// Levels are expanded in parallel on a thread pool.
+//
+// States are identified by a 64-bit hash of memory, registers, timers, stack
+// and screen; the PRNG state and cycle count are left out, so states that only
+// differ in them count as one. Only hashes are kept for visited states, in a
+// fixed-size lock-free table; once it is 3/4 full, new states are dropped
+// rather than stored. The states of the level being expanded are kept
+// delta-coded against the initial state, usually a few hundred bytes each,
+// and of earlier levels only how each state was reached.
+
+#define SEARCH_MAX_ACTIONS 32
+
+struct Rom;
+
+struct SearchConfig {
+    uint32_t frames_per_input; // frames each action is held
+    uint32_t max_depth; // actions in a row, 0 = until nothing new is found
+    uint64_t max_states; // stop after the level that finds this many states, 0 = no limit
+    uint32_t visited_mb; // size of the visited table, 8 bytes per state
+    uint32_t num_threads; // 0 = one per core
+    uint32_t seed; // PRNG seed of the initial state, 0 = CHIP8_DEFAULT_SEED
+    uint32_t num_actions; // 0 = no key and each single key
+    uint16_t actions[SEARCH_MAX_ACTIONS]; // key masks
+};
+
+struct SearchStats {
+    uint32_t depth; // levels expanded
+    uint64_t frontier; // states in the level to expand next
+    uint64_t states; // distinct states found, the initial one included
+    uint64_t expanded; // forks run
+    uint64_t duplicates; // forks that reached a known state
+    uint64_t dropped; // new states lost to a full visited table
+    uint64_t faults; // new states that faulted, which are not expanded
+    uint64_t unforked; // states run with one action because their frames read no keys
+    uint64_t screens; // distinct screens among the states
+    uint64_t frontier_bytes; // encoded size of the level to expand next
+    double seconds; // spent in search_step
+};
+
+struct Search;
+
+void search_default_config(SearchConfig *config);
+// The Rom must outlive the Search. NULL if the config is invalid.
+Search *search_create(const Rom *rom, const SearchConfig *config);
+void search_destroy(Search *s);
+// Expands one level. Returns false, doing nothing, once the search is over.
+bool search_step(Search *s);
+SearchStats search_stats(const Search *s);
+uint32_t search_threads(const Search *s);
+
+// Distinct screens, in the order they were found, each with the shortest
+// action sequence found to reach it.
+uint32_t search_screens(const Search *s);
+const uint64_t *search_screen(const Search *s, uint32_t i);
+// Number of actions leading to screen i; writes them to inputs if not NULL.
+uint32_t search_screen_inputs(const Search *s, uint32_t i, uint16_t *inputs);
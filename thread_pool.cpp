@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <assert.h>
+
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    bool quit;
+    uint64_t generation;
+
+    // Current job, published under mutex together with a new generation.
+    ThreadPoolTask task;
+    void *user;
+    uint32_t count;
+    uint32_t chunk;
+    std::atomic<uint32_t> next_index;
+    uint32_t busy_workers;
+};
+
+static void run_job(ThreadPool *pool, uint32_t thread_index) {
+    for (;;) {
+        uint32_t begin = pool->next_index.fetch_add(pool->chunk, std::memory_order_relaxed);
+        if (begin >= pool->count) break;
+        uint32_t end = begin + pool->chunk;
+        if (end > pool->count) end = pool->count;
+        for (uint32_t i = begin; i < end; ++i) pool->task(i, thread_index, pool->user);
+    }
+}
+
+static void worker_main(ThreadPool *pool, uint32_t thread_index) {
+    uint64_t seen_generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->work_ready.wait(lock, [&] { return pool->quit || pool->generation != seen_generation; });
+            if (pool->quit) return;
+            seen_generation = pool->generation;
+        }
+        run_job(pool, thread_index);
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (--pool->busy_workers == 0) pool->work_done.notify_one();
+        }
+    }
+}
+
+ThreadPool *thread_pool_create(uint32_t num_threads) {
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0) num_threads = 1;
+
+    ThreadPool *pool = new ThreadPool();
+    pool->quit = false;
+    pool->generation = 0;
+    pool->task = nullptr;
+    pool->user = nullptr;
+    pool->count = 0;
+    pool->chunk = 1;
+    pool->next_index = 0;
+    pool->busy_workers = 0;
+    for (uint32_t i = 1; i < num_threads; ++i) pool->workers.emplace_back(worker_main, pool, i);
+    return pool;
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->quit = true;
+    }
+    pool->work_ready.notify_all();
+    for (std::thread &worker : pool->workers) worker.join();
+    delete pool;
+}
+
+uint32_t thread_pool_num_threads(const ThreadPool *pool) {
+    return (uint32_t)pool->workers.size() + 1;
+}
+
+void thread_pool_for(ThreadPool *pool, uint32_t count, ThreadPoolTask task, void *user) {
+    if (count == 0) return;
+
+    const uint32_t num_threads = thread_pool_num_threads(pool);
+    if (num_threads == 1 || count == 1) {
+        for (uint32_t i = 0; i < count; ++i) task(i, 0, user);
+        return;
+    }
+
+    // Hand out indices in chunks: small enough to balance uneven work, large enough
+    // that threads are not all hammering next_index.
+    uint32_t chunk = count / (num_threads * 8);
+    if (chunk == 0) chunk = 1;
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        assert(pool->busy_workers == 0);
+        pool->task = task;
+        pool->user = user;
+        pool->count = count;
+        pool->chunk = chunk;
+        pool->next_index.store(0, std::memory_order_relaxed);
+        pool->busy_workers = (uint32_t)pool->workers.size();
+        pool->generation++;
+    }
+    pool->work_ready.notify_all();
+
+    run_job(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->work_done.wait(lock, [&] { return pool->busy_workers == 0; });
+}
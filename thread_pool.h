@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+struct ThreadPool;
+
+typedef void (*ThreadPoolTask)(uint32_t index, uint32_t thread_index, void *user);
+
+// num_threads == 0 picks one thread per hardware core. The calling thread takes
+// part in every thread_pool_for, so a pool of N threads starts N-1 workers.
+ThreadPool *thread_pool_create(uint32_t num_threads);
+void thread_pool_destroy(ThreadPool *pool);
+uint32_t thread_pool_num_threads(const ThreadPool *pool);
+
+// Calls task(i, thread_index, user) for every i in [0, count) and returns when all calls finished.
+void thread_pool_for(ThreadPool *pool, uint32_t count, ThreadPoolTask task, void *user);
@@ -0,0 +1,257 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RING_MASK (TRACE_RING_SIZE - 1)
+#define MAX_THREAD_NAME 32
+
+struct TraceRecord {
+    uint64_t ns;
+    uint64_t arg;
+    uint32_t duration; // ns, 0 for instants
+    uint16_t event;
+    uint16_t thread;
+};
+
+// Written by its thread only; `written` is published after every record.
+struct TraceRing {
+    TraceRecord records[TRACE_RING_SIZE];
+    std::atomic<uint64_t> written;
+    uint16_t thread;
+    char name[MAX_THREAD_NAME];
+};
+
+static std::atomic<bool> enabled(false);
+static std::mutex rings_mutex;
+static std::vector<TraceRing *> rings; // never freed, a thread's events outlive it
+static thread_local TraceRing *thread_ring;
+static thread_local const char *thread_name;
+
+static const char *const event_names[TRACE_NUM_EVENTS] = {
+    "key", "input", "run", "submit", "present", "wait", "audio write", "audio underrun", "audio dropped",
+};
+// What arg holds, NULL = nothing.
+static const char *const arg_names[TRACE_NUM_EVENTS] = {
+    "mask", "mask", "frame", "frame", "frame", NULL, "samples", NULL, "samples",
+};
+static const bool is_span[TRACE_NUM_EVENTS] = {
+    false, false, true, false, true, true, true, false, false,
+};
+
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_enable(bool on) {
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+bool trace_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void trace_thread_name(const char *name) {
+    thread_name = name;
+    if (thread_ring) snprintf(thread_ring->name, sizeof(thread_ring->name), "%s", name);
+}
+
+static TraceRing *ring() {
+    if (thread_ring) return thread_ring;
+    TraceRing *r = new TraceRing; // not zeroed, this runs inside the first traced event
+    r->written = 0;
+    snprintf(r->name, sizeof(r->name), "%s", thread_name ? thread_name : "thread");
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    r->thread = (uint16_t)rings.size();
+    rings.push_back(r);
+    thread_ring = r;
+    return r;
+}
+
+static void record(TraceEvent event, uint64_t ns, uint64_t duration, uint64_t arg) {
+    TraceRing *r = ring();
+    const uint64_t n = r->written.load(std::memory_order_relaxed);
+    TraceRecord *rec = &r->records[n & RING_MASK];
+    rec->ns = ns;
+    rec->arg = arg;
+    rec->duration = duration > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)duration;
+    rec->event = (uint16_t)event;
+    rec->thread = r->thread;
+    r->written.store(n + 1, std::memory_order_release);
+}
+
+void trace_instant(TraceEvent event, uint64_t arg) {
+    if (!trace_enabled()) return;
+    record(event, trace_now(), 0, arg);
+}
+
+uint64_t trace_begin() {
+    return trace_enabled() ? trace_now() : 0;
+}
+
+void trace_span(TraceEvent event, uint64_t start, uint64_t arg) {
+    if (start == 0 || !trace_enabled()) return;
+    const uint64_t now = trace_now();
+    record(event, start, now - start, arg);
+}
+
+// Every thread's surviving records, by start time.
+static std::vector<TraceRecord> collect(uint64_t *lost) {
+    std::vector<TraceRecord> records;
+    *lost = 0;
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (const TraceRing *r : rings) {
+        const uint64_t written = r->written.load(std::memory_order_acquire);
+        const uint64_t count = written < TRACE_RING_SIZE ? written : TRACE_RING_SIZE;
+        *lost += written - count;
+        for (uint64_t i = written - count; i < written; ++i) records.push_back(r->records[i & RING_MASK]);
+    }
+    std::stable_sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) { return a.ns < b.ns; });
+    return records;
+}
+
+static TracePercentiles percentiles(std::vector<double> values) {
+    TracePercentiles p = {};
+    p.count = values.size();
+    if (values.empty()) return p;
+    std::sort(values.begin(), values.end());
+    p.p50 = values[(values.size() - 1) / 2];
+    p.p99 = values[(values.size() - 1) * 99 / 100];
+    p.max = values.back();
+    return p;
+}
+
+static double ms(uint64_t ns) {
+    return ns * 1e-6;
+}
+
+// Deltas between consecutive times, which need not be sorted.
+static std::vector<double> intervals(std::vector<uint64_t> times) {
+    std::sort(times.begin(), times.end());
+    std::vector<double> deltas;
+    for (size_t i = 1; i < times.size(); ++i) deltas.push_back(ms(times[i] - times[i - 1]));
+    return deltas;
+}
+
+void trace_summarize(TraceSummary *summary) {
+    uint64_t lost;
+    const std::vector<TraceRecord> records = collect(&lost);
+
+    // Key changes waiting for the run that reads them, then for a changed
+    // screen, then for its present (with the screen's frame number).
+    std::vector<uint64_t> to_input, to_submit;
+    std::vector<std::pair<uint64_t, uint64_t>> to_present;
+    std::vector<double> key_to_input, key_to_submit, key_to_present, present, frame_jitter;
+    std::vector<uint64_t> wait_ends, ticks, audio_writes;
+    uint32_t threads = 0;
+    for (const TraceRecord &rec : records) threads = std::max<uint32_t>(threads, rec.thread + 1u);
+    std::vector<uint64_t> last_frame(threads, UINT64_MAX);
+    uint64_t underruns = 0, dropped = 0;
+
+    for (const TraceRecord &rec : records) {
+        const uint64_t end = rec.ns + rec.duration;
+        switch (rec.event) {
+            case TRACE_KEY:
+                to_input.push_back(rec.ns);
+                break;
+            case TRACE_INPUT:
+                for (uint64_t key : to_input) {
+                    key_to_input.push_back(ms(rec.ns - key));
+                    to_submit.push_back(key);
+                }
+                to_input.clear();
+                break;
+            case TRACE_RUN:
+                if (last_frame[rec.thread] != UINT64_MAX && rec.arg > last_frame[rec.thread]) ticks.push_back(end);
+                last_frame[rec.thread] = rec.arg;
+                break;
+            case TRACE_SUBMIT:
+                for (uint64_t key : to_submit) {
+                    key_to_submit.push_back(ms(rec.ns - key));
+                    to_present.push_back(std::make_pair(key, rec.arg));
+                }
+                to_submit.clear();
+                break;
+            case TRACE_PRESENT: {
+                present.push_back(ms(rec.duration));
+                size_t kept = 0;
+                for (size_t i = 0; i < to_present.size(); ++i) {
+                    // Presents can skip screens, so any later one shows this one's effect.
+                    if (to_present[i].second <= rec.arg) key_to_present.push_back(ms(end - to_present[i].first));
+                    else to_present[kept++] = to_present[i];
+                }
+                to_present.resize(kept);
+                break;
+            }
+            case TRACE_WAIT:
+                wait_ends.push_back(end);
+                break;
+            case TRACE_AUDIO_WRITE:
+                audio_writes.push_back(rec.ns);
+                break;
+            case TRACE_AUDIO_UNDERRUN:
+                underruns++;
+                break;
+            case TRACE_AUDIO_DROPPED:
+                dropped += rec.arg;
+                break;
+        }
+    }
+
+    const std::vector<double> frame_intervals = intervals(wait_ends);
+    summary->frame_interval = percentiles(frame_intervals);
+    for (double interval : frame_intervals) frame_jitter.push_back(fabs(interval - summary->frame_interval.p50));
+    summary->key_to_input = percentiles(key_to_input);
+    summary->key_to_submit = percentiles(key_to_submit);
+    summary->key_to_present = percentiles(key_to_present);
+    summary->frame_jitter = percentiles(frame_jitter);
+    summary->tick_interval = percentiles(intervals(ticks));
+    summary->present = percentiles(present);
+    summary->audio_interval = percentiles(intervals(audio_writes));
+    summary->audio_underruns = underruns;
+    summary->audio_dropped = dropped;
+    summary->events = records.size();
+    summary->lost = lost;
+}
+
+bool trace_write_json(const char *path) {
+    uint64_t lost;
+    const std::vector<TraceRecord> records = collect(&lost);
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (const TraceRing *r : rings) {
+            fprintf(file, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", r->thread, r->name);
+            first = false;
+        }
+    }
+    // Chrome wants microseconds; start the timeline at the first event.
+    const uint64_t base = records.empty() ? 0 : records[0].ns;
+    for (const TraceRecord &rec : records) {
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"chip8\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,", first ? "" : ",\n",
+                event_names[rec.event], rec.thread, (rec.ns - base) * 1e-3);
+        first = false;
+        if (is_span[rec.event]) {
+            fprintf(file, "\"ph\":\"X\",\"dur\":%.3f", rec.duration * 1e-3);
+        }
+        else {
+            fprintf(file, "\"ph\":\"i\",\"s\":\"t\"");
+        }
+        if (arg_names[rec.event]) fprintf(file, ",\"args\":{\"%s\":%llu}", arg_names[rec.event], (unsigned long long)rec.arg);
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n]}\n");
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+// Pipeline tracing: key changes, the frame that first runs with them, screen
+// submission, presentation and audio writes, stamped with a monotonic clock
+// into a ring buffer per thread. Recording an event is a clock read and a
+// store into memory only its thread writes; while tracing is off it is a
+// relaxed load and a branch, so it can stay compiled in and be switched on in
+// the field. A thread's ring is allocated on its first event, keeps its last
+// TRACE_RING_SIZE events and outlives the thread.
+//
+// Key latency is followed at frame granularity: a key change counts as read
+// by the first run that sees it (the instruction that tests it is somewhere in
+// that run), and as shown by the first present of a screen submitted after it.
+
+#define TRACE_RING_SIZE 65536 // events per thread, a power of two
+
+enum TraceEvent {
+    TRACE_KEY, // instant: the host's key state changed, arg = key mask
+    TRACE_INPUT, // instant: the next run is the first with a new key state, arg = key mask
+    TRACE_RUN, // span: the emulation ran, arg = frame number after it; runs that advance it ended on a timer tick
+    TRACE_SUBMIT, // instant: a changed screen went to the renderer, arg = frame number
+    TRACE_PRESENT, // span: the render sink presented a screen, arg = its frame number
+    TRACE_WAIT, // span: the host loop waited for its next frame
+    TRACE_AUDIO_WRITE, // span: the synth handed samples to its sink, arg = count
+    TRACE_AUDIO_UNDERRUN, // instant: the audio device had run out of samples
+    TRACE_AUDIO_DROPPED, // instant: samples did not fit into the device buffer, arg = count
+    TRACE_NUM_EVENTS
+};
+
+// Nanoseconds on the clock events are stamped with.
+uint64_t trace_now();
+// Tracing is off at startup. Turning it on does not clear earlier events.
+void trace_enable(bool on);
+bool trace_enabled();
+// Names the calling thread in exported traces. name must stay valid.
+void trace_thread_name(const char *name);
+
+void trace_instant(TraceEvent event, uint64_t arg);
+// Start of a span: trace_now(), or 0 while tracing is off.
+uint64_t trace_begin();
+// Records a span from `start` to now, unless start is 0.
+void trace_span(TraceEvent event, uint64_t start, uint64_t arg);
+
+// Distribution of a measured interval, in milliseconds.
+struct TracePercentiles {
+    uint64_t count;
+    double p50;
+    double p99;
+    double max;
+};
+
+struct TraceSummary {
+    TracePercentiles key_to_input; // key change to the run that reads it
+    TracePercentiles key_to_submit; // to the end of the first run after it that changed the screen
+    TracePercentiles key_to_present; // to the end of that screen's present
+    TracePercentiles frame_interval; // between the ends of host loop waits
+    TracePercentiles frame_jitter; // |frame_interval - its median|
+    TracePercentiles tick_interval; // between timer ticks, host time
+    TracePercentiles present; // how long a present took
+    TracePercentiles audio_interval; // between audio writes
+    uint64_t audio_underruns;
+    uint64_t audio_dropped; // samples
+    uint64_t events;
+    uint64_t lost; // overwritten before they could be read
+};
+
+// Both read every thread's ring; call them while the traced threads are
+// stopped or idle, e.g. after shutting down the renderer and synth.
+void trace_summarize(TraceSummary *summary);
+// Chrome trace-event JSON, as chrome://tracing and Perfetto load it. Returns
+// false if the file cannot be written.
+bool trace_write_json(const char *path);